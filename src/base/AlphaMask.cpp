@@ -0,0 +1,161 @@
+#include "AlphaMask.hpp"
+
+#include "gui/Image.hpp"
+
+#include <cmath>
+#include <iostream>
+
+
+namespace FW
+{
+    void AlphaMaskCache::clear()
+    {
+        m_triangles = nullptr;
+        m_masks.clear();
+        m_triMask.clear();
+        m_opaque.clear();
+        m_maskOfImage.clear();
+        m_numMasked = 0;
+    }
+
+    void AlphaMaskCache::build(const std::vector<RTTriangle>& triangles, int maxResolution)
+    {
+        clear();
+
+        m_triangles = &triangles;
+        m_triMask.resize(triangles.size(), -1);
+        m_opaque.resize(triangles.size(), 1);
+
+        for (size_t i = 0; i < triangles.size(); ++i)
+        {
+            const MeshBase::Material* mat = triangles[i].m_material;
+
+            if (!mat || !mat->textures[MeshBase::TextureType_Alpha].exists())
+            {
+                continue;
+            }
+
+            // materials sharing an alpha texture share the mask
+            const Image* image = mat->textures[MeshBase::TextureType_Alpha].getImage();
+            auto it = m_maskOfImage.find(image);
+            int maskIdx = it != m_maskOfImage.end() ? it->second : buildMask(*image, maxResolution);
+
+            m_triMask[i] = maskIdx;
+
+            if (!coversOnlyOpaque(m_masks[maskIdx], triangles[i]))
+            {
+                m_opaque[i] = 0;
+                ++m_numMasked;
+            }
+        }
+
+        std::cout << "Alpha masks: " << m_masks.size() << " textures, " << m_numMasked
+            << " of " << triangles.size() << " triangles need the alpha test" << std::endl;
+    }
+
+    int AlphaMaskCache::buildMask(const Image& image, int maxResolution)
+    {
+        Mask mask;
+        Vec2i srcSize = image.getSize();
+        mask.size = Vec2i(FW::min(srcSize.x, maxResolution), FW::min(srcSize.y, maxResolution));
+        mask.bits.resize((mask.size.x * mask.size.y + 31) / 32, 0);
+        mask.solidBits.resize(mask.bits.size(), 0);
+
+        // Each mask texel averages the alpha of the source texels it covers, and is solid if none of them is cut out.
+        for (int y = 0; y < mask.size.y; ++y)
+        {
+            int y0 = y * srcSize.y / mask.size.y;
+            int y1 = FW::max(y0 + 1, (y + 1) * srcSize.y / mask.size.y);
+
+            for (int x = 0; x < mask.size.x; ++x)
+            {
+                int x0 = x * srcSize.x / mask.size.x;
+                int x1 = FW::max(x0 + 1, (x + 1) * srcSize.x / mask.size.x);
+
+                float alpha = 0.f;
+                float minAlpha = 1.f;
+                for (int sy = y0; sy < y1; ++sy)
+                    for (int sx = x0; sx < x1; ++sx)
+                    {
+                        float a = image.getVec4f(Vec2i(sx, sy)).y;
+                        alpha += a;
+                        minAlpha = FW::min(minAlpha, a);
+                    }
+
+                if (alpha > 0.5f * (x1 - x0) * (y1 - y0))
+                {
+                    mask.set(x, y);
+                }
+
+                if (minAlpha > 0.5f)
+                {
+                    mask.setSolid(x, y);
+                }
+            }
+        }
+
+        int maskIdx = (int)m_masks.size();
+        m_masks.push_back(mask);
+        m_maskOfImage[&image] = maskIdx;
+
+        return maskIdx;
+    }
+
+    bool AlphaMaskCache::coversOnlyOpaque(const Mask& mask, const RTTriangle& tri) const
+    {
+        // Conservative: every texel of the UV bounding box of the triangle has to be solid, i.e. opaque in all
+        // of the source texels it stands for, not just on average.
+        Vec2f lo = FW::min(tri.m_vertices[0].t, tri.m_vertices[1].t, tri.m_vertices[2].t);
+        Vec2f hi = FW::max(tri.m_vertices[0].t, tri.m_vertices[1].t, tri.m_vertices[2].t);
+
+        int x0 = (int)std::floor(lo.x * mask.size.x), x1 = (int)std::floor(hi.x * mask.size.x);
+        int y0 = (int)std::floor(lo.y * mask.size.y), y1 = (int)std::floor(hi.y * mask.size.y);
+
+        // footprints wrapping around the texture more than once cover all of it
+        x1 = FW::min(x1, x0 + mask.size.x - 1);
+        y1 = FW::min(y1, y0 + mask.size.y - 1);
+
+        for (int y = y0; y <= y1; ++y)
+        {
+            int wy = ((y % mask.size.y) + mask.size.y) % mask.size.y;
+
+            for (int x = x0; x <= x1; ++x)
+            {
+                int wx = ((x % mask.size.x) + mask.size.x) % mask.size.x;
+
+                if (!mask.getSolid(wx, wy))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    bool AlphaMaskCache::isOpaque(int triIdx, float u, float v) const
+    {
+        if (m_opaque[triIdx])
+        {
+            return true;
+        }
+
+        const RTTriangle& tri = (*m_triangles)[triIdx];
+        const Mask& mask = m_masks[m_triMask[triIdx]];
+
+        Vec2f uv = (1.f - u - v) * tri.m_vertices[0].t + u * tri.m_vertices[1].t + v * tri.m_vertices[2].t;
+
+        // wrap like GL_REPEAT
+        float fx = uv.x - std::floor(uv.x);
+        float fy = uv.y - std::floor(uv.y);
+        int x = FW::min(int(fx * mask.size.x), mask.size.x - 1);
+        int y = FW::min(int(fy * mask.size.y), mask.size.y - 1);
+
+        return mask.get(x, y);
+    }
+
+    bool AlphaMaskCache::alphaTest(const void* userData, int triIdx, float u, float v)
+    {
+        return static_cast<const AlphaMaskCache*>(userData)->isOpaque(triIdx, u, v);
+    }
+}
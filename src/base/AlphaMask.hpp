@@ -0,0 +1,58 @@
+#pragma once
+
+
+#include "RTTriangle.hpp"
+
+#include <vector>
+#include <unordered_map>
+
+
+namespace FW
+{
+    // Binary coverage masks of the alpha textures at reduced resolution, for alpha-tested ray tracing.
+    // A texel is opaque where the texture's alpha (green channel, as in the GL shader) exceeds 0.5.
+    // Triangles whose UV footprint only covers opaque texels, and triangles without an alpha texture,
+    // are flagged opaque so the tracer can skip the lookup for them entirely.
+    class AlphaMaskCache
+    {
+    public:
+        AlphaMaskCache() : m_triangles(nullptr), m_numMasked(0) {}
+
+        void build(const std::vector<RTTriangle>& triangles, int maxResolution = 256);
+        void clear();
+
+        // Per-triangle flags, 1 for triangles that never need the alpha lookup.
+        const U8* getOpaqueFlags() const { return m_opaque.empty() ? nullptr : &m_opaque[0]; }
+
+        bool isOpaque(int triIdx, float u, float v) const;
+
+        // AlphaTestFunc for RayTracer::setAlphaTest; userData is the AlphaMaskCache.
+        static bool alphaTest(const void* userData, int triIdx, float u, float v);
+
+        int getNumMasks() const { return (int)m_masks.size(); }
+        int getNumMaskedTriangles() const { return m_numMasked; }
+
+    private:
+        struct Mask
+        {
+            Vec2i size;
+            std::vector<U32> bits;      // the average alpha of the covered source texels exceeds 0.5; for the per-hit lookups
+            std::vector<U32> solidBits; // every covered source texel does; for the conservative opaque flags
+
+            bool get(int x, int y) const { int i = y * size.x + x; return (bits[i >> 5] >> (i & 31)) & 1; }
+            void set(int x, int y) { int i = y * size.x + x; bits[i >> 5] |= 1u << (i & 31); }
+            bool getSolid(int x, int y) const { int i = y * size.x + x; return (solidBits[i >> 5] >> (i & 31)) & 1; }
+            void setSolid(int x, int y) { int i = y * size.x + x; solidBits[i >> 5] |= 1u << (i & 31); }
+        };
+
+        int buildMask(const Image& image, int maxResolution);
+        bool coversOnlyOpaque(const Mask& mask, const RTTriangle& tri) const;
+
+        const std::vector<RTTriangle>* m_triangles;
+        std::vector<Mask> m_masks;
+        std::vector<int> m_triMask;     // mask index per triangle, -1 if it has no alpha texture
+        std::vector<U8> m_opaque;
+        std::unordered_map<const Image*, int> m_maskOfImage;
+        int m_numMasked;
+    };
+}
@@ -9,6 +9,8 @@
 #include "base/Random.hpp"
 
 #include "RayTracer.hpp"
+#include "BvhTuner.hpp"
+#include "Benchmarks.hpp"
 #include "rtlib.hpp"
 
 #include <stdio.h>
@@ -36,6 +38,39 @@ App::App(std::vector<std::string>& cmd_args)
     m_cameraCtrl(&m_commonCtrl, CameraControls::Feature_Default | CameraControls::Feature_StereoControls),
     m_action(Action_None),
     m_cullMode(CullMode_None),
+    m_shadingMode(ShadingMode_ShadowMaps),
+    m_emissionSampler(SamplerType_Sobol),
+    m_sceneVersion(0),
+    m_mainShadowLightVersion(0),
+    m_mainShadowSceneVersion(0),
+    m_mainShadowValid(false),
+    m_softwareShadowMaps(false),
+    m_useShadowAtlas(false),
+    m_adaptiveShadowMaps(false),
+    m_shadowTexelBudgetLevel(22),
+    m_shadowAtlasTexels(0),
+    m_shadowGeometryVersion(0),
+    m_shadowGeometryValid(false),
+    m_cullShadowGeometry(false),
+    m_shadowCullerVersion(0),
+    m_shadowCullerValid(false),
+    m_useShadowLod(false),
+    m_shadowLodTexelError(1.0f),
+    m_shadowLodVersion(0),
+    m_shadowLodValid(false),
+    m_paraboloidShadowMaps(false),
+    m_shadowFilter(ShadowFilter_None),
+    m_shadowBlurRadius(2),
+    m_shadowSoftness(0.0f),
+    m_deferredIndirect(false),
+    m_tiledLightCulling(false),
+    m_lightCullThreshold(0.001f),
+    m_lightTileSizeLevel(4),
+    m_tileLightsReported(-1.0f),
+    m_scenePointsVersion(0),
+    m_scenePointsValid(false),
+    m_ismResolutionLevel(5),
+    m_ismPointsLevel(11),
     m_numHemisphereRays(256),
     m_lightSize(0.25f),
     m_toneMapWhite(1.0f),
@@ -53,6 +88,7 @@ App::App(std::vector<std::string>& cmd_args)
     m_commonCtrl.addButton((S32*)&m_action, Action_ReloadMesh, FW_KEY_F5, "Reload mesh (F5)");
     m_commonCtrl.addButton((S32*)&m_action, Action_SaveMesh, FW_KEY_O, "Save mesh... (O)");
     m_commonCtrl.addButton((S32*)&m_action, Action_LoadBVH, FW_KEY_NONE, "Load BVH from file...");
+    m_commonCtrl.addButton((S32*)&m_action, Action_TuneBvh, FW_KEY_NONE, "Tune BVH builder for this scene");
     m_commonCtrl.addSeparator();
 
     m_commonCtrl.addButton((S32*)&m_action, Action_ResetCamera, FW_KEY_NONE, "Reset camera");
@@ -88,12 +124,54 @@ App::App(std::vector<std::string>& cmd_args)
 
     m_commonCtrl.addButton((S32*)&m_action, Action_PlaceLightSourceAtCamera, FW_KEY_SPACE, "Place light at camera (SPACE)");
 
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_ShadowMaps, FW_KEY_NONE, "Shade with shadow maps (GL)");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_BruteForce, FW_KEY_NONE, "Shade on CPU, all VPLs");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_Lightcuts, FW_KEY_NONE, "Shade on CPU, Lightcuts");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_RowColumn, FW_KEY_NONE, "Shade on CPU, row-column sampling");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_StochasticTree, FW_KEY_NONE, "Shade on CPU, stochastic light tree (progressive)");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_ImperfectShadowMaps, FW_KEY_NONE, "Shade on CPU, imperfect shadow maps");
+    m_commonCtrl.addToggle((S32*)&m_shadingMode, ShadingMode_Deferred, FW_KEY_NONE, "Shade on CPU, deferred tiles with rasterized shadow maps");
+    m_commonCtrl.addButton((S32*)&m_action, Action_BenchmarkManyLights, FW_KEY_NONE, "Benchmark CPU many-light shading");
+    m_commonCtrl.addButton((S32*)&m_action, Action_BenchmarkSamplers, FW_KEY_NONE, "Benchmark VPL emission samplers");
+    m_commonCtrl.addSeparator();
+
+    m_commonCtrl.addToggle((S32*)&m_emissionSampler, SamplerType_Random, FW_KEY_NONE, "Emit VPLs with random rejection sampling");
+    m_commonCtrl.addToggle((S32*)&m_emissionSampler, SamplerType_Halton, FW_KEY_NONE, "Emit VPLs with scrambled Halton points");
+    m_commonCtrl.addToggle((S32*)&m_emissionSampler, SamplerType_Sobol, FW_KEY_NONE, "Emit VPLs with scrambled Sobol points");
+    m_commonCtrl.addSeparator();
+
     m_commonCtrl.addToggle(&m_renderFromLight, FW_KEY_NONE, "Render from light source view");
     m_commonCtrl.addToggle(&m_visualizeLight, FW_KEY_NONE, "Visualize main light source");
     m_commonCtrl.addToggle(&m_visualizeIndirect, FW_KEY_NONE, "Visualize indirect light sources");
+    m_commonCtrl.addToggle(&m_incrementalVpls, FW_KEY_NONE, "Update indirect lights incrementally when the light moves");
+    m_commonCtrl.addToggle(&m_cameraResampling, FW_KEY_NONE, "Resample indirect lights by their contribution to the view");
+    m_commonCtrl.addToggle(&m_softwareShadowMaps, FW_KEY_NONE, "Rasterize indirect light shadow maps on the CPU");
+    m_commonCtrl.addToggle(&m_useShadowAtlas, FW_KEY_NONE, "Pack indirect light shadow maps into an atlas and shade them in batches");
+    m_commonCtrl.addToggle(&m_adaptiveShadowMaps, FW_KEY_NONE, "Size indirect light shadow maps by importance (uses the atlas)");
+    m_commonCtrl.addToggle(&m_cullShadowGeometry, FW_KEY_NONE, "Cull shadow map geometry to the light frustum with the BVH");
+    m_commonCtrl.addToggle(&m_useShadowLod, FW_KEY_NONE, "Render indirect light shadow maps from simplified geometry");
+    m_commonCtrl.addToggle(&m_paraboloidShadowMaps, FW_KEY_NONE, "Paraboloid indirect light shadow maps over the whole hemisphere (half resolution)");
+    m_commonCtrl.addToggle((S32*)&m_shadowFilter, ShadowFilter_None, FW_KEY_NONE, "Indirect light shadows with depth comparisons");
+    m_commonCtrl.addToggle((S32*)&m_shadowFilter, ShadowFilter_Exponential, FW_KEY_NONE, "Indirect light shadows with prefiltered exponential shadow maps (no atlas)");
+    m_commonCtrl.addToggle((S32*)&m_shadowFilter, ShadowFilter_Variance, FW_KEY_NONE, "Indirect light shadows with prefiltered variance shadow maps (no atlas)");
+    m_commonCtrl.addToggle(&m_deferredIndirect, FW_KEY_NONE, "Accumulate indirect lights over a G-buffer (deferred)");
+    m_commonCtrl.addToggle(&m_tiledLightCulling, FW_KEY_NONE, "Cull indirect lights per screen tile in deferred shading");
     m_commonCtrl.beginSliderStack();
     m_commonCtrl.addSlider(&m_smResolutionLevel, 1, 11, false, FW_KEY_NONE, FW_KEY_NONE, "Shadow map resolution= 2^%d");
+    m_commonCtrl.addSlider(&m_shadowTexelBudgetLevel, 16, 26, false, FW_KEY_NONE, FW_KEY_NONE, "Adaptive shadow map texel budget= 2^%d");
+    m_commonCtrl.addSlider(&m_shadowLodTexelError, 0.25f, 16.0f, true, FW_KEY_NONE, FW_KEY_NONE, "Shadow map simplification error= %.2f texels");
+    m_commonCtrl.addSlider(&m_shadowBlurRadius, 0, 8, false, FW_KEY_NONE, FW_KEY_NONE, "Prefiltered shadow map blur radius= %d texels");
+    m_commonCtrl.addSlider(&m_shadowSoftness, 0.0f, 4.0f, false, FW_KEY_NONE, FW_KEY_NONE, "Prefiltered shadow map softness= %.2f mip levels");
+    m_commonCtrl.addSlider(&m_lightCullThreshold, 0.00001f, 1.0f, true, FW_KEY_NONE, FW_KEY_NONE, "Light culling contribution threshold= %g");
+    m_commonCtrl.addSlider(&m_lightTileSizeLevel, 3, 7, false, FW_KEY_NONE, FW_KEY_NONE, "Light culling tile size= 2^%d pixels");
     m_commonCtrl.addSlider(&m_num_indirect, 0, 256, false, FW_KEY_NONE, FW_KEY_NONE, "Number of indirect lights= %d");
+    m_commonCtrl.addSlider(&m_numIndirectCpu, 0, 4096, false, FW_KEY_NONE, FW_KEY_NONE, "Number of indirect lights on the CPU= %d");
+    m_commonCtrl.addSlider(&m_numBounces, 1, 8, false, FW_KEY_NONE, FW_KEY_NONE, "Indirect bounces= %d");
+    m_commonCtrl.addSlider(&m_vplUpdateBudget, 1, 256, true, FW_KEY_NONE, FW_KEY_NONE, "Light paths retraced per frame= %d");
+    m_commonCtrl.addSlider(&m_vplOversampling, 1, 16, false, FW_KEY_NONE, FW_KEY_NONE, "Candidate indirect lights per slot= %d");
+    m_commonCtrl.addSlider(&m_lightSamplesPerPixel, 1, 64, false, FW_KEY_NONE, FW_KEY_NONE, "Light tree samples per pixel= %d");
+    m_commonCtrl.addSlider(&m_ismResolutionLevel, 3, 7, false, FW_KEY_NONE, FW_KEY_NONE, "Imperfect shadow map resolution= 2^%d");
+    m_commonCtrl.addSlider(&m_ismPointsLevel, 8, 14, false, FW_KEY_NONE, FW_KEY_NONE, "Imperfect shadow map points= 2^%d");
     m_commonCtrl.addSlider(&m_indirectFOV, 1.0f, 180.0f, false, FW_KEY_NONE, FW_KEY_NONE, "Indirect light FOV= %f");
     m_commonCtrl.addSlider(&m_shadowMapVisMultiplier, 0.00001f, 10.0f, true, FW_KEY_NONE, FW_KEY_NONE, "Shadow map visualization intensity= %f");
     m_commonCtrl.endSliderStack();
@@ -116,11 +194,15 @@ App::App(std::vector<std::string>& cmd_args)
     m_visualizeLight = true;
     m_visualizeIndirect = false;
     m_renderFromLight = false;
-    m_instantRadiosity.setup(m_window.getGL(), Vec2i(256, 256));
-
-    m_smcontext.setup(Vec2i(1024, 1024));
     m_lightFOV = 80;
     m_num_indirect = 81;
+    m_numIndirectCpu = 81;
+    m_numBounces = 1;
+    m_incrementalVpls = true;
+    m_vplUpdateBudget = 16;
+    m_cameraResampling = false;
+    m_vplOversampling = 4;
+    m_lightSamplesPerPixel = 4;
     m_shadowMapVisMultiplier = 0.00001;
     m_smResolutionLevel = 9;
     m_smResolutionLevelPrev = 9;
@@ -129,7 +211,19 @@ App::App(std::vector<std::string>& cmd_args)
 
     process_args(cmd_args);
 
+    // -cpu_render has to run on machines without a GPU, so it never calls getGL(): the window stays hidden,
+    // and only the state, the scene and its BVH are loaded before rendering and closing.
+    if (isHeadless())
+    {
+        m_window.setVisible(false);
+        m_commonCtrl.loadState(m_commonCtrl.getStateFileName(1));
+        renderHeadless();
+        m_window.requestClose();
+        return;
+    }
 
+    m_instantRadiosity.setup(m_window.getGL(), Vec2i(256, 256));
+    m_smcontext.setup(Vec2i(1024, 1024));
 
     m_commonCtrl.loadState(m_commonCtrl.getStateFileName(1));
     m_timer.start();
@@ -148,8 +242,11 @@ int find_argument(std::string needle, std::vector<std::string> haystack) {
 void App::process_args(std::vector<std::string>& args) {
 
     // all of the possible cmd arguments and the corresponding enums (enum value is the index of the string in the vector)
-    const std::vector<std::string> argument_names = { "-builder", "-spp", "-output_images", "-use_textures", "-bat_render", "-aa", "-ao", "-ao_length" };
-    enum argument { arg_not_found = -1, builder = 0, spp = 1, output_images = 2, use_textures = 3, bat_render = 4, AA = 5, AO = 6, AO_length = 7 };
+    const std::vector<std::string> argument_names = { "-builder", "-spp", "-output_images", "-use_textures", "-bat_render", "-aa", "-ao", "-ao_length", "-tune_bvh", "-benchmark", "-watertight", "-cpu_render", "-cpu_size", "-cpu_threads", "-cpu_shadow_filter" };
+    enum argument { arg_not_found = -1, builder = 0, spp = 1, output_images = 2, use_textures = 3, bat_render = 4, AA = 5, AO = 6, AO_length = 7, tune_bvh = 8, benchmark = 9, watertight = 10, cpu_render = 11, cpu_size = 12, cpu_threads = 13, cpu_shadow_filter = 14 };
+
+    // and the shadow map filters of the CPU render
+    const std::vector<std::string> filter_names = { "none", "esm", "vsm" };
 
     // similarly a list of the implemented BVH builder types
     const std::vector<std::string> builder_names = { "none", "sah", "object_median", "spatial_median", "linear" };
@@ -162,6 +259,13 @@ void App::process_args(std::vector<std::string>& args) {
     m_settings.ao_length = 1.0f;
     m_settings.spp = 1;
     m_settings.splitMode = SplitMode_Sah;
+    m_settings.tune_bvh = false;
+    m_settings.benchmark = false;
+    m_settings.intersectMode = IntersectMode_Woop;
+    m_settings.cpu_render_file.clear();
+    m_settings.cpu_render_size = Vec2i(0, 0);
+    m_settings.cpu_render_threads = 0;
+    m_settings.cpu_shadow_filter = ShadowFilter_None;
 
     for (unsigned i = 0; i < args.size(); ++i) {
 
@@ -200,6 +304,44 @@ void App::process_args(std::vector<std::string>& args) {
             m_settings.ao_length = std::stof(args[i]);
             break;
 
+        case tune_bvh:
+            m_settings.tune_bvh = true;
+            break;
+
+        case benchmark:
+            m_settings.benchmark = true;
+            break;
+
+        case watertight:
+            m_settings.intersectMode = IntersectMode_Watertight;
+            break;
+
+        case cpu_render:
+            ++i;
+            m_settings.cpu_render_file = args[i];
+            break;
+
+        case cpu_size:
+            i += 2;
+            m_settings.cpu_render_size = Vec2i(std::stoi(args[i - 1]), std::stoi(args[i]));
+            break;
+
+        case cpu_threads:
+            ++i;
+            m_settings.cpu_render_threads = std::stoi(args[i]);
+            break;
+
+        case cpu_shadow_filter: {
+            ++i;
+            int filter = find_argument(args[i], filter_names);
+            if (filter < 0) {
+                filter = ShadowFilter_None;
+                std::cout << "Shadow filter not recognized, tracing shadow rays" << std::endl;
+            }
+            m_settings.cpu_shadow_filter = ShadowFilter(filter);
+            break;
+        }
+
         case builder: {
 
             ++i;
@@ -251,7 +393,8 @@ void App::process_args(std::vector<std::string>& args) {
 
 App::~App()
 {
-    deleteRenderToTexture();
+    if (!isHeadless())
+        deleteRenderToTexture();
 }
 
 //------------------------------------------------------------------------
@@ -265,6 +408,10 @@ bool App::handleEvent(const Window::Event& ev)
         return true;
     }
 
+    // the hidden window of -cpu_render only waits for the close it requested
+    if (isHeadless())
+        return false;
+
     if (ev.type == Window::EventType_Resize)
     {
         // Need to reallocate the RTT textures and buffers.
@@ -441,11 +588,45 @@ bool App::handleEvent(const Window::Event& ev)
         m_lightSource->setPosition(m_cameraCtrl.getPosition());
         m_commonCtrl.message("Placed light at camera");
         break;
+    case Action_TuneBvh:
+        if (m_mesh)
+        {
+            m_window.showModalMessage("Tuning BVH builder...");
+            tuneTracer();
+            attachAlphaMasks();
+            m_commonCtrl.message("BVH builder tuned");
+        }
+        break;
+    case Action_BenchmarkManyLights:
+        if (m_mesh)
+        {
+            m_window.showModalMessage("Benchmarking many-light shading...");
+            benchmarkManyLights();
+        }
+        break;
+    case Action_BenchmarkSamplers:
+        if (m_rt && m_mesh)
+        {
+            m_window.showModalMessage("Benchmarking VPL emission samplers...");
+
+            // a small view keeps the thousands of VPLs of the reference affordable
+            GLContext* gl = m_window.getGL();
+            Mat4f projection = gl->xformFitToView(Vec2f(-1.0f, -1.0f), Vec2f(2.0f, 2.0f)) * m_cameraCtrl.getCameraToClip();
+            Vec2i size = gl->getViewSize() / 8;
+
+            m_gbuffer.build(*m_rt, projection * m_cameraCtrl.getWorldToCamera(), size);
+            benchmarkEmissionSamplers(*m_rt, m_gbuffer, *m_lightSource, m_indirectFOV, m_numBounces);
+        }
+        break;
     default:
         FW_ASSERT(false);
         break;
     }
 
+    // Actions that edit the mesh invalidate the cached VPLs and shadow maps.
+    if (action >= Action_NormalizeScale && action <= Action_ChopBehindNear)
+        ++m_sceneVersion;
+
     if (ev.type == Window::EventType_KeyUp)
     {
     }
@@ -523,20 +704,106 @@ void App::renderFrame(GLContext* gl)
     m_lightSource->setFOV(m_lightFOV);
     m_lightSource->setEmission(Vec3f(m_lightIntensity));
     m_instantRadiosity.setFOV(m_indirectFOV);
+    m_instantRadiosity.setNumBounces(m_numBounces);
+    m_instantRadiosity.setIncremental(m_incrementalVpls);
+    m_instantRadiosity.setUpdateBudget(m_vplUpdateBudget);
+    m_instantRadiosity.setEmissionSampler(m_emissionSampler);
+    m_instantRadiosity.setCameraResampling(m_cameraResampling);
+    m_instantRadiosity.setOversampling(m_vplOversampling);
+    m_instantRadiosity.setUseAtlas(m_useShadowAtlas || m_adaptiveShadowMaps);
+    m_instantRadiosity.setAdaptiveResolution(m_adaptiveShadowMaps);
+    m_instantRadiosity.setTexelBudget(S64(1) << m_shadowTexelBudgetLevel);
+    m_instantRadiosity.setParaboloid(m_paraboloidShadowMaps);
+    m_instantRadiosity.setShadowFilter(getShadowFilterSettings(m_shadowFilter), getSceneExtent());
+
+    // A paraboloid map matches the texel density of the 150 degree frustum at half its resolution.
+    int smResolutionLevel = FW::max(1, m_smResolutionLevel - (m_paraboloidShadowMaps ? 1 : 0));
+    m_instantRadiosity.setResolutionRange(16, 1 << smResolutionLevel);
+    m_instantRadiosity.setCameraView(gl->xformFitToView(Vec2f(-1.0f, -1.0f), Vec2f(2.0f, 2.0f)) * m_cameraCtrl.getCameraToClip() * m_cameraCtrl.getWorldToCamera());
 
     // Dumb hack, won't bother with callbacks or anything now:
     // If the user-set shadow map resolution has changed since last frame, reallocate everything.
-    if (m_smResolutionLevelPrev != m_smResolutionLevel)
-        m_instantRadiosity.setup(gl, Vec2i(1 << m_smResolutionLevel, 1 << m_smResolutionLevel));	// power-of-two trick
-    m_smResolutionLevelPrev = m_smResolutionLevel;
+    // With adaptive resolutions it's only the upper limit, and the atlas resizes just the maps it affects.
+    if (m_smResolutionLevelPrev != smResolutionLevel && !m_adaptiveShadowMaps)
+    {
+        m_instantRadiosity.setup(gl, Vec2i(1 << smResolutionLevel, 1 << smResolutionLevel));	// power-of-two trick
+        m_smResolutionLevelPrev = smResolutionLevel;
+    }
 
-    // Cast the indirect light sources from the main light source using the raytracer
-    m_instantRadiosity.castIndirect(m_rt.get(), m_mesh.get(), *m_lightSource, m_num_indirect);
+    // The CPU shading paths trace their own shadow rays and need no shadow maps.
+    bool cpuShading = m_shadingMode != ShadingMode_ShadowMaps && !m_renderFromLight;
 
-    // Render the shadow maps for all the indirect lights into an off-screen buffer
-    m_instantRadiosity.renderShadowMaps(m_mesh.get());
-    // Similarly, render the shadow map for the main light
-    m_lightSource->renderShadowMap(gl, m_mesh.get(), &m_smcontext);
+    // Cast the indirect light sources from the main light source using the raytracer. They are kept
+    // from the previous frame unless the light, the scene or the indirect light settings have changed,
+    // so that moving only the camera costs just the shading passes below. The GL paths render a shadow
+    // map and a pass per light, so they have a count of their own.
+    if (m_instantRadiosity.updateIndirect(m_rt.get(), m_mesh.get(), *m_lightSource, cpuShading ? m_numIndirectCpu : m_num_indirect, m_sceneVersion))
+        m_accumulation.reset();
+
+    if (!cpuShading)
+    {
+        ShadowCuller* culler = nullptr;
+        if (m_cullShadowGeometry && m_rt && m_mesh)
+        {
+            if (!m_shadowCullerValid || m_shadowCullerVersion != m_sceneVersion)
+            {
+                m_shadowCuller.build(*m_rt, *m_mesh);
+                m_shadowCullerVersion = m_sceneVersion;
+                m_shadowCullerValid = true;
+            }
+            culler = &m_shadowCuller;
+        }
+
+        // The simplified levels are built (or loaded from the cache next to the mesh) once per scene.
+        if (m_useShadowLod && m_mesh && (!m_shadowLodValid || m_shadowLodVersion != m_sceneVersion))
+        {
+            m_shadowLod.build(*m_mesh, getHierarchyCacheBase());
+            m_shadowLodVersion = m_sceneVersion;
+            m_shadowLodValid = true;
+        }
+        m_instantRadiosity.setShadowLod(m_useShadowLod && m_shadowLodValid ? &m_shadowLod : nullptr, m_shadowLodTexelError);
+
+        // Render the shadow maps for all the indirect lights into an off-screen buffer (if they changed)
+        if (m_softwareShadowMaps && m_mesh)
+        {
+            if (!m_shadowGeometryValid || m_shadowGeometryVersion != m_sceneVersion)
+            {
+                m_shadowGeometry.build(*m_mesh);
+                m_shadowGeometryVersion = m_sceneVersion;
+                m_shadowGeometryValid = true;
+            }
+
+            // cull the same faces as the GL pass: glFrontFace() is flipped when culling counter-clockwise faces
+            m_shadowRasterizer.setCullMode(m_cullMode == CullMode_CCW ? ShadowRasterizer::CullMode_Back : ShadowRasterizer::CullMode_Front);
+
+            Timer timer(true);
+            int numMaps = m_instantRadiosity.renderShadowMaps(m_shadowGeometry, m_shadowRasterizer, culler);
+            if (numMaps > 0)
+                m_commonCtrl.message(sprintf("Rasterized %d shadow maps on the CPU in %.1f ms", numMaps, timer.end() * 1000.0f), "shadowmaps");
+        }
+        else
+            m_instantRadiosity.renderShadowMaps(m_mesh.get(), culler);
+
+        const InstantRadiosity::ShadowStats& shadowStats = m_instantRadiosity.getShadowStats();
+        if ((culler || m_useShadowLod) && shadowStats.numMaps > 0)
+            m_commonCtrl.message(sprintf("Shadow maps drew %.0f of %d triangles per light on average, %d to %d",
+                double(shadowStats.triangles) / shadowStats.numMaps, m_mesh->numTriangles(), shadowStats.minTriangles, shadowStats.maxTriangles), "shadowculling");
+
+        if (m_adaptiveShadowMaps && m_shadowAtlasTexels != m_instantRadiosity.getAllocatedTexels())
+        {
+            m_shadowAtlasTexels = m_instantRadiosity.getAllocatedTexels();
+            m_commonCtrl.message(sprintf("Adaptive shadow maps use %.2f M of %.2f M texels", m_shadowAtlasTexels / 1048576.0, double(S64(1) << m_shadowTexelBudgetLevel) / 1048576.0), "shadowatlas");
+        }
+
+        // Similarly, render the shadow map for the main light
+        if (!m_mainShadowValid || m_mainShadowLightVersion != m_lightSource->getVersion() || m_mainShadowSceneVersion != m_sceneVersion)
+        {
+            m_lightSource->renderShadowMap(gl, m_mesh.get(), &m_smcontext, false, culler);
+            m_mainShadowLightVersion = m_lightSource->getVersion();
+            m_mainShadowSceneVersion = m_sceneVersion;
+            m_mainShadowValid = true;
+        }
+    }
 
     // We need to render the screen image into an off-screen floating point buffer, because 
     // we're accumulating very small values and they get rounded if we use a typical 8-bit
@@ -571,23 +838,64 @@ void App::renderFrame(GLContext* gl)
     }
 
 
-    // We first render the scene with the main light on; the additive blending is off at this point.
-    m_lightSource->renderShadowedScene(gl, m_mesh.get(), worldToCamera, projection, m_renderFromLight);
-
-    // Then loop through all the indirect lights and re-draw the scene with each of them individually.
-    // We use an additive blend mode, so that the light gets added on top. The end result will be an
-    // image with all the lights on.
-    for (int i = 0; i < m_instantRadiosity.getNumLights(); i++)
+    if (cpuShading)
     {
-        // Don't draw if the light is off (e.g. it flew outisde the scene)
-        if (!m_instantRadiosity.getLight(i).isEnabled())
-            continue;
-        glDepthFunc(GL_EQUAL);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_ONE, GL_ONE);
-        glDepthMask(GL_FALSE);
-
-        m_instantRadiosity.getLight(i).renderShadowedScene(gl, m_mesh.get(), worldToCamera, projection);
+        // The image is computed on the CPU and written straight into the render target texture.
+        shadeOnCpu(projection * worldToCamera, gl->getViewSize());
+    }
+    else
+    {
+        // We first render the scene with the main light on; the additive blending is off at this point.
+        m_lightSource->renderShadowedScene(gl, m_mesh.get(), worldToCamera, projection, m_renderFromLight);
+
+        // Then loop through all the indirect lights and re-draw the scene with each of them individually.
+        // We use an additive blend mode, so that the light gets added on top. The end result will be an
+        // image with all the lights on.
+        if (m_deferredIndirect && !m_renderFromLight)
+        {
+            // The scene is drawn once more into the G-buffer, and the lights are screen-space passes over it.
+            m_deferredGBuffer.render(gl, m_mesh.get(), worldToCamera, projection, gl->getViewSize());
+            if (m_tiledLightCulling)
+                m_deferredGBuffer.reduceTileDepths(gl, 1 << m_lightTileSizeLevel);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, m_rttFBO);
+            glDisable(GL_DEPTH_TEST);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glDepthMask(GL_FALSE);
+
+            float tileLights = m_instantRadiosity.renderIndirectDeferred(m_deferredGBuffer, worldToCamera, projection,
+                m_tiledLightCulling ? 1 << m_lightTileSizeLevel : 0, m_lightCullThreshold);
+            glEnable(GL_DEPTH_TEST);
+
+            if (m_tiledLightCulling && tileLights != m_tileLightsReported)
+            {
+                m_tileLightsReported = tileLights;
+                m_commonCtrl.message(sprintf("Tiled light culling: %.1f of %d indirect lights per tile", tileLights, m_instantRadiosity.getNumLights()), "tiledculling");
+            }
+        }
+        else if (m_instantRadiosity.getUseAtlas())
+        {
+            // a batch of lights per pass instead of one
+            glDepthFunc(GL_EQUAL);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glDepthMask(GL_FALSE);
+
+            m_instantRadiosity.renderIndirect(m_mesh.get(), worldToCamera, projection);
+        }
+        else for (int i = 0; i < m_instantRadiosity.getNumLights(); i++)
+        {
+            // Don't draw if the light is off (e.g. it flew outisde the scene)
+            if (!m_instantRadiosity.getLight(i).isEnabled())
+                continue;
+            glDepthFunc(GL_EQUAL);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glDepthMask(GL_FALSE);
+
+            m_instantRadiosity.getLight(i).renderShadowedScene(gl, m_mesh.get(), worldToCamera, projection);
+        }
     }
 
     // Reset the default state
@@ -821,8 +1129,14 @@ void App::loadMesh(const String& fileName)
 
     m_commonCtrl.message(sprintf("Loaded mesh from '%s'", fileName.getPtr()));
 
+    ++m_sceneVersion;
+
     // build the BVH!
     constructTracer();
+    attachAlphaMasks();
+
+    if (m_settings.benchmark)
+        runBenchmarks();
 }
 
 //------------------------------------------------------------------------
@@ -896,6 +1210,24 @@ void App::constructTracer()
 
     // construct a new ray tracer (deletes the old one if there was one)
     m_rt.reset(new RayTracer());
+    m_rt->setIntersectMode(m_settings.intersectMode);
+
+    std::string cacheBase = getHierarchyCacheBase();
+
+    // pick up builder parameters tuned earlier for this scene, if any
+    m_bvhParams = BvhBuildParams();
+    {
+        std::ifstream ifs(cacheBase + ".bvhparams", std::ios::binary);
+        if (ifs.good() && m_bvhParams.load(ifs))
+            ::printf("Loaded BVH builder parameters from %s.bvhparams\n", cacheBase.c_str());
+    }
+
+    if (m_settings.tune_bvh)
+    {
+        // tuning rebuilds the hierarchy with the winning parameters and refreshes the cache
+        tuneTracer();
+        return;
+    }
 
     // whether we want to try loading a saved hierarchy from disk
     bool tryLoadHierarchy = true;
@@ -907,16 +1239,7 @@ void App::constructTracer()
     if (tryLoadHierarchy)
     {
         // check if saved hierarchy exists
-
-        std::string meshName = m_meshFileName.getPtr();
-        std::string hierarchyName = meshName.substr(0, meshName.find_last_of("."));
-#ifdef _WIN64
-        hierarchyName += "_x64";
-#endif
-
-        hierarchyName += ".hierarchy";
-
-        String hierarchyCacheFile = hierarchyName.c_str();
+        String hierarchyCacheFile = (cacheBase + ".hierarchy").c_str();
 
         if (fileExists(hierarchyCacheFile.getPtr()))
         {
@@ -931,7 +1254,7 @@ void App::constructTracer()
             QueryPerformanceFrequency(&frequency);
             QueryPerformanceCounter(&start); // Start time stamp		
 
-            m_rt->constructHierarchy(m_rtTriangles, m_settings.splitMode);
+            m_rt->constructHierarchy(m_rtTriangles, m_settings.splitMode, m_bvhParams);
 
             QueryPerformanceCounter(&stop); // Stop time stamp
 
@@ -950,7 +1273,7 @@ void App::constructTracer()
         QueryPerformanceFrequency(&frequency);
         QueryPerformanceCounter(&start); // Start time stamp		
 
-        m_rt->constructHierarchy(m_rtTriangles, m_settings.splitMode);
+        m_rt->constructHierarchy(m_rtTriangles, m_settings.splitMode, m_bvhParams);
 
         QueryPerformanceCounter(&stop); // Stop time stamp
 
@@ -960,6 +1283,339 @@ void App::constructTracer()
 
 }
 
+// Sweeps the builder parameters on a sample of the rays this scene actually traces, i.e. rays
+// emitted by the main light and point-to-point visibility segments, and stores the winner next to
+// the hierarchy cache so that later loads of the scene use it automatically.
+void App::tuneTracer()
+{
+    if (!m_mesh || m_rtTriangles.empty())
+        return;
+
+    BvhTuner tuner(m_rtTriangles, m_settings.splitMode);
+
+    std::vector<Ray> lightRays;
+    sampleLightRays(*m_lightSource, 4096, lightRays);
+    tuner.addRays(lightRays);
+
+    Random rand(1234);
+    tuner.addSceneRays(16384, rand);
+
+    m_bvhParams = tuner.tune();
+
+    std::string cacheBase = getHierarchyCacheBase();
+    {
+        std::ofstream ofs(cacheBase + ".bvhparams", std::ios::binary);
+        m_bvhParams.save(ofs);
+        ::printf("Saved BVH builder parameters to %s.bvhparams\n", cacheBase.c_str());
+    }
+
+    // rebuild with the tuned parameters and replace the now stale cached hierarchy
+    m_rt.reset(new RayTracer());
+    m_rt->setIntersectMode(m_settings.intersectMode);
+    m_rt->constructHierarchy(m_rtTriangles, m_settings.splitMode, m_bvhParams);
+    m_rt->saveHierarchy((cacheBase + ".hierarchy").c_str(), m_rtTriangles);
+    ::printf("Saved hierarchy to %s.hierarchy\n", cacheBase.c_str());
+}
+
+void App::runBenchmarks()
+{
+    if (!m_rt)
+        return;
+
+    // same ray mix as the tuner: light rays and point-to-point visibility segments
+    std::vector<Ray> rays;
+    sampleLightRays(*m_lightSource, 4096, rays);
+
+    Random rand(1234);
+    sampleSceneSegments(m_rtTriangles, 16384, rand, rays);
+
+    benchmarkIntersectModes(*m_rt, m_rtTriangles, rays);
+}
+
+// Builds the alpha coverage masks for the current triangles and hooks them to the ray tracer.
+void App::attachAlphaMasks()
+{
+    if (!m_rt)
+        return;
+
+    m_alphaMasks.build(m_rtTriangles);
+    m_rt->setAlphaTest(&AlphaMaskCache::alphaTest, &m_alphaMasks, m_alphaMasks.getOpaqueFlags());
+}
+
+// Shades the view on the CPU with the selected many-light method and uploads the result into
+// the render target texture, from where blitRttToScreen() tone maps it like the GL result.
+void App::shadeOnCpu(const Mat4f& worldToClip, const Vec2i& size)
+{
+    m_gbuffer.build(*m_rt, worldToClip, size);
+
+    std::vector<Vpl> vpls;
+    collectVpls(m_instantRadiosity, vpls);
+    Vpl mainLight(*m_lightSource);
+
+    switch (m_shadingMode)
+    {
+    case ShadingMode_Lightcuts:
+        m_lightcuts.build(vpls);
+        m_lightcuts.shade(*m_rt, m_gbuffer, mainLight, m_cpuImage);
+        break;
+
+    case ShadingMode_RowColumn:
+        m_rowColumn.shade(*m_rt, m_gbuffer, mainLight, vpls, m_cpuImage);
+        break;
+
+    case ShadingMode_StochasticTree:
+    {
+        // Keep averaging frames for as long as the view and the lights stay put.
+        std::vector<float> key(worldToClip.getPtr(), worldToClip.getPtr() + 16);
+        key.insert(key.end(), { float(size.x), float(size.y), float(vpls.size()), float(m_lightSamplesPerPixel),
+            mainLight.position.x, mainLight.position.y, mainLight.position.z,
+            mainLight.normal.x, mainLight.normal.y, mainLight.normal.z,
+            mainLight.E.x, mainLight.E.y, mainLight.E.z, mainLight.cosHalfFov, m_indirectFOV, float(m_numBounces) });
+
+        if (key != m_accumulationKey)
+        {
+            m_accumulation.reset();
+            m_accumulationKey = key;
+        }
+
+        std::vector<Vec3f> frame;
+        m_stochasticTree.setSamplesPerPixel(m_lightSamplesPerPixel);
+        m_stochasticTree.build(vpls);
+        m_stochasticTree.shade(*m_rt, m_gbuffer, mainLight, m_accumulation.getNumFrames(), frame);
+        m_accumulation.add(frame);
+        m_accumulation.resolve(m_cpuImage);
+
+        m_commonCtrl.message(sprintf("Accumulated %d frames", m_accumulation.getNumFrames()), "accumulation");
+        break;
+    }
+
+    case ShadingMode_ImperfectShadowMaps:
+    {
+        // One point set for all the maps; each VPL splats its own window of it.
+        const int numScenePoints = 1 << 18;
+        if (!m_scenePointsValid || m_scenePointsVersion != m_sceneVersion)
+        {
+            std::string cacheFile = getHierarchyCacheBase() + ".ismpoints";
+            if (!m_scenePoints.load(cacheFile, numScenePoints))
+            {
+                m_scenePoints.build(*m_mesh, numScenePoints, 1234);
+                m_scenePoints.save(cacheFile);
+            }
+            m_scenePointsVersion = m_sceneVersion;
+            m_scenePointsValid = true;
+        }
+
+        m_ism.setResolution(1 << m_ismResolutionLevel);
+        m_ism.setPointsPerMap(1 << m_ismPointsLevel);
+        m_ism.render(m_scenePoints, vpls);
+        m_ism.shade(*m_rt, m_gbuffer, mainLight, m_cpuImage);
+
+        const ImperfectShadowMaps::Stats& stats = m_ism.getStats();
+        m_commonCtrl.message(sprintf("Imperfect shadow maps: %d maps of %d^2 texels, %d points each, %.1f ms",
+            stats.numMaps, m_ism.getResolution(), stats.pointsPerMap, stats.time * 1000.f), "ism");
+        break;
+    }
+
+    case ShadingMode_Deferred:
+    {
+        // Shadow maps from the software rasterizer instead of shadow rays: hard ones for the main light, and
+        // for the VPLs the filtering the shadow filter toggles select.
+        if (!m_shadowGeometryValid || m_shadowGeometryVersion != m_sceneVersion)
+        {
+            m_shadowGeometry.build(*m_mesh);
+            m_shadowGeometryVersion = m_sceneVersion;
+            m_shadowGeometryValid = true;
+        }
+        m_shadowRasterizer.setCullMode(m_cullMode == CullMode_CCW ? ShadowRasterizer::CullMode_Back : ShadowRasterizer::CullMode_Front);
+
+        Timer timer(true);
+        int resolution = 1 << FW::max(1, m_smResolutionLevel - (m_paraboloidShadowMaps ? 1 : 0));
+        std::vector<PrefilteredShadowMap> maps(1);
+        std::vector<PrefilteredShadowMap> vplMaps;
+        buildPrefilteredShadowMap(*m_lightSource, m_shadowGeometry, m_shadowRasterizer, 1024, getSceneExtent(), ShadowFilterSettings(), maps[0]);
+        buildPrefilteredShadowMaps(m_instantRadiosity, m_shadowGeometry, m_shadowRasterizer, resolution, getSceneExtent(),
+            getShadowFilterSettings(m_shadowFilter), vplMaps);
+        maps.insert(maps.end(), vplMaps.begin(), vplMaps.end());
+        float mapTime = timer.end();
+
+        // the main light is lights[0], like maps[0]
+        std::vector<Vpl> lights(1, mainLight);
+        lights.insert(lights.end(), vpls.begin(), vpls.end());
+        float tileLights = shadeDeferred(m_gbuffer, lights, maps, 1 << m_lightTileSizeLevel, m_tiledLightCulling ? m_lightCullThreshold : 0.f, m_cpuImage);
+
+        m_commonCtrl.message(sprintf("Deferred: %.1f of %d lights per tile over %d x %d pixels, shadow maps %.1f ms, shading %.1f ms",
+            tileLights, (int)lights.size(), size.x, size.y, mapTime * 1000.f, timer.end() * 1000.f), "deferred");
+        break;
+    }
+
+    default:
+        shadeBruteForce(*m_rt, m_gbuffer, mainLight, vpls, m_cpuImage);
+        break;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_rttTex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size.x, size.y, GL_RGB, GL_FLOAT, m_cpuImage.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GLContext::checkErrors();
+}
+
+// Renders the loaded state with CpuRenderer and writes the tone mapped image to the -cpu_render file.
+// Neither the VPLs nor the image touch OpenGL, and the constructor creates no GL context in this mode, so it
+// runs without graphics hardware.
+void App::renderHeadless()
+{
+    if (!m_rt || !m_mesh)
+    {
+        std::cout << "No scene loaded, nothing to render" << std::endl;
+        return;
+    }
+
+    Vec2i size = m_settings.cpu_render_size.min() > 0 ? m_settings.cpu_render_size : m_window.getSize();
+
+    // the same light settings renderFrame() applies
+    m_lightSource->setFOV(m_lightFOV);
+    m_lightSource->setEmission(Vec3f(m_lightIntensity));
+    m_instantRadiosity.setFOV(m_indirectFOV);
+    m_instantRadiosity.setNumBounces(m_numBounces);
+    m_instantRadiosity.setEmissionSampler(m_emissionSampler);
+    m_instantRadiosity.setParaboloid(m_paraboloidShadowMaps);
+    m_instantRadiosity.castIndirect(m_rt.get(), m_mesh.get(), *m_lightSource, m_numIndirectCpu);
+
+    std::vector<Vpl> vpls;
+    collectVpls(m_instantRadiosity, vpls);
+
+    Mat4f projection = Mat4f::fitToView(Vec2f(-1.0f, -1.0f), Vec2f(2.0f, 2.0f), Vec2f(size)) * m_cameraCtrl.getCameraToClip();
+
+    CpuRenderer renderer;
+    renderer.setNumThreads(m_settings.cpu_render_threads);
+
+    // The VPLs' visibility from prefiltered maps, rasterized at the resolution of the GL ones, instead of shadow rays.
+    std::vector<PrefilteredShadowMap> shadowMaps;
+    if (m_settings.cpu_shadow_filter != ShadowFilter_None)
+    {
+        Timer timer(true);
+        ShadowGeometry geometry;
+        geometry.build(*m_mesh);
+        int resolution = 1 << FW::max(1, m_smResolutionLevel - (m_paraboloidShadowMaps ? 1 : 0));
+        buildPrefilteredShadowMaps(m_instantRadiosity, geometry, m_shadowRasterizer, resolution, getSceneExtent(),
+            getShadowFilterSettings(m_settings.cpu_shadow_filter), shadowMaps);
+        renderer.setShadowMaps(&shadowMaps);
+
+        std::cout << "Prefiltered " << shadowMaps.size() << " shadow maps of " << resolution << "^2 texels in " << timer.end() * 1000.0f << " ms" << std::endl;
+    }
+    renderer.render(*m_rt, projection * m_cameraCtrl.getWorldToCamera(), size, Vpl(*m_lightSource), vpls, m_cpuImage);
+
+    const CpuRenderer::Stats& stats = renderer.getStats();
+    std::cout << "CPU render: " << size.x << "x" << size.y << " pixels, " << vpls.size() << " VPLs, "
+        << stats.numTiles << " tiles on " << stats.numThreads << " threads, " << stats.time * 1000.0 << " ms" << std::endl;
+
+    Image image(size, ImageFormat::R8_G8_B8);
+    tonemapReinhard(m_cpuImage, size, m_toneMapWhite, m_toneMapBoost, image);
+    exportImage(m_settings.cpu_render_file.c_str(), &image);
+
+    std::cout << "Wrote " << m_settings.cpu_render_file << std::endl;
+}
+
+// Shades the current view with every CPU many-light method and reports their cost and their
+// error against brute-force accumulation over all VPLs.
+void App::benchmarkManyLights()
+{
+    if (!m_rt)
+        return;
+
+    m_instantRadiosity.castIndirect(m_rt.get(), m_mesh.get(), *m_lightSource, m_numIndirectCpu);
+
+    GLContext* gl = m_window.getGL();
+    Mat4f projection = gl->xformFitToView(Vec2f(-1.0f, -1.0f), Vec2f(2.0f, 2.0f)) * m_cameraCtrl.getCameraToClip();
+    Vec2i size = gl->getViewSize();
+
+    Timer timer(true);
+    m_gbuffer.build(*m_rt, projection * m_cameraCtrl.getWorldToCamera(), size);
+    float gbufferTime = timer.end();
+
+    std::vector<Vpl> vpls;
+    collectVpls(m_instantRadiosity, vpls);
+    Vpl mainLight(*m_lightSource);
+
+    std::vector<Vec3f> reference, image;
+
+    timer.start();
+    shadeBruteForce(*m_rt, m_gbuffer, mainLight, vpls, reference);
+    float bruteForceTime = timer.end();
+
+    m_lightcuts.build(vpls);
+    float lightTreeTime = timer.end();
+    m_lightcuts.shade(*m_rt, m_gbuffer, mainLight, image);
+    float lightcutsTime = timer.end();
+
+    ::printf("Many-light shading, %d VPLs at %dx%d (G-buffer %.1f ms):\n", int(vpls.size()), size.x, size.y, gbufferTime * 1000.f);
+    ::printf("  brute force: %.1f ms, %d shadow rays/pixel\n", bruteForceTime * 1000.f, int(vpls.size()) + 1);
+    ::printf("  lightcuts:   %.1f ms (tree %.1f ms), cut %.1f, %.1f shadow rays/pixel, rel. RMS error %.4f\n",
+        lightcutsTime * 1000.f, lightTreeTime * 1000.f, m_lightcuts.getStats().averageCutSize,
+        m_lightcuts.getStats().averageShadowRays, relativeRmsError(image, reference));
+
+    m_rowColumn.shade(*m_rt, m_gbuffer, mainLight, vpls, image);
+    const RowColumnSampling::Stats& rc = m_rowColumn.getStats();
+    ::printf("  row-column:  %.1f ms (%d rows %.1f ms, clustering %.1f ms), %d clusters, rel. RMS error %.4f\n",
+        (rc.rowTime + rc.clusterTime + rc.shadeTime) * 1000.f, rc.numRows, rc.rowTime * 1000.f, rc.clusterTime * 1000.f,
+        rc.numClusters, relativeRmsError(image, reference));
+
+    // The stochastic estimate converges over frames; report a single frame and a short accumulation.
+    const int numFrames = 16;
+    AccumulationBuffer accumulation;
+
+    m_stochasticTree.setSamplesPerPixel(m_lightSamplesPerPixel);
+    timer.start();
+    m_stochasticTree.build(vpls);
+    float stochasticBuildTime = timer.end();
+
+    for (int frame = 0; frame < numFrames; ++frame)
+    {
+        m_stochasticTree.shade(*m_rt, m_gbuffer, mainLight, frame, image);
+        accumulation.add(image);
+
+        if (frame == 0)
+        {
+            ::printf("  light tree:  %.1f ms/frame (tree %.1f ms), %d samples/pixel, rel. RMS error %.4f after 1 frame",
+                timer.end() * 1000.f, stochasticBuildTime * 1000.f, m_stochasticTree.getSamplesPerPixel(), relativeRmsError(image, reference));
+        }
+    }
+
+    accumulation.resolve(image);
+    ::printf(", %.4f after %d\n", relativeRmsError(image, reference), numFrames);
+}
+
+// Path of the hierarchy cache without the extension; other per-scene caches are stored next to it.
+std::string App::getHierarchyCacheBase() const
+{
+    std::string meshName = m_meshFileName.getPtr();
+    std::string hierarchyName = meshName.substr(0, meshName.find_last_of("."));
+#ifdef _WIN64
+    hierarchyName += "_x64";
+#endif
+    return hierarchyName;
+}
+
+// The app's prefiltering settings for filter, with the blur and softness sliders.
+ShadowFilterSettings App::getShadowFilterSettings(ShadowFilter filter) const
+{
+    ShadowFilterSettings settings;
+    settings.filter = filter;
+    settings.blurRadius = m_shadowBlurRadius;
+    settings.softness = m_shadowSoftness;
+    return settings;
+}
+
+// The diagonal of the scene's bounds; the prefiltered shadow maps normalize their depths by it.
+float App::getSceneExtent() const
+{
+    if (!m_rt)
+        return 1.0f;
+
+    const AABB& bb = m_rt->getBvh().root().bb;
+    return FW::max((bb.max - bb.min).length(), 1e-6f);
+}
+
 
 
 //------------------------------------------------------------------------
@@ -11,9 +11,18 @@
 #include <memory>
 
 #include "RayTracer.hpp"
+#include "AlphaMask.hpp"
 
 #include "ShadowMap.hpp"
 #include "InstantRadiosity.hpp"
+#include "ManyLights.hpp"
+#include "Lightcuts.hpp"
+#include "RowColumnSampling.hpp"
+#include "StochasticLightTree.hpp"
+#include "CpuRenderer.hpp"
+#include "ShadowLod.hpp"
+#include "ImperfectShadowMaps.hpp"
+#include "DeferredShading.hpp"
 
 
 namespace FW {
@@ -56,7 +65,23 @@ namespace FW {
             Action_ChopBehindNear,
 
             Action_TracePrimaryRays,
-            Action_PlaceLightSourceAtCamera
+            Action_PlaceLightSourceAtCamera,
+
+            Action_TuneBvh,
+            Action_BenchmarkManyLights,
+            Action_BenchmarkSamplers
+        };
+
+        // How the image is shaded: with the GL shadow map passes, or on the CPU with ray traced visibility.
+        enum ShadingMode
+        {
+            ShadingMode_ShadowMaps = 0,
+            ShadingMode_BruteForce,
+            ShadingMode_Lightcuts,
+            ShadingMode_RowColumn,
+            ShadingMode_StochasticTree,
+            ShadingMode_ImperfectShadowMaps,
+            ShadingMode_Deferred,
         };
 
         enum CullMode
@@ -85,6 +110,13 @@ namespace FW {
             bool use_arealights;		// whether or not area light sampling is used
             bool enable_reflections;	// whether to compute reflections in whitted integrator
             float ao_length;
+            bool tune_bvh;				// sweep the BVH builder parameters for the loaded scene and store the best ones
+            bool benchmark;				// run the kernel benchmarks after loading a scene
+            IntersectMode intersectMode;	// ray/triangle test used by the ray tracer
+            std::string cpu_render_file;	// if set, render the loaded state on the CPU into this file and exit
+            Vec2i cpu_render_size;		// image size of the CPU render; the window size if zero
+            int cpu_render_threads;		// worker threads of the CPU render; all hardware threads if zero
+            ShadowFilter cpu_shadow_filter;	// if set, the CPU render looks up the VPLs' visibility from prefiltered shadow maps
         } m_settings;
 
         struct {
@@ -119,6 +151,16 @@ namespace FW {
 
         // 
         void			constructTracer(void);
+        void			tuneTracer(void);
+        void			runBenchmarks(void);
+        void			attachAlphaMasks(void);
+        void			shadeOnCpu(const Mat4f& worldToClip, const Vec2i& size);
+        void			benchmarkManyLights(void);
+        void			renderHeadless(void);
+        bool			isHeadless(void) const { return !m_settings.cpu_render_file.empty(); }
+        std::string		getHierarchyCacheBase(void) const;
+        ShadowFilterSettings	getShadowFilterSettings(ShadowFilter filter) const;
+        float			getSceneExtent(void) const;
 
         void			blitRttToScreen(GLContext* gl);
 
@@ -144,6 +186,8 @@ namespace FW {
         std::unique_ptr<RayTracer>			m_rt;
         std::vector<Vec3f>				    m_rtVertexPositions; // kept only for MD5 checksums
         std::vector<RTTriangle>				m_rtTriangles;
+        BvhBuildParams						m_bvhParams;
+        AlphaMaskCache						m_alphaMasks;
 
         std::unique_ptr<MeshWithColors>     m_mesh;
         std::unique_ptr<LightSource>    	m_lightSource;
@@ -163,8 +207,64 @@ namespace FW {
         bool								m_visualizeIndirect;
         bool								m_renderFromLight;
         int									m_num_indirect;
+        int									m_numIndirectCpu;		// VPL count of the CPU shading modes, which need no shadow map per light
+        int									m_numBounces;
+        bool								m_incrementalVpls;
+        int									m_vplUpdateBudget;
+        SamplerType							m_emissionSampler;
+        bool								m_cameraResampling;
+        int									m_vplOversampling;
         int									m_smResolutionLevel;
         int									m_smResolutionLevelPrev;
+        U32									m_sceneVersion;			// bumped on every change of the geometry
+        U32									m_mainShadowLightVersion;	// state the main light's shadow map was rendered with
+        U32									m_mainShadowSceneVersion;
+        bool								m_mainShadowValid;
+
+        bool								m_softwareShadowMaps;	// rasterize the VPL shadow maps on the CPU
+        bool								m_useShadowAtlas;		// VPL shadow maps in one atlas, shaded in batches
+        bool								m_adaptiveShadowMaps;	// VPL shadow map resolution by importance, within a texel budget
+        int									m_shadowTexelBudgetLevel;
+        S64									m_shadowAtlasTexels;	// last reported atlas usage
+        ShadowRasterizer					m_shadowRasterizer;
+        ShadowGeometry						m_shadowGeometry;
+        U32									m_shadowGeometryVersion;	// m_sceneVersion the geometry was built from
+        bool								m_shadowGeometryValid;
+        bool								m_cullShadowGeometry;	// draw only the BVH clusters in each light's frustum
+        ShadowCuller						m_shadowCuller;
+        U32									m_shadowCullerVersion;	// m_sceneVersion the culler was built from
+        bool								m_shadowCullerValid;
+        bool								m_useShadowLod;			// simplified geometry for the VPL shadow maps
+        float								m_shadowLodTexelError;	// allowed simplification error, in shadow map texels
+        ShadowLod							m_shadowLod;
+        U32									m_shadowLodVersion;		// m_sceneVersion the levels were built from
+        bool								m_shadowLodValid;
+        bool								m_paraboloidShadowMaps;	// indirect light maps over the whole hemisphere, at half the resolution
+        ShadowFilter						m_shadowFilter;			// prefiltering of the indirect light maps
+        int									m_shadowBlurRadius;
+        float								m_shadowSoftness;
+        bool								m_deferredIndirect;		// accumulate the indirect lights over a G-buffer instead of scene passes
+        DeferredGBuffer						m_deferredGBuffer;
+        bool								m_tiledLightCulling;	// deferred shading evaluates per screen tile only the lights that reach it
+        float								m_lightCullThreshold;	// smallest contribution to the radiance a tile still evaluates
+        int									m_lightTileSizeLevel;
+        float								m_tileLightsReported;	// last reported average of lights per tile
+
+        ShadingMode							m_shadingMode;
+        GBuffer								m_gbuffer;
+        Lightcuts							m_lightcuts;
+        RowColumnSampling					m_rowColumn;
+        StochasticLightTree					m_stochasticTree;
+        int									m_lightSamplesPerPixel;
+        ImperfectShadowMaps					m_ism;
+        ScenePoints							m_scenePoints;
+        U32									m_scenePointsVersion;	// m_sceneVersion the points were sampled from
+        bool								m_scenePointsValid;
+        int									m_ismResolutionLevel;
+        int									m_ismPointsLevel;
+        AccumulationBuffer					m_accumulation;
+        std::vector<float>					m_accumulationKey;	// inputs of the accumulated image; a change restarts it
+        std::vector<Vec3f>					m_cpuImage;
 
         GLuint								m_rttFBO;
         GLuint								m_rttDepth;
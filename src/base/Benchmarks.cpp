@@ -0,0 +1,192 @@
+#include "Benchmarks.hpp"
+#include "InstantRadiosity.hpp"
+
+#include "base/Timer.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+
+namespace FW
+{
+    void sampleSceneSegments(const std::vector<RTTriangle>& triangles, int num, Random& rand, std::vector<Ray>& rays)
+    {
+        if (triangles.empty())
+        {
+            return;
+        }
+
+        rays.reserve(rays.size() + num);
+
+        auto samplePoint = [&]()
+        {
+            const RTTriangle& tri = triangles[rand.getU32(U32(triangles.size()))];
+            float u = rand.getF32();
+            float v = rand.getF32();
+
+            if (u + v > 1.f)
+            {
+                u = 1.f - u;
+                v = 1.f - v;
+            }
+
+            return (1.f - u - v) * tri.m_vertices[0].p + u * tri.m_vertices[1].p + v * tri.m_vertices[2].p;
+        };
+
+        for (int i = 0; i < num; ++i)
+        {
+            Vec3f from = samplePoint();
+            Vec3f to = samplePoint();
+
+            rays.push_back(Ray::segment(from, to));
+        }
+    }
+
+    void sampleLightRays(const LightSource& ls, int num, std::vector<Ray>& rays)
+    {
+        std::vector<Vec3f> origs, dirs, E_times_pdf;
+        ls.sampleEmittedRays(num, origs, dirs, E_times_pdf);
+
+        rays.reserve(rays.size() + num);
+
+        for (int i = 0; i < num; ++i)
+        {
+            rays.push_back(Ray(origs[i], dirs[i], 0.f, ls.getFar()));
+        }
+    }
+
+    void benchmarkIntersectModes(RayTracer& rt, const std::vector<RTTriangle>& triangles, const std::vector<Ray>& rays)
+    {
+        if (triangles.empty() || rays.empty())
+        {
+            return;
+        }
+
+        std::cout << "Intersection benchmark: " << rays.size() << " rays, " << triangles.size() << " triangles" << std::endl;
+
+        // Bare kernel: every ray against a fixed window of triangles, so that traversal does not blur the numbers.
+        size_t numTris = std::min(triangles.size(), size_t(256));
+        size_t numTests = rays.size() * numTris;
+
+        int woopHits = 0, watertightHits = 0;
+        Timer timer(true);
+
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            for (size_t j = 0; j < numTris; ++j)
+            {
+                float t, u, v;
+                woopHits += triangles[j].intersect_woop(rays[i].orig, rays[i].dir, t, u, v) && t > rays[i].tMin && t < rays[i].tMax;
+            }
+        }
+
+        float woopTime = timer.end();
+
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            // per-ray constants are part of the cost, as in traversal
+            WatertightRay wtRay(rays[i].orig, rays[i].dir);
+
+            for (size_t j = 0; j < numTris; ++j)
+            {
+                float t, u, v;
+                watertightHits += triangles[j].intersect_watertight(wtRay, t, u, v) && t > rays[i].tMin && t < rays[i].tMax;
+            }
+        }
+
+        float watertightTime = timer.end();
+
+        std::cout << "  kernel woop:       " << woopTime * 1e9f / numTests << " ns/test, " << woopHits << " hits" << std::endl;
+        std::cout << "  kernel watertight: " << watertightTime * 1e9f / numTests << " ns/test, " << watertightHits << " hits" << std::endl;
+
+        // Full traversal with both modes.
+        IntersectMode oldMode = rt.getIntersectMode();
+        const IntersectMode modes[] = { IntersectMode_Woop, IntersectMode_Watertight };
+        const char* names[] = { "woop", "watertight" };
+
+        for (int m = 0; m < 2; ++m)
+        {
+            rt.setIntersectMode(modes[m]);
+
+            int hits = 0;
+            timer.start();
+
+            for (size_t i = 0; i < rays.size(); ++i)
+            {
+                Hit hit;
+                hits += rt.intersect(rays[i], hit) ? 1 : 0;
+            }
+
+            float traceTime = timer.end();
+
+            // second pass with the counting kernel for the traversal statistics
+            rt.resetStats();
+            for (size_t i = 0; i < rays.size(); ++i)
+            {
+                Hit hit;
+                rt.intersect<TraceFeature_MaxDistance | TraceFeature_Stats>(rays[i], hit);
+            }
+            TraceStats stats = rt.getStats();
+
+            std::cout << "  trace " << names[m] << ": " << rays.size() / traceTime * 1e-6f << " Mrays/s, "
+                << hits << " hits, " << float(stats.nodes) / stats.rays << " nodes/ray, "
+                << float(stats.triangles) / stats.rays << " triangles/ray" << std::endl;
+        }
+
+        rt.setIntersectMode(oldMode);
+    }
+
+    void benchmarkEmissionSamplers(RayTracer& rt, const GBuffer& gbuffer, const LightSource& ls, float indirectFOV, int numBounces)
+    {
+        static const SamplerType samplers[] = { SamplerType_Random, SamplerType_Halton, SamplerType_Sobol };
+        static const int counts[] = { 16, 32, 64, 128, 256, 512, 1024 };
+        // The reference is independent of every tested set: random points from a seed of its own, many more
+        // of them than the largest tested count, so that no sampler is compared against its own points.
+        const int referenceCount = 16384;
+        const U32 referenceSeed = 98765;
+
+        // Only the indirect light is compared; the direct light doesn't depend on the sampler.
+        Vpl noLight;
+        noLight.E = Vec3f(0.f);
+
+        auto shadeIndirect = [&](SamplerType sampler, int count, U32 seed, std::vector<Vec3f>& image)
+        {
+            InstantRadiosity ir;
+            ir.setFOV(indirectFOV);
+            ir.setNumBounces(numBounces);
+            ir.setEmissionSampler(sampler);
+            ir.setEmissionSeed(seed);
+            ir.castIndirect(&rt, nullptr, ls, count);
+
+            std::vector<Vpl> vpls;
+            collectVpls(ir, vpls);
+            shadeBruteForce(rt, gbuffer, noLight, vpls, image);
+        };
+
+        std::vector<Vec3f> reference, image;
+        shadeIndirect(SamplerType_Random, referenceCount, referenceSeed, reference);
+
+        std::cout << "Relative RMS error of the indirect light against " << referenceCount << " independent random VPLs ("
+            << gbuffer.getSize().x << "x" << gbuffer.getSize().y << " pixels):" << std::endl;
+        std::cout << std::setw(8) << "VPLs";
+        for (SamplerType sampler : samplers)
+        {
+            std::cout << std::setw(10) << getSamplerName(sampler);
+        }
+        std::cout << std::endl;
+
+        for (int count : counts)
+        {
+            std::cout << std::setw(8) << count;
+
+            for (SamplerType sampler : samplers)
+            {
+                shadeIndirect(sampler, count, 1234, image);
+                std::cout << std::setw(10) << std::setprecision(4) << relativeRmsError(image, reference);
+            }
+
+            std::cout << std::endl;
+        }
+    }
+}
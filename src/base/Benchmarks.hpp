@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * Micro-benchmarks for the ray tracing kernels; run with the -benchmark command line flag
+ */
+
+#include "RayTracer.hpp"
+#include "ShadowMap.hpp"
+#include "ManyLights.hpp"
+
+#include "base/Random.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Segments between random points on random triangles.
+    void sampleSceneSegments(const std::vector<RTTriangle>& triangles, int num, Random& rand, std::vector<Ray>& rays);
+
+    // Rays emitted by the light, ending at its far plane.
+    void sampleLightRays(const LightSource& ls, int num, std::vector<Ray>& rays);
+
+    // Compares the Woop and watertight triangle tests, both as a bare kernel and inside full traversal.
+    // Also reports how many rays each mode loses, e.g. through cracks between triangles.
+    void benchmarkIntersectModes(RayTracer& rt, const std::vector<RTTriangle>& triangles, const std::vector<Ray>& rays);
+
+    // Error of the indirect illumination seen in the G-buffer against the VPL count, for each emission sampler.
+    // The reference is shaded with many Sobol VPLs; everything is shaded on the CPU with ray traced shadows.
+    void benchmarkEmissionSamplers(RayTracer& rt, const GBuffer& gbuffer, const LightSource& ls, float indirectFOV, int numBounces);
+}
@@ -5,12 +5,53 @@
 #include <numeric>
 
 
-#define MAX_TRIS_PER_LEAF 3
-#define MAX_TRIS_PER_LEAF_SAH 10
+// Identifies a saved BvhBuildParams file; bump the version whenever the layout changes.
+#define BVH_PARAMS_MAGIC 0x50485642u
+#define BVH_PARAMS_VERSION 2u
 
 
 namespace FW
 {
+    void BvhBuildParams::save(std::ostream& os) const
+    {
+        filesave(os, BVH_PARAMS_MAGIC);
+        filesave(os, BVH_PARAMS_VERSION);
+        filesave(os, maxTrisPerLeaf);
+        filesave(os, maxTrisPerLeafSah);
+        filesave(os, numSplitCandidates);
+        filesave(os, traversalCost);
+        filesave(os, intersectionCost);
+        filesave(os, sahLeafTermination);
+    }
+
+    bool BvhBuildParams::load(std::istream& is)
+    {
+        uint32_t magic = 0, version = 0;
+        fileload(is, magic);
+        fileload(is, version);
+
+        if (!is || magic != BVH_PARAMS_MAGIC || version != BVH_PARAMS_VERSION)
+        {
+            return false;
+        }
+
+        BvhBuildParams loaded;
+        fileload(is, loaded.maxTrisPerLeaf);
+        fileload(is, loaded.maxTrisPerLeafSah);
+        fileload(is, loaded.numSplitCandidates);
+        fileload(is, loaded.traversalCost);
+        fileload(is, loaded.intersectionCost);
+        fileload(is, loaded.sahLeafTermination);
+
+        if (!is || loaded.maxTrisPerLeaf < 1 || loaded.maxTrisPerLeafSah < 1 || loaded.numSplitCandidates < 1)
+        {
+            return false;
+        }
+
+        *this = loaded;
+        return true;
+    }
+
     Bvh::Bvh()
     {
     }
@@ -41,8 +82,8 @@ namespace FW
         rootNode_.reset(new BvhNode(loader));
     }
 
-    Bvh::Bvh(std::vector<RTTriangle>& triangles, SplitMode splitMode) : triangles_ptr(&triangles), mode_(splitMode),
-        indices_(triangles.size())
+    Bvh::Bvh(std::vector<RTTriangle>& triangles, SplitMode splitMode, const BvhBuildParams& params) :
+        triangles_ptr(&triangles), mode_(splitMode), params_(params), indices_(triangles.size())
     {
         rootNode_.reset(new BvhNode(0, triangles.size() - 1));
 
@@ -99,7 +140,7 @@ namespace FW
 
         node->bb = AABB(bbPoints.first, bbPoints.second);
 
-        if (node->endPrim - node->startPrim + 1 > MAX_TRIS_PER_LEAF)
+        if (node->endPrim - node->startPrim + 1 > size_t(params_.maxTrisPerLeaf))
         {
             int longestAxis = getLongestAxis(bbPoints);
 
@@ -126,7 +167,7 @@ namespace FW
 
         node->bb = AABB(bbPoints.first, bbPoints.second);
 
-        if (node->endPrim - node->startPrim + 1 > MAX_TRIS_PER_LEAF)
+        if (node->endPrim - node->startPrim + 1 > size_t(params_.maxTrisPerLeaf))
         {
             int longestAxis = getLongestAxis(bbPoints);
             size_t splitIndex = std::stable_partition(indices_.begin() + node->startPrim,
@@ -157,19 +198,24 @@ namespace FW
 
         node->bb = AABB(bbPoints.first, bbPoints.second);
 
-        if (node->endPrim - node->startPrim + 1 > MAX_TRIS_PER_LEAF_SAH)
+        size_t numPrims = node->endPrim - node->startPrim + 1;
+
+        if (numPrims > size_t(params_.maxTrisPerLeafSah))
         {
             size_t sahSplitIndex = node->startPrim;
             float lowestScore = std::numeric_limits<float>::max();
             float bestSplitPlaneCoord = 0.f;
             int bestAxis = 0;
 
+            float nodeArea = node->bb.area();
+            float invNodeArea = nodeArea > 0.f ? 1.f / nodeArea : 1.f;
+
             for (int axis = 0; axis < 3; ++axis)
             {
-                float splitCoef = 0.1f;
-
-                while (splitCoef < 1.f)
+                // candidate planes split the node evenly into numSplitCandidates + 1 slabs
+                for (int candidate = 1; candidate <= params_.numSplitCandidates; ++candidate)
                 {
+                    float splitCoef = float(candidate) / float(params_.numSplitCandidates + 1);
                     float splitPlaneCoord = bbPoints.first[axis] +
                         (bbPoints.second[axis] - bbPoints.first[axis]) * splitCoef;
 
@@ -181,7 +227,8 @@ namespace FW
                                 splitPlaneCoord;
                         }) - indices_.begin();
 
-                        float currentScore = getSahScore(node->startPrim, node->endPrim, splitIndex);
+                        float currentScore = params_.traversalCost + params_.intersectionCost * invNodeArea *
+                            getSahScore(node->startPrim, node->endPrim, splitIndex);
 
                         if (currentScore < lowestScore)
                         {
@@ -190,11 +237,17 @@ namespace FW
                             bestAxis = axis;
                             bestSplitPlaneCoord = splitPlaneCoord;
                         }
-
-                        splitCoef += 0.1f;
                 }
             }
 
+            // Optionally, small nodes stay leaves when no split beats intersecting all of their triangles.
+            float leafScore = params_.intersectionCost * numPrims;
+
+            if (params_.sahLeafTermination && lowestScore >= leafScore && numPrims <= 2 * size_t(params_.maxTrisPerLeafSah))
+            {
+                return;
+            }
+
             std::stable_partition(indices_.begin() + node->startPrim,
                 indices_.begin() + node->endPrim + 1,
                 [&](uint32_t n)
@@ -11,18 +11,44 @@
 
 namespace FW
 {
+    // Tunable parameters of the BVH builders. The defaults are the values the builders used to have
+    // hard-coded; BvhTuner searches this space per scene and stores the winner next to the hierarchy cache.
+    struct BvhBuildParams
+    {
+        int maxTrisPerLeaf;         // leaf size of the median builders
+        int maxTrisPerLeafSah;      // leaf size of the SAH builder
+        int numSplitCandidates;     // split planes tried per axis by the SAH builder
+        float traversalCost;        // SAH cost of visiting an inner node
+        float intersectionCost;     // SAH cost of testing one triangle
+        bool sahLeafTermination;    // SAH builder: keeps nodes of up to 2 * maxTrisPerLeafSah triangles as leaves when no split is cheaper
+
+        BvhBuildParams() :
+            maxTrisPerLeaf(3),
+            maxTrisPerLeafSah(10),
+            numSplitCandidates(9),
+            traversalCost(1.f),
+            intersectionCost(1.f),
+            sahLeafTermination(false)
+        {}
+
+        void save(std::ostream& os) const;
+        bool load(std::istream& is);
+    };
+
+
     class Bvh
     {
     public:
 
         Bvh();
         Bvh(std::istream& is);
-        Bvh(std::vector<RTTriangle>& triangles, SplitMode splitMode);
+        Bvh(std::vector<RTTriangle>& triangles, SplitMode splitMode, const BvhBuildParams& params = BvhBuildParams());
 
         // move assignment for performance
         Bvh& operator=(Bvh&& other)
         {
             mode_ = other.mode_;
+            params_ = other.params_;
             std::swap(rootNode_, other.rootNode_);
             std::swap(indices_, other.indices_);
             return *this;
@@ -35,9 +61,12 @@ namespace FW
 
         uint32_t getIndex(uint32_t index) const { return indices_[index]; }
 
+        const BvhBuildParams& getParams() const { return params_; }
+
     private:
 
         SplitMode mode_;
+        BvhBuildParams params_;
         std::unique_ptr<BvhNode> rootNode_;
 
         std::vector<uint32_t> indices_; // triangle index list that will be sorted during BVH construction
@@ -0,0 +1,126 @@
+#include "BvhTuner.hpp"
+#include "Benchmarks.hpp"
+
+#include "base/Timer.hpp"
+
+#include <iostream>
+
+
+namespace FW
+{
+    BvhTuner::BvhTuner(std::vector<RTTriangle>& triangles, SplitMode splitMode) :
+        m_triangles(triangles), m_splitMode(splitMode)
+    {
+    }
+
+    void BvhTuner::addRays(const std::vector<Ray>& rays)
+    {
+        m_rays.insert(m_rays.end(), rays.begin(), rays.end());
+    }
+
+    void BvhTuner::addSceneRays(int num, Random& rand)
+    {
+        sampleSceneSegments(m_triangles, num, rand, m_rays);
+    }
+
+    BvhBuildParams BvhTuner::tune()
+    {
+        m_results.clear();
+
+        // A full grid would need hundreds of builds, so walk the parameters one at a time
+        // and keep the best value of each before moving on to the next one.
+        static const int leafSizes[] = { 1, 2, 3, 4, 6, 8, 12, 16 };
+        static const int splitCandidates[] = { 4, 9, 16, 32 };
+        static const float traversalCosts[] = { 0.5f, 1.f, 2.f, 4.f };
+
+        BvhBuildParams best;
+        Result bestResult = measure(best);
+
+        auto consider = [&](const BvhBuildParams& params)
+        {
+            Result result = measure(params);
+
+            if (result.raysPerSecond > bestResult.raysPerSecond)
+            {
+                bestResult = result;
+                best = params;
+            }
+        };
+
+        for (int leafSize : leafSizes)
+        {
+            BvhBuildParams params = best;
+
+            if (m_splitMode == SplitMode_Sah)
+            {
+                params.maxTrisPerLeafSah = leafSize;
+            }
+            else
+            {
+                params.maxTrisPerLeaf = leafSize;
+            }
+
+            consider(params);
+        }
+
+        // The remaining parameters only affect the SAH builder.
+        if (m_splitMode == SplitMode_Sah)
+        {
+            for (int candidates : splitCandidates)
+            {
+                BvhBuildParams params = best;
+                params.numSplitCandidates = candidates;
+                consider(params);
+            }
+
+            for (float cost : traversalCosts)
+            {
+                BvhBuildParams params = best;
+                params.traversalCost = cost;
+                consider(params);
+            }
+
+            BvhBuildParams params = best;
+            params.sahLeafTermination = !best.sahLeafTermination;
+            consider(params);
+        }
+
+        std::cout << "Best BVH configuration: leaf " << best.maxTrisPerLeaf << "/" << best.maxTrisPerLeafSah
+            << ", " << best.numSplitCandidates << " split candidates, traversal cost " << best.traversalCost
+            << ", intersection cost " << best.intersectionCost
+            << ", SAH leaf termination " << (best.sahLeafTermination ? "on" : "off")
+            << " (" << bestResult.raysPerSecond * 1e-6f << " Mrays/s)" << std::endl;
+
+        return best;
+    }
+
+    BvhTuner::Result BvhTuner::measure(const BvhBuildParams& params)
+    {
+        Result result;
+        result.params = params;
+
+        RayTracer rt;
+
+        Timer timer(true);
+        rt.constructHierarchy(m_triangles, m_splitMode, params);
+        result.buildTime = timer.end();
+
+        // Trace the sample single-threaded so that the timings are comparable between runs.
+        for (const Ray& ray : m_rays)
+        {
+            rt.raycast(ray);
+        }
+
+        float traceTime = timer.end();
+        result.raysPerSecond = traceTime > 0.f ? m_rays.size() / traceTime : 0.f;
+
+        std::cout << "  leaf " << params.maxTrisPerLeaf << "/" << params.maxTrisPerLeafSah
+            << ", candidates " << params.numSplitCandidates << ", Ct " << params.traversalCost
+            << (params.sahLeafTermination ? ", leaf termination" : "")
+            << ": build " << result.buildTime * 1000.f << " ms, "
+            << result.raysPerSecond * 1e-6f << " Mrays/s" << std::endl;
+
+        m_results.push_back(result);
+        return result;
+    }
+}
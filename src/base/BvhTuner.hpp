@@ -0,0 +1,46 @@
+#pragma once
+
+
+#include "RayTracer.hpp"
+
+#include "base/Random.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Searches the BVH builder parameters (leaf sizes, split candidate counts and SAH cost constants)
+    // for the configuration that traces a sample of the scene's rays the fastest.
+    class BvhTuner
+    {
+    public:
+        struct Result
+        {
+            BvhBuildParams params;
+            float buildTime;        // seconds
+            float raysPerSecond;
+        };
+
+        BvhTuner(std::vector<RTTriangle>& triangles, SplitMode splitMode);
+
+        void addRays(const std::vector<Ray>& rays);
+
+        // Adds segments between random points on random triangles; these resemble the
+        // visibility queries the renderer issues.
+        void addSceneRays(int num, Random& rand);
+
+        // Sweeps one parameter at a time starting from the defaults and returns the fastest configuration.
+        BvhBuildParams tune();
+
+        const std::vector<Result>& getResults() const { return m_results; }
+
+    private:
+        Result measure(const BvhBuildParams& params);
+
+        std::vector<RTTriangle>& m_triangles;
+        SplitMode m_splitMode;
+        std::vector<Ray> m_rays;
+        std::vector<Result> m_results;
+    };
+}
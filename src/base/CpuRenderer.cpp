@@ -0,0 +1,68 @@
+#include "CpuRenderer.hpp"
+
+#include "base/Timer.hpp"
+
+#include <omp.h>
+
+
+namespace FW
+{
+    void CpuRenderer::render(const RayTracer& rt, const Mat4f& worldToClip, const Vec2i& size, const Vpl& mainLight,
+        const std::vector<Vpl>& vpls, std::vector<Vec3f>& image)
+    {
+        Timer timer(true);
+
+        image.assign(size.x * size.y, Vec3f(0.f));
+
+        Mat4f clipToWorld = worldToClip.inverted();
+        Vec2i numTiles = (size + Vec2i(m_tileSize - 1)) / m_tileSize;
+        int tileCount = numTiles.x * numTiles.y;
+        int numThreads = m_numThreads > 0 ? m_numThreads : omp_get_max_threads();
+
+        // Tiles keep the rays of a thread coherent; with lights all over the scene their cost varies a lot,
+        // so they're handed out one at a time.
+#pragma omp parallel for schedule(dynamic, 1) num_threads(numThreads)
+        for (int t = 0; t < tileCount; ++t)
+        {
+            Vec2i lo = Vec2i(t % numTiles.x, t / numTiles.x) * m_tileSize;
+            Vec2i hi = FW::min(lo + Vec2i(m_tileSize), size);
+
+            for (int y = lo.y; y < hi.y; ++y)
+            {
+                for (int x = lo.x; x < hi.x; ++x)
+                {
+                    Vec2f ndc(2.f * (x + 0.5f) / size.x - 1.f, 2.f * (y + 0.5f) / size.y - 1.f);
+                    GBufferSample s;
+
+                    if (traceCameraSample(rt, clipToWorld, ndc, s))
+                    {
+                        image[x + y * size.x] = m_shadowMaps ? shadeSample(rt, s, mainLight, vpls, *m_shadowMaps) : shadeSample(rt, s, mainLight, vpls);
+                    }
+                }
+            }
+        }
+
+        m_stats.numTiles = tileCount;
+        m_stats.numThreads = numThreads;
+        m_stats.time = timer.end();
+    }
+
+    void tonemapReinhard(const std::vector<Vec3f>& radiance, const Vec2i& size, float white, float boost, Image& out)
+    {
+        FW_ASSERT(out.getSize() == size);
+
+        for (int y = 0; y < size.y; ++y)
+        {
+            for (int x = 0; x < size.x; ++x)
+            {
+                Vec3f color = radiance[x + y * size.x] * boost;
+                float L = 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+                color *= (1.f + L / white / white) / (1.f + L);
+
+                // the GL framebuffer clamps the same way when the blit writes it
+                color = FW::clamp(color, Vec3f(0.f), Vec3f(1.f));
+                out.setVec4f(Vec2i(x, size.y - 1 - y), Vec4f(color, 1.f));
+            }
+        }
+    }
+}
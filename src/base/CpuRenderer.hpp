@@ -0,0 +1,53 @@
+#pragma once
+
+
+#include "ManyLights.hpp"
+#include "PrefilteredShadowMap.hpp"
+#include "gui/Image.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Instant radiosity without OpenGL: the image App::renderFrame accumulates from the shadow mapped
+    // passes of the main light and the VPLs, computed with the ray tracer instead. Primary visibility,
+    // the spot light shading of the MeshBase::draw_generic shader and the visibility of every light
+    // are evaluated per pixel, in square tiles handed out to the worker threads.
+    class CpuRenderer
+    {
+    public:
+        struct Stats
+        {
+            int numTiles;
+            int numThreads;
+            double time;        // seconds
+        };
+
+        CpuRenderer() : m_tileSize(32), m_numThreads(0), m_shadowMaps(nullptr) {}
+
+        void setTileSize(int size) { m_tileSize = FW::max(1, size); }
+        void setNumThreads(int n) { m_numThreads = FW::max(0, n); }    // 0 uses all hardware threads
+
+        // With maps, one per VPL in the order of the vpls given to render(), the VPLs' visibility is looked up
+        // from them instead of traced, like the shadow mapped GL passes do; null goes back to shadow rays.
+        void setShadowMaps(const std::vector<PrefilteredShadowMap>* maps) { m_shadowMaps = maps; }
+
+        // Radiance of every pixel; row 0 is the bottom row, like in the GL render target.
+        // worldToClip is the camera's projection * worldToCamera.
+        void render(const RayTracer& rt, const Mat4f& worldToClip, const Vec2i& size, const Vpl& mainLight,
+            const std::vector<Vpl>& vpls, std::vector<Vec3f>& image);
+
+        const Stats& getStats() const { return m_stats; }
+
+    private:
+        int m_tileSize;
+        int m_numThreads;
+        const std::vector<PrefilteredShadowMap>* m_shadowMaps;
+        Stats m_stats;
+    };
+
+    // The Reinhard operator of App::blitRttToScreen(), applied to a bottom-row-first radiance image.
+    // The result is an 8-bit image with the top row first, ready for exportImage().
+    void tonemapReinhard(const std::vector<Vec3f>& radiance, const Vec2i& size, float white, float boost, Image& out);
+}
@@ -0,0 +1,536 @@
+#include "DeferredShading.hpp"
+
+#include "gpu/GLContext.hpp"
+
+#include <cfloat>
+
+
+namespace FW
+{
+    void DeferredGBuffer::allocate(const Vec2i& size)
+    {
+        free();
+        m_size = size;
+
+        glGenFramebuffers(1, &m_framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+
+        glGenRenderbuffers(1, &m_depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, size.x, size.y);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+        GLContext::checkErrors();
+
+        // Full floats for the positions, which are far from the origin in large scenes; half floats do for the rest.
+        glGenTextures(Target_Max, m_textures);
+        for (int i = 0; i < Target_Max; ++i)
+        {
+            glBindTexture(GL_TEXTURE_2D, m_textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, i == Target_Position ? GL_RGBA32F : GL_RGBA16F, size.x, size.y, 0, GL_RGBA, GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, m_textures[i], 0);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLContext::checkErrors();
+    }
+
+    void DeferredGBuffer::free()
+    {
+        if (m_framebuffer)
+        {
+            glDeleteFramebuffers(1, &m_framebuffer);
+            glDeleteRenderbuffers(1, &m_depth);
+            glDeleteTextures(Target_Max, m_textures);
+            m_framebuffer = m_depth = 0;
+            for (int i = 0; i < Target_Max; ++i)
+                m_textures[i] = 0;
+        }
+
+        if (m_tileFramebuffer)
+        {
+            glDeleteFramebuffers(1, &m_tileFramebuffer);
+            glDeleteTextures(1, &m_tileTexture);
+            m_tileFramebuffer = m_tileTexture = 0;
+        }
+
+        m_size = Vec2i(0);
+        m_tileTextureSize = Vec2i(0);
+        m_tileDepths.clear();
+    }
+
+    void DeferredGBuffer::render(GLContext* gl, MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection, const Vec2i& size)
+    {
+        if (!m_framebuffer || m_size != size)
+            allocate(size);
+        m_tileDepths.clear();
+
+        // Get or build the shader: the vertex stage of MeshBase::draw_generic, with the fragment stage writing
+        // the surface into the three targets instead of shading it.
+        static const char* progId = "DeferredGBuffer::render";
+        GLContext::Program* prog = gl->getProgram(progId);
+        if (!prog)
+        {
+            prog = new GLContext::Program(
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    uniform mat4 posToClip;
+                    uniform mat4 posToCamera;
+                    uniform mat3 normalToCamera;
+                    attribute vec3 positionAttrib;
+                    attribute vec3 normalAttrib;
+                    attribute vec4 vcolorAttrib;
+                    attribute vec2 texCoordAttrib;
+                    centroid varying vec3 positionVarying;
+                    centroid varying vec3 normalVarying;
+                    centroid varying vec4 colorVarying;
+                    varying vec2 texCoordVarying;
+
+                    void main()
+                    {
+                        vec4 pos = vec4(positionAttrib, 1.0);
+                        gl_Position = posToClip * pos;
+                        positionVarying = (posToCamera * pos).xyz;
+                        normalVarying = normalToCamera * normalAttrib;
+                        colorVarying = vcolorAttrib;
+                        texCoordVarying = texCoordAttrib;
+                    }
+                ),
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    uniform bool hasDiffuseTexture;
+                    uniform bool hasAlphaTexture;
+                    uniform vec4 diffuseUniform;
+                    uniform sampler2D diffuseSampler;
+                    uniform sampler2D alphaSampler;
+                    centroid varying vec3 positionVarying;
+                    centroid varying vec3 normalVarying;
+                    centroid varying vec4 colorVarying;
+                    varying vec2 texCoordVarying;
+
+                    void main()
+                    {
+                        vec4 diffuseColor = diffuseUniform;
+
+                        if (hasDiffuseTexture) {
+                            diffuseColor.rgb = texture2D(diffuseSampler, texCoordVarying).rgb;
+                        }
+
+                        diffuseColor *= colorVarying;
+
+                        if (hasAlphaTexture) {
+                            diffuseColor.a = texture2D(alphaSampler, texCoordVarying).g;
+                        }
+
+                        if (diffuseColor.a <= 0.5) {
+                            discard;
+                        }
+
+                        gl_FragData[0] = vec4(positionVarying, 1.0);
+                        gl_FragData[1] = vec4(normalize(normalVarying), 0.0);
+                        gl_FragData[2] = vec4(diffuseColor.rgb, 1.0);
+                    }
+                )
+            );
+            gl->setProgram(progId, prog);
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+        static const GLenum drawBuffers[Target_Max] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+        glDrawBuffers(Target_Max, drawBuffers);
+        glViewport(0, 0, size.x, size.y);
+
+        // w = 0 marks the pixels no surface covers
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+
+        int posAttrib = scene->findAttrib(MeshBase::AttribType_Position);
+        int normalAttrib = scene->findAttrib(MeshBase::AttribType_Normal);
+        int vcolorAttrib = scene->findAttrib(MeshBase::AttribType_Color);
+        int texCoordAttrib = scene->findAttrib(MeshBase::AttribType_TexCoord);
+        if (posAttrib == -1)
+            return;
+
+        prog->use();
+        gl->setUniform(prog->getUniformLoc("posToClip"), projection * worldToCamera);
+        gl->setUniform(prog->getUniformLoc("posToCamera"), worldToCamera);
+        gl->setUniform(prog->getUniformLoc("normalToCamera"), worldToCamera.getXYZ().inverted().transposed());
+        gl->setUniform(prog->getUniformLoc("diffuseSampler"), 0);
+        gl->setUniform(prog->getUniformLoc("alphaSampler"), 1);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene->getVBO().getGLBuffer());
+        scene->setGLAttrib(gl, posAttrib, prog->getAttribLoc("positionAttrib"));
+
+        if (normalAttrib != -1)
+            scene->setGLAttrib(gl, normalAttrib, prog->getAttribLoc("normalAttrib"));
+        else
+            glVertexAttrib3f(prog->getAttribLoc("normalAttrib"), 0.0f, 0.0f, 0.0f);
+
+        if (vcolorAttrib != -1)
+            scene->setGLAttrib(gl, vcolorAttrib, prog->getAttribLoc("vcolorAttrib"));
+        else
+            glVertexAttrib4f(prog->getAttribLoc("vcolorAttrib"), 1.0f, 1.0f, 1.0f, 1.0f);
+
+        if (texCoordAttrib != -1)
+            scene->setGLAttrib(gl, texCoordAttrib, prog->getAttribLoc("texCoordAttrib"));
+        else
+            glVertexAttrib2f(prog->getAttribLoc("texCoordAttrib"), 0.0f, 0.0f);
+
+        for (int i = 0; i < scene->numSubmeshes(); i++)
+        {
+            const MeshBase::Material& mat = scene->material(i);
+            gl->setUniform(prog->getUniformLoc("diffuseUniform"), mat.diffuse);
+
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, mat.textures[MeshBase::TextureType_Diffuse].getGLTexture());
+            gl->setUniform(prog->getUniformLoc("hasDiffuseTexture"), mat.textures[MeshBase::TextureType_Diffuse].exists());
+
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, mat.textures[MeshBase::TextureType_Alpha].getGLTexture());
+            gl->setUniform(prog->getUniformLoc("hasAlphaTexture"), mat.textures[MeshBase::TextureType_Alpha].exists());
+
+            glDrawElements(GL_TRIANGLES, scene->vboIndexSize(i), GL_UNSIGNED_INT, (void*)(UPTR)scene->vboIndexOffset(i));
+        }
+
+        gl->resetAttribs();
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(0);
+
+        // back to the single target the other framebuffers draw into
+        glDrawBuffers(1, drawBuffers);
+        GLContext::checkErrors();
+    }
+
+    void DeferredGBuffer::reduceTileDepths(GLContext* gl, int tileSize)
+    {
+        tileSize = FW::max(tileSize, 1);
+        Vec2i numTiles = (m_size + Vec2i(tileSize - 1)) / tileSize;
+        m_tileDepths.clear();
+        if (!m_framebuffer || numTiles.min() <= 0)
+            return;
+
+        if (!m_tileFramebuffer || m_tileTextureSize != numTiles)
+        {
+            if (m_tileFramebuffer)
+            {
+                glDeleteFramebuffers(1, &m_tileFramebuffer);
+                glDeleteTextures(1, &m_tileTexture);
+            }
+
+            glGenFramebuffers(1, &m_tileFramebuffer);
+            glBindFramebuffer(GL_FRAMEBUFFER, m_tileFramebuffer);
+            glGenTextures(1, &m_tileTexture);
+            glBindTexture(GL_TEXTURE_2D, m_tileTexture);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, numTiles.x, numTiles.y, 0, GL_RGBA, GL_FLOAT, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_tileTexture, 0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            m_tileTextureSize = numTiles;
+            GLContext::checkErrors();
+        }
+
+        // Get or build the shader: each fragment is a tile and loops over its pixels.
+        static const char* progId = "DeferredGBuffer::reduceTileDepths";
+        GLContext::Program* prog = gl->getProgram(progId);
+        if (!prog)
+        {
+            prog = new GLContext::Program(
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    attribute vec4 posAttrib;
+
+                    void main()
+                    {
+                        gl_Position = posAttrib;
+                    }
+                ),
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    uniform sampler2D positionSampler;
+                    uniform vec2 viewSize;
+                    uniform int tileSize;
+
+                    void main()
+                    {
+                        vec2 origin = floor(gl_FragCoord.xy) * float(tileSize);
+                        vec2 range = vec2(1e30, -1e30);
+
+                        for (int y = 0; y < tileSize; ++y)
+                        {
+                            for (int x = 0; x < tileSize; ++x)
+                            {
+                                vec2 pixel = origin + vec2(float(x), float(y)) + 0.5;
+                                vec4 position = texture2D(positionSampler, pixel / viewSize);
+
+                                // the last row and column of tiles reach past the view
+                                if (pixel.x < viewSize.x && pixel.y < viewSize.y && position.w != 0.0) {
+                                    range = vec2(min(range.x, -position.z), max(range.y, -position.z));
+                                }
+                            }
+                        }
+
+                        gl_FragColor = vec4(range, 0.0, 1.0);
+                    }
+                )
+            );
+            gl->setProgram(progId, prog);
+        }
+
+        static const F32 quad[] =
+        {
+            -1, -1, 0, 1,
+            1, -1, 0, 1,
+            -1, 1, 0, 1,
+            1, 1, 0, 1
+        };
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_tileFramebuffer);
+        glViewport(0, 0, numTiles.x, numTiles.y);
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_BLEND);
+
+        prog->use();
+        gl->setAttrib(prog->getAttribLoc("posAttrib"), 4, GL_FLOAT, 0, quad);
+        gl->setUniform(prog->getUniformLoc("positionSampler"), 2);
+        gl->setUniform(prog->getUniformLoc("viewSize"), Vec2f(m_size));
+        gl->setUniform(prog->getUniformLoc("tileSize"), tileSize);
+        glActiveTexture(GL_TEXTURE0 + 2);
+        glBindTexture(GL_TEXTURE_2D, m_textures[Target_Position]);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        std::vector<Vec4f> texels(numTiles.x * numTiles.y);
+        glReadPixels(0, 0, numTiles.x, numTiles.y, GL_RGBA, GL_FLOAT, texels.data());
+        m_tileDepths.resize(texels.size());
+        for (size_t i = 0; i < texels.size(); ++i)
+        {
+            m_tileDepths[i] = Vec2f(texels[i].x, texels[i].y);
+        }
+        m_depthTileSize = tileSize;
+
+        gl->resetAttribs();
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(0);
+
+        // as render() left things
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+        glViewport(0, 0, m_size.x, m_size.y);
+        glEnable(GL_DEPTH_TEST);
+        GLContext::checkErrors();
+    }
+
+    void TileLightLists::build(const Mat4f& worldToCamera, const Mat4f& projection, const Vec2i& size, const std::vector<Vpl>& lights,
+        int tileSize, float threshold, const std::vector<Vec2f>& tileDepths)
+    {
+        m_size = size;
+        m_tileSize = FW::max(tileSize, 1);
+        m_numTiles = (size + Vec2i(m_tileSize - 1)) / m_tileSize;
+        m_lights.assign(m_numTiles.x * m_numTiles.y, std::vector<int>());
+
+        Mat4f worldToClip = projection * worldToCamera;
+        bool depthBounds = tileDepths.size() == m_lights.size();
+
+        // The eye-space boxes of the tiles' frustum slices: the rays through the corners of a tile, from the
+        // camera at the origin, cut at its nearest and farthest depth. Empty ones for the tiles without surfaces.
+        std::vector<AABB> boxes;
+        if (depthBounds)
+        {
+            Mat4f clipToCamera = projection.inverted();
+            boxes.assign(m_lights.size(), AABB(Vec3f(FLT_MAX), Vec3f(-FLT_MAX)));
+
+            for (int tile = 0; tile < (int)boxes.size(); ++tile)
+            {
+                const Vec2f& depth = tileDepths[tile];
+                if (depth.x > depth.y)
+                {
+                    continue;
+                }
+
+                for (int c = 0; c < 4; ++c)
+                {
+                    Vec2i pixel = getTileOrigin(tile) + Vec2i(c & 1 ? getTileSize(tile).x : 0, c & 2 ? getTileSize(tile).y : 0);
+                    Vec2f ndc = 2.f * Vec2f(pixel) / Vec2f(size) - Vec2f(1.f);
+                    Vec4f onNear = clipToCamera * Vec4f(ndc.x, ndc.y, -1.f, 1.f);
+                    Vec3f ray = onNear.getXYZ() / onNear.w;
+
+                    for (int d = 0; d < 2; ++d)
+                    {
+                        Vec3f corner = ray * (depth[d] / -ray.z);
+                        boxes[tile].min = FW::min(boxes[tile].min, corner);
+                        boxes[tile].max = FW::max(boxes[tile].max, corner);
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < (int)lights.size(); ++i)
+        {
+            float radius = getInfluenceRadius(lights[i], threshold);
+            if (radius <= 0.f)
+            {
+                continue;
+            }
+
+            // The pixels the corners of the sphere's bounding box project to; a corner at or behind the camera
+            // plane makes it the whole screen.
+            Vec2i lo(0), hi = m_numTiles - 1;
+            if (radius < FLT_MAX)
+            {
+                Vec2f rectMin(FLT_MAX), rectMax(-FLT_MAX);
+                bool behind = false;
+
+                for (int c = 0; c < 8 && !behind; ++c)
+                {
+                    Vec3f corner = lights[i].position + radius * Vec3f(c & 1 ? 1.f : -1.f, c & 2 ? 1.f : -1.f, c & 4 ? 1.f : -1.f);
+                    Vec4f clip = worldToClip * Vec4f(corner, 1.f);
+                    if (clip.w <= 1e-6f)
+                    {
+                        behind = true;
+                        break;
+                    }
+
+                    Vec2f pixel = (0.5f * Vec2f(clip.x, clip.y) / clip.w + Vec2f(0.5f)) * Vec2f(size);
+                    rectMin = FW::min(rectMin, pixel);
+                    rectMax = FW::max(rectMax, pixel);
+                }
+
+                if (!behind)
+                {
+                    if (rectMax.x < 0.f || rectMax.y < 0.f || rectMin.x >= float(size.x) || rectMin.y >= float(size.y))
+                    {
+                        continue;
+                    }
+
+                    lo = FW::clamp(Vec2i((int)rectMin.x, (int)rectMin.y) / m_tileSize, Vec2i(0), m_numTiles - 1);
+                    hi = FW::clamp(Vec2i((int)rectMax.x, (int)rectMax.y) / m_tileSize, Vec2i(0), m_numTiles - 1);
+                }
+            }
+
+            // the same light in eye space for the boxes; the distances stay the same
+            Vpl eyeLight = lights[i];
+            eyeLight.position = (worldToCamera * Vec4f(lights[i].position, 1.f)).getXYZ();
+            eyeLight.normal = (worldToCamera * Vec4f(lights[i].normal, 0.f)).getXYZ();
+
+            for (int y = lo.y; y <= hi.y; ++y)
+            {
+                for (int x = lo.x; x <= hi.x; ++x)
+                {
+                    int tile = x + y * m_numTiles.x;
+                    if (!depthBounds || (boxes[tile].min.x <= boxes[tile].max.x && influencesBox(eyeLight, radius, boxes[tile])))
+                    {
+                        m_lights[tile].push_back(i);
+                    }
+                }
+            }
+        }
+    }
+
+    float TileLightLists::getAverageLights() const
+    {
+        if (m_lights.empty())
+        {
+            return 0.f;
+        }
+
+        S64 total = 0;
+        for (size_t t = 0; t < m_lights.size(); ++t)
+        {
+            total += m_lights[t].size();
+        }
+        return float(double(total) / m_lights.size());
+    }
+
+    float shadeDeferred(const GBuffer& gbuffer, const std::vector<Vpl>& lights, const std::vector<PrefilteredShadowMap>& maps,
+        int tileSize, float threshold, std::vector<Vec3f>& image)
+    {
+        const Vec2i& size = gbuffer.getSize();
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+        tileSize = FW::max(tileSize, 1);
+        Vec2i numTiles = (size + Vec2i(tileSize - 1)) / tileSize;
+
+        std::vector<float> radii(lights.size());
+        for (size_t l = 0; l < lights.size(); ++l)
+        {
+            radii[l] = getInfluenceRadius(lights[l], threshold);
+        }
+
+        S64 evaluated = 0;
+        int shadedTiles = 0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+:evaluated, shadedTiles)
+        for (int tile = 0; tile < numTiles.x * numTiles.y; ++tile)
+        {
+            Vec2i lo = Vec2i(tile % numTiles.x, tile / numTiles.x) * tileSize;
+            Vec2i hi = FW::min(lo + Vec2i(tileSize), size);
+
+            // the valid samples of the tile, packed, and their bounds
+            std::vector<int> pixels;
+            std::vector<Vec3f> irradiance;
+            pixels.reserve(tileSize * tileSize);
+            AABB bounds(Vec3f(FLT_MAX), Vec3f(-FLT_MAX));
+
+            for (int y = lo.y; y < hi.y; ++y)
+            {
+                for (int x = lo.x; x < hi.x; ++x)
+                {
+                    const GBufferSample& s = gbuffer.get(x, y);
+                    if (s.valid)
+                    {
+                        pixels.push_back(x + y * size.x);
+                        bounds.min = FW::min(bounds.min, s.position);
+                        bounds.max = FW::max(bounds.max, s.position);
+                    }
+                }
+            }
+
+            if (pixels.empty())
+            {
+                continue;
+            }
+
+            // the tile's light list
+            std::vector<int> tileLights;
+            for (int l = 0; l < (int)lights.size(); ++l)
+            {
+                if (threshold <= 0.f || influencesBox(lights[l], radii[l], bounds))
+                {
+                    tileLights.push_back(l);
+                }
+            }
+
+            evaluated += tileLights.size();
+            ++shadedTiles;
+            irradiance.assign(pixels.size(), Vec3f(0.f));
+
+            for (size_t k = 0; k < tileLights.size(); ++k)
+            {
+                const Vpl& light = lights[tileLights[k]];
+                const PrefilteredShadowMap& map = maps[tileLights[k]];
+
+                for (size_t j = 0; j < pixels.size(); ++j)
+                {
+                    const GBufferSample& s = gbuffer[pixels[j]];
+                    float g = evalVplGeometry(light, s.position, s.normal);
+                    if (g > 0.f)
+                    {
+                        irradiance[j] += light.E * (g * map.lookup(s.position));
+                    }
+                }
+            }
+
+            for (size_t j = 0; j < pixels.size(); ++j)
+            {
+                image[pixels[j]] = gbuffer[pixels[j]].albedo * irradiance[j];
+            }
+        }
+
+        return shadedTiles ? float(double(evaluated) / shadedTiles) : 0.f;
+    }
+}
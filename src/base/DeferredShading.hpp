@@ -0,0 +1,102 @@
+#pragma once
+
+
+#include "InstantRadiosity.hpp"
+#include "ManyLights.hpp"
+#include "PrefilteredShadowMap.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // The G-buffer of deferred shading on the GPU: the scene is rasterized once into textures of the eye-space
+    // positions, the normals and the albedos of the visible surfaces, and every light is then a screen-space pass
+    // over those (see InstantRadiosity::renderIndirectDeferred()) instead of another pass over the geometry. The
+    // cost of the lights is the number of pixels times the number of lights, whatever the triangle count.
+    class DeferredGBuffer
+    {
+    public:
+        enum Target
+        {
+            Target_Position = 0,    // eye space; w is 1 where a surface was drawn and 0 elsewhere
+            Target_Normal,          // eye space
+            Target_Albedo,
+            Target_Max
+        };
+
+        DeferredGBuffer() : m_framebuffer(0), m_depth(0), m_size(0), m_tileFramebuffer(0), m_tileTexture(0), m_tileTextureSize(0), m_depthTileSize(0)
+        {
+            for (int i = 0; i < Target_Max; ++i)
+                m_textures[i] = 0;
+        }
+        ~DeferredGBuffer() { free(); }
+
+        // Rasterizes the scene into the targets, which are (re)allocated to size. The culling is the caller's,
+        // like for LightSource::renderShadowedScene(). Leaves the G-buffer's framebuffer bound.
+        void render(GLContext* gl, MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection, const Vec2i& size);
+        void free();
+
+        const Vec2i& getSize() const { return m_size; }
+        GLuint getTexture(Target target) const { return m_textures[target]; }
+
+        // Reduces the eye-space depths (-z) of the surfaces in each screen tile of tileSize^2 pixels, laid out
+        // like in TileLightLists, to their minimum and maximum in a pass over the positions, and reads those
+        // back. A tile without surfaces gets an empty range, with the minimum above the maximum. Leaves the
+        // G-buffer's framebuffer bound; render() drops the depths.
+        void reduceTileDepths(GLContext* gl, int tileSize);
+        const std::vector<Vec2f>& getTileDepths() const { return m_tileDepths; }
+        int getDepthTileSize() const { return m_depthTileSize; }
+
+    private:
+        void allocate(const Vec2i& size);
+
+        GLuint m_framebuffer;
+        GLuint m_depth;
+        GLuint m_textures[Target_Max];
+        Vec2i m_size;
+
+        GLuint m_tileFramebuffer;           // a texel per tile for reduceTileDepths()
+        GLuint m_tileTexture;
+        Vec2i m_tileTextureSize;
+        std::vector<Vec2f> m_tileDepths;
+        int m_depthTileSize;
+    };
+
+    // Screen tiles of tileSize^2 pixels, each with the lights whose influence (see getInfluenceRadius()) reaches
+    // it. A light is first placed by the screen rectangle its influence sphere projects to. With the depth range
+    // of the surfaces in each tile (see DeferredGBuffer::reduceTileDepths()), a tile is then only the slice of its
+    // frustum between those depths, and a light has to influence the eye-space box around that slice like the
+    // CPU tiles test the boxes of their samples (see influencesBox()); tiles without surfaces get no lights.
+    class TileLightLists
+    {
+    public:
+        TileLightLists() : m_size(0), m_tileSize(0), m_numTiles(0) {}
+
+        // lights[i] gets index i in the lists. tileDepths holds the depth range of each tile, or is empty if
+        // they aren't known; the boxes assume the perspective projection of a camera at the eye-space origin.
+        void build(const Mat4f& worldToCamera, const Mat4f& projection, const Vec2i& size, const std::vector<Vpl>& lights,
+            int tileSize, float threshold, const std::vector<Vec2f>& tileDepths);
+
+        const Vec2i& getNumTiles() const { return m_numTiles; }
+        // Lower left corner and size of the tile in pixels; the tiles of the last row and column may be cut short.
+        Vec2i getTileOrigin(int tile) const { return Vec2i(tile % m_numTiles.x, tile / m_numTiles.x) * m_tileSize; }
+        Vec2i getTileSize(int tile) const { return FW::min(getTileOrigin(tile) + Vec2i(m_tileSize), m_size) - getTileOrigin(tile); }
+        const std::vector<int>& getLights(int tile) const { return m_lights[tile]; }
+        float getAverageLights() const;
+
+    private:
+        Vec2i m_size;
+        int m_tileSize;
+        Vec2i m_numTiles;
+        std::vector<std::vector<int>> m_lights;    // per tile
+    };
+
+    // The CPU counterpart: shades a GBuffer with lights[i] shadowed by maps[i], in tiles of tileSize^2 pixels.
+    // Each tile first gathers its valid samples, and then runs the lights in the outer loop and the samples in
+    // the inner one, so that a light's parameters and the part of its map the tile touches stay in the cache.
+    // A tile evaluates only the lights that influence the bounding box of its samples by threshold or more;
+    // 0 keeps them all. Returns the average number of lights a tile with samples evaluated.
+    float shadeDeferred(const GBuffer& gbuffer, const std::vector<Vpl>& lights, const std::vector<PrefilteredShadowMap>& maps,
+        int tileSize, float threshold, std::vector<Vec3f>& image);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+
+#include "RTTriangle.hpp"
+
+#include "base/Math.hpp"
+
+#include <limits>
+
+
+namespace FW
+{
+    // Minimal hit record filled in by traversal. Everything else about the surface is derived
+    // on demand with RayTracer::evaluateSurface(), only for the hits that actually get shaded.
+    struct Hit {
+        int triIdx;     // index of the hit triangle in the ray tracer's triangle array, -1 on a miss
+        float t;        // distance along the ray
+        float u, v;     // barycentric coordinates; weights of the triangle's second and third vertex
+
+        Hit() :
+            triIdx(-1),
+            t(std::numeric_limits<float>::max()),
+            u(0.f), v(0.f)
+        {}
+
+        inline bool valid() const { return triIdx >= 0; }
+        inline operator bool() const { return valid(); }
+    };
+
+
+    // Shading information at a hit point.
+    struct SurfaceInteraction {
+        const RTTriangle* tri;
+        const MeshBase::Material* material;
+        Vec3f position;
+        Vec3f geometricNormal;  // unit normal of the triangle plane
+        Vec3f normal;           // interpolated vertex normal
+        Vec2f uv;               // interpolated texture coordinates
+
+        SurfaceInteraction() :
+            tri(nullptr), material(nullptr),
+            position(), geometricNormal(), normal(), uv()
+        {}
+    };
+}
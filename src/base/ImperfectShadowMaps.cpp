@@ -0,0 +1,321 @@
+#include "ImperfectShadowMaps.hpp"
+
+#include "base/Random.hpp"
+#include "base/Timer.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <fstream>
+
+
+namespace FW
+{
+    namespace
+    {
+        const U32 ScenePointsMagic = 0x504d5349u;  // "ISMP"
+    }
+
+    void ScenePoints::build(const MeshWithColors& mesh, int num, U32 seed)
+    {
+        positions.clear();
+
+        // Cumulative triangle areas over all the submeshes.
+        std::vector<Vec3i> triangles;
+        std::vector<double> cdf;
+        double totalArea = 0.0;
+
+        for (int s = 0; s < mesh.numSubmeshes(); ++s)
+        {
+            const Array<Vec3i>& indices = mesh.indices(s);
+            for (int i = 0; i < indices.getSize(); ++i)
+            {
+                const Vec3i& t = indices[i];
+                Vec3f a = mesh.vertex(t.x).p, b = mesh.vertex(t.y).p, c = mesh.vertex(t.z).p;
+                totalArea += 0.5 * FW::cross(b - a, c - a).length();
+                triangles.push_back(t);
+                cdf.push_back(totalArea);
+            }
+        }
+
+        if (triangles.empty() || totalArea <= 0.0)
+        {
+            return;
+        }
+
+        Random rand(seed);
+        positions.resize(num);
+
+        for (int i = 0; i < num; ++i)
+        {
+            double x = rand.getF64() * totalArea;
+            size_t tri = std::min(size_t(std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin()), triangles.size() - 1);
+            const Vec3i& t = triangles[tri];
+
+            // Uniform in the triangle.
+            float su = FW::sqrt(rand.getF32());
+            float v = rand.getF32();
+            float wa = 1.f - su, wb = su * (1.f - v), wc = su * v;
+            positions[i] = wa * mesh.vertex(t.x).p + wb * mesh.vertex(t.y).p + wc * mesh.vertex(t.z).p;
+        }
+    }
+
+    bool ScenePoints::load(const std::string& fileName, int num)
+    {
+        std::ifstream in(fileName.c_str(), std::ios::binary);
+        U32 magic = 0;
+        S32 count = 0;
+
+        if (!in.read((char*)&magic, sizeof(magic)) || !in.read((char*)&count, sizeof(count)) || magic != ScenePointsMagic || count != num)
+        {
+            return false;
+        }
+
+        positions.resize(count);
+        if (!in.read((char*)positions.data(), count * sizeof(Vec3f)))
+        {
+            positions.clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    void ScenePoints::save(const std::string& fileName) const
+    {
+        std::ofstream out(fileName.c_str(), std::ios::binary);
+        U32 magic = ScenePointsMagic;
+        S32 count = size();
+
+        out.write((const char*)&magic, sizeof(magic));
+        out.write((const char*)&count, sizeof(count));
+        out.write((const char*)positions.data(), count * sizeof(Vec3f));
+    }
+
+    void ImperfectShadowMaps::render(const ScenePoints& points, const std::vector<Vpl>& vpls)
+    {
+        Timer timer(true);
+
+        int num = (int)vpls.size();
+        m_vpls = vpls;
+        m_worldToLight.resize(num);
+        m_cellsPerRow = num > 0 ? (int)FW::ceil(FW::sqrt(float(num))) : 0;
+
+        int atlasWidth = m_cellsPerRow * m_resolution;
+        m_atlas.assign(size_t(atlasWidth) * atlasWidth, FLT_MAX);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num; ++i)
+        {
+            // The light's frame, with the normal as z; formBasis puts it in the third column.
+            m_worldToLight[i] = formBasis(vpls[i].normal).transposed();
+
+            std::vector<float> cell;
+            splat(i, points, cell);
+            pullPush(cell);
+
+            Vec2i origin = getCellOrigin(i);
+            for (int y = 0; y < m_resolution; ++y)
+            {
+                std::copy(cell.begin() + y * m_resolution, cell.begin() + (y + 1) * m_resolution,
+                    m_atlas.begin() + (origin.y + y) * atlasWidth + origin.x);
+            }
+        }
+
+        m_stats.numMaps = num;
+        m_stats.pointsPerMap = FW::min(m_pointsPerMap, points.size());
+        m_stats.time = timer.end();
+    }
+
+    void ImperfectShadowMaps::splat(int vpl, const ScenePoints& points, std::vector<float>& cell) const
+    {
+        cell.assign(m_resolution * m_resolution, FLT_MAX);
+
+        int numPoints = points.size();
+        if (numPoints == 0)
+        {
+            return;
+        }
+
+        const Vpl& light = m_vpls[vpl];
+        const Mat3f& worldToLight = m_worldToLight[vpl];
+        int count = FW::min(m_pointsPerMap, numPoints);
+        int first = int((S64(vpl) * m_pointsPerMap) % numPoints);
+
+        for (int j = 0; j < count; ++j)
+        {
+            int index = first + j;
+            if (index >= numPoints)
+            {
+                index -= numPoints;
+            }
+
+            Vec3f d = points.positions[index] - light.position;
+            float distance = d.length();
+            if (distance <= 0.f)
+            {
+                continue;
+            }
+
+            Vec3f local = worldToLight * (d / distance);
+            if (local.z <= 0.f)
+            {
+                continue;
+            }
+
+            Vec2f uv = toParaboloid(local);
+            int x = FW::clamp(int(uv.x * m_resolution), 0, m_resolution - 1);
+            int y = FW::clamp(int(uv.y * m_resolution), 0, m_resolution - 1);
+
+            float& depth = cell[x + y * m_resolution];
+            depth = FW::min(depth, distance);
+        }
+    }
+
+    void ImperfectShadowMaps::pullPush(std::vector<float>& cell) const
+    {
+        // Pull: each coarser level averages the valid texels below it, until one texel is left.
+        std::vector<std::vector<float>> levels;
+        std::vector<int> sizes;
+        levels.push_back(cell);
+        sizes.push_back(m_resolution);
+
+        while (sizes.back() > 1)
+        {
+            const std::vector<float>& fine = levels.back();
+            int fineSize = sizes.back();
+            int size = (fineSize + 1) / 2;
+            std::vector<float> coarse(size * size, FLT_MAX);
+
+            for (int y = 0; y < size; ++y)
+            {
+                for (int x = 0; x < size; ++x)
+                {
+                    float sum = 0.f;
+                    int valid = 0;
+
+                    for (int dy = 0; dy < 2; ++dy)
+                    {
+                        for (int dx = 0; dx < 2; ++dx)
+                        {
+                            int fx = 2 * x + dx, fy = 2 * y + dy;
+                            if (fx < fineSize && fy < fineSize && fine[fx + fy * fineSize] < FLT_MAX)
+                            {
+                                sum += fine[fx + fy * fineSize];
+                                ++valid;
+                            }
+                        }
+                    }
+
+                    if (valid > 0)
+                    {
+                        coarse[x + y * size] = sum / float(valid);
+                    }
+                }
+            }
+
+            levels.push_back(std::move(coarse));
+            sizes.push_back(size);
+        }
+
+        // Push: holes take the value of their parent, from the coarsest level down.
+        for (int l = (int)levels.size() - 2; l >= 0; --l)
+        {
+            std::vector<float>& fine = levels[l];
+            const std::vector<float>& coarse = levels[l + 1];
+            int fineSize = sizes[l];
+            int size = sizes[l + 1];
+
+            for (int y = 0; y < fineSize; ++y)
+            {
+                for (int x = 0; x < fineSize; ++x)
+                {
+                    float& depth = fine[x + y * fineSize];
+                    if (depth == FLT_MAX)
+                    {
+                        depth = coarse[x / 2 + (y / 2) * size];
+                    }
+                }
+            }
+        }
+
+        cell.swap(levels[0]);
+    }
+
+    float ImperfectShadowMaps::lookup(int vpl, const Vec3f& p) const
+    {
+        const Vpl& light = m_vpls[vpl];
+        Vec3f d = p - light.position;
+        float distance = d.length();
+        if (distance <= 0.f)
+        {
+            return 1.f;
+        }
+
+        Vec3f local = m_worldToLight[vpl] * (d / distance);
+        if (local.z <= 0.f)
+        {
+            return 0.f;
+        }
+
+        // Percentage closer filtering of the four nearest texels, to hide the blockiness of the small maps.
+        Vec2f uv = toParaboloid(local) * float(m_resolution) - Vec2f(0.5f);
+        int x0 = (int)FW::floor(uv.x), y0 = (int)FW::floor(uv.y);
+        float fx = uv.x - float(x0), fy = uv.y - float(y0);
+
+        Vec2i origin = getCellOrigin(vpl);
+        int atlasWidth = m_cellsPerRow * m_resolution;
+        float threshold = distance / (1.f + m_depthBias);
+        float lit = 0.f;
+
+        for (int dy = 0; dy < 2; ++dy)
+        {
+            for (int dx = 0; dx < 2; ++dx)
+            {
+                int x = FW::clamp(x0 + dx, 0, m_resolution - 1);
+                int y = FW::clamp(y0 + dy, 0, m_resolution - 1);
+                float w = (dx ? fx : 1.f - fx) * (dy ? fy : 1.f - fy);
+
+                if (threshold <= m_atlas[size_t(origin.y + y) * atlasWidth + origin.x + x])
+                {
+                    lit += w;
+                }
+            }
+        }
+
+        return lit;
+    }
+
+    void ImperfectShadowMaps::shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, std::vector<Vec3f>& image) const
+    {
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < gbuffer.getNumPixels(); ++i)
+        {
+            const GBufferSample& s = gbuffer[i];
+            if (!s.valid)
+            {
+                continue;
+            }
+
+            // The main light casts the sharp shadows; it keeps its shadow ray.
+            Vec3f irradiance(0.f);
+            Vec3f direct = evalVpl(mainLight, s.position, s.normal);
+            if (direct.max() > 0.f && isVisible(rt, s, mainLight.position))
+            {
+                irradiance += direct;
+            }
+
+            for (int j = 0; j < (int)m_vpls.size(); ++j)
+            {
+                Vec3f contribution = evalVpl(m_vpls[j], s.position, s.normal);
+                if (contribution.max() > 0.f)
+                {
+                    irradiance += contribution * lookup(j, s.position);
+                }
+            }
+
+            image[i] = s.albedo * irradiance;
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+
+#include "ManyLights.hpp"
+
+#include <string>
+#include <vector>
+
+
+namespace FW
+{
+    // Points spread over the surfaces of the scene in proportion to their area, in random order, so that
+    // any contiguous run of them is itself a uniform sample of the scene.
+    struct ScenePoints
+    {
+        std::vector<Vec3f> positions;
+
+        void build(const MeshWithColors& mesh, int num, U32 seed);
+
+        // A binary cache next to the mesh, like the hierarchy; load() fails if it holds a different number of points.
+        bool load(const std::string& fileName, int num);
+        void save(const std::string& fileName) const;
+
+        int size() const { return (int)positions.size(); }
+    };
+
+
+    // Imperfect shadow maps [Ritschel et al. 2008]: instead of rasterizing the scene for every VPL, each VPL
+    // splats its own subset of the scene points into a small paraboloid depth map of the hemisphere around
+    // its normal, and the holes the sparse points leave are filled with a pull-push pass. The maps are
+    // wrong in the details, but each one costs only a few thousand point splats, so thousands of them fit
+    // in a frame. All the maps are cells of one depth atlas; they are rendered in parallel, one per thread.
+    class ImperfectShadowMaps
+    {
+    public:
+        struct Stats
+        {
+            int numMaps;
+            int pointsPerMap;
+            float time;         // seconds spent in render()
+        };
+
+        ImperfectShadowMaps() :
+            m_resolution(32),
+            m_pointsPerMap(2048),
+            m_depthBias(0.05f),
+            m_cellsPerRow(0)
+        {
+            m_stats.numMaps = m_stats.pointsPerMap = 0;
+            m_stats.time = 0.f;
+        }
+
+        void setResolution(int resolution) { m_resolution = FW::max(2, resolution); }
+        void setPointsPerMap(int points) { m_pointsPerMap = FW::max(1, points); }
+        // Relative to the distance to the light; the maps are too coarse for an absolute bias.
+        void setDepthBias(float bias) { m_depthBias = bias; }
+
+        // Renders a map for every VPL. VPL i splats the pointsPerMap points that follow points[i * pointsPerMap],
+        // wrapping around, so the VPLs see different subsets as long as there are enough points.
+        void render(const ScenePoints& points, const std::vector<Vpl>& vpls);
+
+        // The shadow test of the map of VPL i: 1 if p is lit, 0 if not.
+        float lookup(int vpl, const Vec3f& p) const;
+
+        // Shades the G-buffer with the main light, with shadow rays, and every VPL, with the maps of the last render().
+        void shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, std::vector<Vec3f>& image) const;
+
+        int getResolution() const { return m_resolution; }
+        const Stats& getStats() const { return m_stats; }
+
+        // The whole atlas, row 0 at the bottom, with the empty texels at FLT_MAX.
+        Vec2i getAtlasSize() const { return Vec2i(m_cellsPerRow * m_resolution); }
+        const std::vector<float>& getAtlas() const { return m_atlas; }
+
+    private:
+        // Paraboloid coordinates in [0, 1]^2 of a unit direction given in the frame of the light, whose z axis is
+        // the light's normal. Directions with z <= 0 are outside the map.
+        static Vec2f toParaboloid(const Vec3f& local) { return Vec2f(local.x, local.y) / (2.f * (1.f + local.z)) + Vec2f(0.5f); }
+
+        void splat(int vpl, const ScenePoints& points, std::vector<float>& cell) const;
+        void pullPush(std::vector<float>& cell) const;
+        Vec2i getCellOrigin(int vpl) const { return Vec2i(vpl % m_cellsPerRow, vpl / m_cellsPerRow) * m_resolution; }
+
+        int m_resolution;
+        int m_pointsPerMap;
+        float m_depthBias;
+
+        std::vector<Vpl> m_vpls;
+        std::vector<Mat3f> m_worldToLight;  // per VPL: rotates world directions into the frame of the light
+        std::vector<float> m_atlas;         // distances from the lights
+        int m_cellsPerRow;
+        Stats m_stats;
+    };
+}
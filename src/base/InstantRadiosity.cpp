@@ -1,8 +1,39 @@
 #include "InstantRadiosity.hpp"
+#include "ManyLights.hpp"
+#include "DeferredShading.hpp"
+
+#include <algorithm>
+#include <limits>
 
 
 namespace FW
 {
+    namespace
+    {
+        // renderIndirectDeferred(): the texels of a light's row, and the width of the rows of tile lists.
+        const int LightTexels = 9;
+        const int IndexTextureWidth = 4096;
+
+        // (Re)allocates a nearest-filtered float texture for the parameters renderIndirectDeferred() reads. It
+        // binds on unit 0, which the passes don't use.
+        void uploadDeferredTexture(GLuint& texture, GLint internalFormat, GLenum format, const Vec2i& size, const void* data)
+        {
+            glActiveTexture(GL_TEXTURE0);
+            if (!texture)
+            {
+                glGenTextures(1, &texture);
+                glBindTexture(GL_TEXTURE_2D, texture);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+            }
+
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, size.x, size.y, 0, format, GL_FLOAT, data);
+        }
+    }
+
     void InstantRadiosity::castIndirect(RayTracer* rt, MeshWithColors* scene, const LightSource& ls, int num)
     {
         // If the caller requests a different number of lights than before, reallocate everything.
@@ -17,91 +48,1460 @@ namespace FW
                 iter.setEnabled(false);
         }
 
-        // Request #num exiting rays from the light.
+        m_paths.clear();
+        m_shadowMapDirty.assign(num, 1);
+
+        if (m_cameraResampling)
+        {
+            m_slotCandidates.assign(num, -1);
+            castResampled(rt, ls, num, true);
+            return;
+        }
+
+        // Request #num exiting rays from the light. Every path uses at least one of the VPL slots,
+        // so no more than #num paths can ever be started.
         std::vector<Vec3f> origs, dirs, E_times_pdf;
-        ls.sampleEmittedRays(num, origs, dirs, E_times_pdf);
-
-        // You'll probably want to implement the sampleEmittedRays() function before the rest of this function,
-        // because otherwise you won't have much to trace.
-        //
-        // At this point m_indirectLights holds #num lights that are off.
-        //
-        // Loop through the rays and fill in the corresponding lights in m_indirectLights
-        // based on what happens to the ray.
-        for (int i = 0; i < num; ++i)
+        ls.sampleEmittedRays(num, origs, dirs, E_times_pdf, m_emissionSampler, m_emissionSeed);
+
+        // Trace the light paths in parallel batches. Each path deposits a VPL at every vertex;
+        // paths are accepted in order until the VPL budget is used up. The paths carry their throughput
+        // only; the light's power is distributed over them in applyPathPower().
+        int numSlots = 0;
+        bool budgetFull = false;
+        const int batchSize = 64;
+
+        while (!budgetFull && int(m_paths.size()) < num)
         {
-            RaycastResult result = rt->raycast(origs[i], dirs[i]);
+            int batchBegin = int(m_paths.size());
+            int batchEnd = FW::min(num, batchBegin + batchSize);
+            std::vector<std::vector<IndirectLight>> pathVpls(batchEnd - batchBegin);
+
+#pragma omp parallel for schedule(dynamic)
+            for (int i = batchBegin; i < batchEnd; ++i)
+            {
+                tracePath(rt, Ray(origs[i], dirs[i], 0.f, ls.getFar()), Vec3f(1.f), ls.getFar(), i, pathVpls[i - batchBegin]);
+            }
 
-            if (result.tri != nullptr)
+            for (int i = batchBegin; i < batchEnd; ++i)
             {
-                // YOUR CODE HERE (R4):
-                // Ray hit the scene, now position the light m_indirectLights[i] correctly,
-                // color it based on the texture or diffuse color, etc. (see the LightSource declaration for the list 
-                // of things that a light source needs to have)
-                // A lot of this code is like in the Assignment 2's corresponding routine.
-                const Vec3i& indices = result.tri->m_data.vertex_indices;
+                const std::vector<IndirectLight>& vpls = pathVpls[i - batchBegin];
 
-                // check for backfaces => don't accumulate if we hit a surface from below!
-                if (FW::dot(dirs[i], -result.tri->normal()) < 0.f)
+                if (numSlots + int(vpls.size()) > num)
                 {
-                    continue;
+                    budgetFull = true;
+                    break;
+                }
+
+                LightPath path;
+                path.diskCoord = toDiskCoord(ls, dirs[i]);
+
+                for (const IndirectLight& vpl : vpls)
+                {
+                    path.slots.push_back(numSlots);
+                    path.throughput.push_back(vpl.E);
+                    writeSlot(numSlots++, vpl);
                 }
 
-                // fetch barycentric coordinates
-                float alpha = result.u;
-                float beta = result.v;
+                setPathPdf(path, ls);
+                m_paths.push_back(path);
+            }
+        }
 
-                Vec3f Ei;
+        // Unused slots are switched off so they're skipped in all rendering operations.
+        for (int i = numSlots; i < num; ++i)
+        {
+            m_indirectLights[i].setEnabled(false);
+        }
 
-                // check for texture
-                const auto mat = result.tri->m_material;
+        m_nextPathIndex = num;
+        m_pathsComplete = true;
+        applyPathPower(ls);
+    }
 
-                if (mat->textures[MeshBase::TextureType_Diffuse].exists())
-                {
-                    // read diffuse texture like in assignment1
-                    const Texture& tex = mat->textures[MeshBase::TextureType_Diffuse];
-                    const Image& texImg = *tex.getImage();
+    void InstantRadiosity::castResampled(RayTracer* rt, const LightSource& ls, int num, bool retrace)
+    {
+        // Trace the oversampled set of light paths unless only the view changed; the light's power is shared
+        // by all of them.
+        if (retrace)
+        {
+            int numPaths = num * m_oversampling;
+
+            std::vector<Vec3f> origs, dirs, E_times_pdf;
+            ls.sampleEmittedRays(numPaths, origs, dirs, E_times_pdf, m_emissionSampler, m_emissionSeed);
+
+            std::vector<std::vector<IndirectLight>> pathVpls(numPaths);
+
+#pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < numPaths; ++i)
+            {
+                tracePath(rt, Ray(origs[i], dirs[i], 0.f, ls.getFar()), Vec3f(1.f), ls.getFar(), i, pathVpls[i]);
+            }
 
-                    Vec2f uv = alpha * scene->vertex(indices[0]).t +
-                        beta * scene->vertex(indices[1]).t +
-                        (1.f - alpha - beta) * scene->vertex(indices[2]).t;
+            float r = FW::sin(0.5f * ls.getFOVRad());
+            Vec3f share = ls.getEmission() * (r * r / float(numPaths));
 
-                    Ei = texImg.getVec4f(FW::getTexelCoords(uv, texImg.getSize())).getXYZ();
+            m_candidates.clear();
+            for (const std::vector<IndirectLight>& vpls : pathVpls)
+            {
+                for (IndirectLight vpl : vpls)
+                {
+                    vpl.E *= share;
+                    m_candidates.push_back(vpl);
                 }
-                else
+            }
+        }
+
+        const std::vector<IndirectLight>& candidates = m_candidates;
+        int numCandidates = int(candidates.size());
+
+        // Camera path samples: first hits of rays through stratified points of the view.
+        std::vector<Vec2f> screenPoints;
+        generateSamples2D(SamplerType_Sobol, m_numCameraSamples, 5678, screenPoints);
+
+        Mat4f clipToWorld = m_worldToClip.inverted();
+        std::vector<GBufferSample> cameraSamples;
+
+        m_cachedWorldToClip = m_worldToClip;
+        m_cameraSamplePositions.clear();
+
+        for (const Vec2f& u : screenPoints)
+        {
+            GBufferSample s;
+            if (traceCameraSample(*rt, clipToWorld, 2.f * u - Vec2f(1.f), s))
+            {
+                cameraSamples.push_back(s);
+                m_cameraSamplePositions.push_back(s.position);
+            }
+        }
+
+        // Importance of a candidate: the luminance it reflects towards the camera through the samples.
+        float cosHalfFov = FW::cos(0.5f * m_indirectFOV * FW_PI / 180.f);
+        std::vector<float> importance(numCandidates, 0.f);
+
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int j = 0; j < numCandidates; ++j)
+        {
+            Vpl vpl;
+            vpl.position = candidates[j].position;
+            vpl.normal = candidates[j].normal;
+            vpl.E = candidates[j].E;
+            vpl.cosHalfFov = cosHalfFov;
+
+            for (const GBufferSample& s : cameraSamples)
+            {
+                Vec3f c = s.albedo * evalVpl(vpl, s.position, s.normal);
+                float luminance = c.x + c.y + c.z;
+
+                if (luminance > 0.f && isVisible(*rt, s, vpl.position))
                 {
-                    // no texture, use constant albedo from material structure.
-                    Ei = mat->diffuse.getXYZ();
+                    importance[j] += luminance;
                 }
+            }
+        }
+
+        // Selection probabilities: proportional to the importance, mixed with a uniform share so that the
+        // candidates the few camera samples missed can still be picked and the estimate stays unbiased.
+        double total = 0.0;
+        for (float v : importance)
+        {
+            total += v;
+        }
+
+        const float uniformShare = total > 0.0 ? 0.1f : 1.f;
+        std::vector<float> pdf(numCandidates);
 
-                m_indirectLights[i].setEmission(E_times_pdf[i] * Ei);
-                m_indirectLights[i].setOrientation(FW::formBasis(-result.tri->normal()));
-                m_indirectLights[i].setPosition(result.point);
-                m_indirectLights[i].setFOV(m_indirectFOV);
+        for (int j = 0; j < numCandidates; ++j)
+        {
+            float proportional = total > 0.0 ? float(importance[j] / total) : 0.f;
+            pdf[j] = (1.f - uniformShare) * proportional + uniformShare / numCandidates;
+        }
+
+        // Systematic resampling: #num evenly spaced points through the cumulative distribution. A candidate
+        // picked several times takes a single slot with the combined weight.
+        std::vector<int> picks(numCandidates, 0);
+        Random rand(2468);
+        float offset = rand.getF32();
+        float cdf = 0.f;
+        int j = 0;
+
+        for (int k = 0; k < num && numCandidates > 0; ++k)
+        {
+            float u = (k + offset) / num;
+            while (j < numCandidates - 1 && cdf + pdf[j] <= u)
+            {
+                cdf += pdf[j++];
+            }
+            ++picks[j];
+        }
 
-                // Replace this with true once your light is ready to be used in rendering:
-                m_indirectLights[i].setEnabled(true);
+        // A slot whose candidate is picked again keeps its place and its shadow map; a retraced candidate
+        // with the same index is the same one if it landed in the same spot. Only the rest are rewritten.
+        std::vector<int> candidateSlots(numCandidates, -1);
+        std::vector<int> freeSlots;
+
+        for (int i = num - 1; i >= 0; --i)
+        {
+            int c = m_slotCandidates[i];
+            if (c >= 0 && c < numCandidates && picks[c] > 0 && m_indirectLights[i].isEnabled() &&
+                m_indirectLights[i].getPosition() == candidates[c].position)
+            {
+                candidateSlots[c] = i;
             }
             else
             {
-                // If we missed the scene, disable the light so it's skipped in all rendering operations.
-                m_indirectLights[i].setEnabled(false);
+                m_slotCandidates[i] = -1;
+                freeSlots.push_back(i);
+            }
+        }
+
+        for (int c = 0; c < numCandidates; ++c)
+        {
+            if (picks[c] == 0)
+            {
+                continue;
+            }
+
+            IndirectLight vpl = candidates[c];
+            vpl.E *= float(picks[c]) / (num * pdf[c]);
+
+            if (candidateSlots[c] < 0)
+            {
+                candidateSlots[c] = freeSlots.back();
+                freeSlots.pop_back();
+                m_slotCandidates[candidateSlots[c]] = c;
+                writeSlot(candidateSlots[c], vpl);
+            }
+            m_indirectLights[candidateSlots[c]].setEmission(vpl.E);
+        }
+
+        for (int i : freeSlots)
+        {
+            m_indirectLights[i].setEnabled(false);
+        }
+
+        // The selected VPLs don't form whole paths anymore, so there is nothing to update incrementally.
+        m_nextPathIndex = num * m_oversampling;
+        m_pathsComplete = true;
+    }
+
+    void InstantRadiosity::updateIncremental(RayTracer* rt, const LightSource& ls, bool lightChanged)
+    {
+        if (lightChanged)
+        {
+            // Drop the paths that aren't valid light paths from the new pose anymore; everything
+            // downstream of a still valid first vertex stays valid, as it doesn't depend on the light.
+            std::vector<LightPath> kept;
+            kept.reserve(m_paths.size());
+
+            for (LightPath& path : m_paths)
+            {
+                if (revalidatePath(rt, ls, path))
+                {
+                    kept.push_back(std::move(path));
+                    continue;
+                }
+
+                for (int slot : path.slots)
+                {
+                    m_indirectLights[slot].setEnabled(false);
+                }
+            }
+
+            m_paths.swap(kept);
+            m_pathsComplete = false;
+        }
+
+        std::vector<int> freeSlots;
+        for (int i = int(m_indirectLights.size()) - 1; i >= 0; --i)
+        {
+            if (!m_indirectLights[i].isEnabled())
+            {
+                freeSlots.push_back(i);
+            }
+        }
+
+        // Add at most m_updateBudget new paths per frame, so the set converges without ever being traced again
+        // from scratch. They continue the point set of castIndirect(), whose later points fill in between the
+        // earlier ones, and each of them is uniform over the disk like the paths applyPathPower() weights.
+        Mat3f basis = FW::formBasis(ls.getNormal());
+        float r = FW::sin(0.5f * ls.getFOVRad());
+        std::vector<Vec2f> disk;
+        if (!m_pathsComplete)
+        {
+            generateDiskSamples(m_emissionSampler, m_nextPathIndex + m_updateBudget, m_emissionSeed, disk);
+        }
+
+        for (int added = 0; added < m_updateBudget && !m_pathsComplete; ++added)
+        {
+            if (m_paths.size() >= m_indirectLights.size())
+            {
+                m_pathsComplete = true;
+                break;
+            }
+
+            Vec2f diskCoord = disk[m_nextPathIndex];
+            Vec3f dir = (basis * Vec3f(diskCoord * r, FW::sqrt(FW::max(0.f, 1.f - FW::lenSqr(diskCoord * r))))).normalized();
+
+            std::vector<IndirectLight> vpls;
+            tracePath(rt, Ray(ls.getPosition(), dir, 0.f, ls.getFar()), Vec3f(1.f), ls.getFar(), m_nextPathIndex++, vpls);
+
+            if (vpls.size() > freeSlots.size())
+            {
+                m_pathsComplete = true;
+                break;
+            }
+
+            LightPath path;
+            path.diskCoord = diskCoord;
+
+            for (const IndirectLight& vpl : vpls)
+            {
+                int slot = freeSlots.back();
+                freeSlots.pop_back();
+
+                path.slots.push_back(slot);
+                path.throughput.push_back(vpl.E);
+                writeSlot(slot, vpl);
+            }
+
+            setPathPdf(path, ls);
+            m_paths.push_back(path);
+        }
+
+        applyPathPower(ls);
+    }
+
+    bool InstantRadiosity::revalidatePath(RayTracer* rt, const LightSource& ls, LightPath& path) const
+    {
+        Vec3f lightPos = ls.getPosition();
+
+        if (path.slots.empty())
+        {
+            // The path deposited nothing (it left the scene or hit a backface). It stays a valid zero
+            // sample for as long as its first ray still does the same.
+            Mat3f basis = FW::formBasis(ls.getNormal());
+            float r = FW::sin(0.5f * ls.getFOVRad());
+            Vec3f dir = (basis * Vec3f(path.diskCoord * r, FW::sqrt(FW::max(0.f, 1.f - FW::lenSqr(path.diskCoord * r))))).normalized();
+
+            Hit hit;
+            if (!rt->intersect<TraceFeature_MaxDistance | TraceFeature_AlphaTest>(Ray(lightPos, dir, 0.f, ls.getFar()), hit))
+            {
+                return true;
+            }
+
+            return FW::dot(dir, -rt->evaluateSurface(hit).geometricNormal) < 0.f;
+        }
+
+        // Reproject the first vertex: it has to be within the cone and range of the light, face it, and see it.
+        const LightSource& first = m_indirectLights[path.slots[0]];
+        Vec3f d = first.getPosition() - lightPos;
+        float distance = d.length();
+
+        if (distance <= 0.f || distance > ls.getFar())
+        {
+            return false;
+        }
+
+        Vec3f dir = d / distance;
+        Vec2f diskCoord = toDiskCoord(ls, dir);
+
+        if (FW::dot(dir, ls.getNormal()) <= 0.f || FW::lenSqr(diskCoord) > 1.f || FW::dot(dir, first.getNormal()) >= 0.f)
+        {
+            return false;
+        }
+
+        if (rt->occluded<TraceFeature_MaxDistance | TraceFeature_AlphaTest>(Ray::segment(lightPos, first.getPosition())))
+        {
+            return false;
+        }
+
+        // The vertex was placed with the density of the pose it was traced from; in the disk of this pose,
+        // that density changes with the distance and the two cosines.
+        path.diskCoord = diskCoord;
+        path.diskPdf = path.vertexPdf / getDiskJacobian(ls, first.getPosition(), first.getNormal());
+        return true;
+    }
+
+    Vec2f InstantRadiosity::toDiskCoord(const LightSource& ls, const Vec3f& dir)
+    {
+        // inverse of the mapping in sampleEmittedRays(): the basis is orthonormal, so its transpose inverts it
+        Vec3f local = FW::formBasis(ls.getNormal()).transposed() * dir;
+        float r = FW::sin(0.5f * ls.getFOVRad());
+        return r > 0.f ? Vec2f(local.x, local.y) / r : Vec2f(0.f);
+    }
+
+    float InstantRadiosity::getDiskJacobian(const LightSource& ls, const Vec3f& position, const Vec3f& normal)
+    {
+        // Unit disk area per surface area at the position: a disk of radius r covers the projected solid angle
+        // PI r^2, and the projected solid angle of a surface element is cos_light cos_surface dA / d^2.
+        Vec3f d = position - ls.getPosition();
+        float r = FW::sin(0.5f * ls.getFOVRad());
+        float lenSqr = d.lenSqr();
+        if (r <= 0.f || lenSqr <= 0.f)
+        {
+            return 0.f;
+        }
+
+        Vec3f dir = d / FW::sqrt(lenSqr);
+        return FW::max(0.f, FW::dot(dir, ls.getNormal())) * FW::max(0.f, -FW::dot(dir, normal)) / (r * r * lenSqr);
+    }
+
+    void InstantRadiosity::setPathPdf(LightPath& path, const LightSource& ls) const
+    {
+        // drawn uniformly from the unit disk
+        path.diskPdf = 1.f / FW_PI;
+        path.vertexPdf = path.slots.empty() ? 0.f : path.diskPdf * getDiskJacobian(ls, m_indirectLights[path.slots[0]].getPosition(), m_indirectLights[path.slots[0]].getNormal());
+    }
+
+    void InstantRadiosity::writeSlot(int slot, const IndirectLight& vpl)
+    {
+        LightSource& light = m_indirectLights[slot];
+        light.setOrientation(FW::formBasis(-vpl.normal));
+        light.setPosition(vpl.position);
+        light.setFOV(m_indirectFOV);
+        light.setProjection(m_paraboloid ? LightSource::Projection_Paraboloid : LightSource::Projection_Perspective);
+        light.setEnabled(true);
+        m_shadowMapDirty[slot] = 1;
+    }
+
+    void InstantRadiosity::applyPathPower(const LightSource& ls)
+    {
+        // Each path carries the power leaving the light's cone divided by the number of paths and by the density
+        // its disk coordinate has under the current pose, relative to the uniform 1 / PI of sampleEmittedRays()
+        // (whose pdf cancels the lambert cosine). The paths kept over a move have the density of the pose they
+        // were traced from, see revalidatePath(). Paths that left the scene count too; they deposit nothing.
+        float r = FW::sin(0.5f * ls.getFOVRad());
+
+        for (const LightPath& path : m_paths)
+        {
+            Vec3f share = ls.getEmission() * (r * r / (float(m_paths.size()) * FW_PI * path.diskPdf));
+            for (size_t k = 0; k < path.slots.size(); ++k)
+            {
+                m_indirectLights[path.slots[k]].setEmission(path.throughput[k] * share);
+            }
+        }
+    }
+
+    void InstantRadiosity::tracePath(RayTracer* rt, Ray ray, Vec3f power, float far, int pathIndex,
+        std::vector<IndirectLight>& vpls) const
+    {
+        // Seeded per path, so that the same paths are traced on every frame. Otherwise it'll flicker.
+        Random rand(m_emissionSeed + 7919 * pathIndex);
+
+        for (int bounce = 0; bounce < m_numBounces; ++bounce)
+        {
+            Hit hit;
+
+            // alpha-tested, so that the VPLs don't land on cut-out foliage the GL shader discards
+            if (!rt->intersect<TraceFeature_MaxDistance | TraceFeature_AlphaTest>(ray, hit))
+            {
+                return;
+            }
+
+            SurfaceInteraction si = rt->evaluateSurface(hit);
+
+            // check for backfaces => don't accumulate if we hit a surface from below!
+            if (FW::dot(ray.dir, -si.geometricNormal) < 0.f)
+            {
+                return;
+            }
+
+            Vec3f albedo = evalAlbedo(si);
+
+            IndirectLight vpl;
+            vpl.position = si.position;
+            vpl.normal = si.geometricNormal;
+            vpl.E = power * albedo;
+            vpls.push_back(vpl);
+
+            // Continue with a cosine-weighted direction: the cosine and the pdf cancel, leaving the albedo
+            // as the throughput. Russian roulette on the albedo keeps the expected power unchanged.
+            float survival = FW::min(1.f, albedo.max());
+
+            if (bounce + 1 == m_numBounces || rand.getF32() >= survival)
+            {
+                return;
             }
+
+            power *= albedo / survival;
+
+            float r = FW::sqrt(rand.getF32());
+            float phi = 2.f * FW_PI * rand.getF32();
+            Vec3f local(r * FW::cos(phi), r * FW::sin(phi), FW::sqrt(FW::max(0.f, 1.f - r * r)));
+            Vec3f dir = (FW::formBasis(si.geometricNormal) * local).normalized();
+
+            ray = Ray::spawn(si.position, si.geometricNormal, dir, far);
+        }
+    }
+
+    bool InstantRadiosity::updateIndirect(RayTracer* rt, MeshWithColors* scene, const LightSource& ls, int num, U32 sceneVersion)
+    {
+        bool settingsChanged = !m_cacheValid ||
+            m_cachedSceneVersion != sceneVersion ||
+            m_cachedNum != num ||
+            m_cachedBounces != m_numBounces ||
+            m_cachedFOV != m_indirectFOV ||
+            m_cachedSampler != m_emissionSampler ||
+            m_cachedResampling != m_cameraResampling;
+
+        if (m_cameraResampling)
+        {
+            settingsChanged = settingsChanged ||
+                m_cachedOversampling != m_oversampling ||
+                m_cachedCameraSamples != m_numCameraSamples;
+        }
+
+        bool lightChanged = m_cachedLightVersion != ls.getVersion();
+
+        if (settingsChanged || (lightChanged && !m_incremental && !m_cameraResampling))
+        {
+            castIndirect(rt, scene, ls, num);
+        }
+        else if (m_cameraResampling)
+        {
+            // A moved light needs new candidates; a moved camera only a new selection among them, and not
+            // before the view has changed noticeably.
+            if (!lightChanged && getViewChange() <= m_resampleThreshold)
+            {
+                return false;
+            }
+            castResampled(rt, ls, num, lightChanged);
+        }
+        else if (lightChanged || !m_pathsComplete)
+        {
+            // Keep what is still valid and spend a bounded amount of work on the rest.
+            updateIncremental(rt, ls, lightChanged);
+        }
+        else
+        {
+            return false;
+        }
+
+        m_cacheValid = true;
+        m_cachedLightVersion = ls.getVersion();
+        m_cachedSceneVersion = sceneVersion;
+        m_cachedNum = num;
+        m_cachedBounces = m_numBounces;
+        m_cachedFOV = m_indirectFOV;
+        m_cachedSampler = m_emissionSampler;
+        m_cachedResampling = m_cameraResampling;
+        m_cachedOversampling = m_oversampling;
+        m_cachedCameraSamples = m_numCameraSamples;
+        return true;
+    }
+
+    float InstantRadiosity::getViewChange() const
+    {
+        // Mean displacement of the last resampling's camera samples in normalized device coordinates.
+        if (m_cameraSamplePositions.empty())
+        {
+            return m_cachedWorldToClip != m_worldToClip ? FW_F32_MAX : 0.f;
+        }
+
+        float sum = 0.f;
+        for (const Vec3f& p : m_cameraSamplePositions)
+        {
+            Vec4f before = m_cachedWorldToClip * Vec4f(p, 1.f);
+            Vec4f after = m_worldToClip * Vec4f(p, 1.f);
+            if (after.w <= 0.f)
+            {
+                return FW_F32_MAX;
+            }
+            sum += (after.getXY() / after.w - before.getXY() / before.w).length();
         }
+        return sum / float(m_cameraSamplePositions.size());
     }
 
-    void InstantRadiosity::renderShadowMaps(MeshWithColors* scene)
+    void InstantRadiosity::renderShadowMaps(MeshWithColors* scene, ShadowCuller* culler)
     {
         // YOUR CODE HERE (R4):
         // Loop through all lights, and call the shadow map renderer for those that are enabled.
         // (see App::renderFrame for an example usage of the shadow map rendering call)
-        for (auto it = m_indirectLights.begin(); it != m_indirectLights.end(); ++it)
+        // Only the lights that moved since their shadow map was rendered need a new one.
+        if (m_useAtlas)
+        {
+            layoutAtlas();
+        }
+
+        m_shadowStats = ShadowStats();
+
+        for (size_t i = 0; i < m_indirectLights.size(); ++i)
+        {
+            if (m_indirectLights[i].isEnabled() && m_shadowMapDirty[i])
+            {
+                // a simplified scene, and its own culler, if the map's texels are too coarse to show the difference
+                MeshWithColors* levelScene = scene;
+                ShadowCuller* levelCuller = culler;
+                int resolution = m_useAtlas ? m_atlas.getCellSize(int(i)) : m_smResolution.x;
+                int level = m_shadowLod ? m_shadowLod->selectLevel(m_indirectLights[i], resolution, m_lodTexelError) : 0;
+
+                if (level > 0)
+                {
+                    levelScene = m_shadowLod->getMesh(level);
+                    levelCuller = culler ? &m_shadowLod->getCuller(level) : nullptr;
+                }
+
+                if (m_useAtlas)
+                    m_indirectLights[i].renderShadowMap(m_gl, levelScene, &m_atlas, int(i), levelCuller);
+                else
+                    m_indirectLights[i].renderShadowMap(m_gl, levelScene, &m_smContext, false, levelCuller);
+                m_shadowStats.add(m_indirectLights[i].getShadowMapTriangles());
+
+                if (!m_useAtlas && m_shadowFilter.filter != ShadowFilter_None)
+                {
+                    DepthMap map;
+                    PrefilteredShadowMap filtered;
+                    m_indirectLights[i].downloadShadowMap(&m_smContext, map);
+                    filtered.build(map, m_indirectLights[i], m_filterDepthScale, m_shadowFilter);
+                    m_indirectLights[i].uploadMomentMap(filtered);
+                }
+                m_shadowMapDirty[i] = 0;
+            }
+        }
+    }
+
+    int InstantRadiosity::renderShadowMaps(const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer, const ShadowCuller* culler)
+    {
+        if (m_useAtlas)
+        {
+            layoutAtlas();
+        }
+
+        // The frustums cull in both projections; the paraboloid is rasterized from the lights' view space.
+        // All the lights share their clipping range, so one copy of the rasterizer does for all of them.
+        std::vector<int> lights;
+        std::vector<Mat4f> posToClip, posToProjected;
+
+        for (size_t i = 0; i < m_indirectLights.size(); ++i)
+        {
+            if (m_indirectLights[i].isEnabled() && m_shadowMapDirty[i])
+            {
+                lights.push_back(int(i));
+                posToClip.push_back(m_indirectLights[i].getPosToLightClip());
+                posToProjected.push_back(m_paraboloid ? m_indirectLights[i].getPosToLightView() : posToClip.back());
+            }
+        }
+
+        ShadowRasterizer projector = rasterizer;
+        if (m_paraboloid && !lights.empty())
+        {
+            const LightSource& light = m_indirectLights[lights[0]];
+            projector.setProjection(LightSource::Projection_Paraboloid, Vec2f(light.getNear(), light.getFar()));
+        }
+
+        std::vector<DepthMap> maps(lights.size());
+        std::vector<int> levels(lights.size(), 0);
+        for (size_t k = 0; k < lights.size(); ++k)
+        {
+            maps[k].clear(m_useAtlas ? Vec2i(m_atlas.getCellSize(lights[k])) : m_smContext.getResolution());
+            if (m_shadowLod)
+                levels[k] = m_shadowLod->selectLevel(m_indirectLights[lights[k]], maps[k].size.x, m_lodTexelError);
+        }
+
+        m_shadowStats = ShadowStats();
+        bool cull = culler && !culler->empty();
+
+        // One batch per level of detail. The simplified levels come with a culler of their own, whose
+        // geometry holds all of the level's triangles when there's no culling.
+        int numLevels = m_shadowLod ? m_shadowLod->getNumLevels() : 1;
+        for (int level = 0; level < numLevels; ++level)
+        {
+            std::vector<int> batch;
+            for (size_t k = 0; k < lights.size(); ++k)
+            {
+                if (levels[k] == level)
+                    batch.push_back(int(k));
+            }
+
+            if (batch.empty())
+            {
+                continue;
+            }
+
+            const ShadowCuller* levelCuller = level > 0 ? &m_shadowLod->getCuller(level) : culler;
+            std::vector<Mat4f> batchPosToClip, batchPosToProjected;
+            std::vector<DepthMap> batchMaps;
+
+            for (int k : batch)
+            {
+                batchPosToClip.push_back(posToClip[k]);
+                batchPosToProjected.push_back(posToProjected[k]);
+                batchMaps.push_back(std::move(maps[k]));
+            }
+
+            if (cull)
+            {
+                std::vector<std::vector<ShadowRange>> ranges(batch.size());
+                for (size_t j = 0; j < batch.size(); ++j)
+                {
+                    m_shadowStats.add(levelCuller->cull(batchPosToClip[j], ranges[j]));
+                }
+
+                projector.renderMany(levelCuller->getGeometry(), ranges, batchPosToProjected, batchMaps);
+            }
+            else
+            {
+                const ShadowGeometry& levelGeometry = level > 0 ? levelCuller->getGeometry() : geometry;
+                for (size_t j = 0; j < batch.size(); ++j)
+                {
+                    m_shadowStats.add(levelGeometry.getNumTriangles());
+                }
+
+                projector.renderMany(levelGeometry, batchPosToProjected, batchMaps);
+            }
+
+            for (size_t j = 0; j < batch.size(); ++j)
+            {
+                maps[batch[j]] = std::move(batchMaps[j]);
+            }
+        }
+
+        // the moments are computed in parallel like the maps, and replace them
+        std::vector<PrefilteredShadowMap> filtered;
+        if (!m_useAtlas && m_shadowFilter.filter != ShadowFilter_None)
+        {
+            filtered.resize(lights.size());
+
+#pragma omp parallel for schedule(dynamic)
+            for (int k = 0; k < (int)lights.size(); ++k)
+            {
+                filtered[k].build(maps[k], m_indirectLights[lights[k]], m_filterDepthScale, m_shadowFilter);
+            }
+        }
+
+        for (size_t k = 0; k < lights.size(); ++k)
+        {
+            if (m_useAtlas)
+                m_atlas.upload(lights[k], maps[k]);
+            else
+                m_indirectLights[lights[k]].uploadShadowMap(&m_smContext, maps[k]);
+            if (!filtered.empty())
+                m_indirectLights[lights[k]].uploadMomentMap(filtered[k]);
+            m_shadowMapDirty[lights[k]] = 0;
+        }
+
+        return int(lights.size());
+    }
+
+    void InstantRadiosity::setShadowLod(const ShadowLod* lod, float texelError)
+    {
+        if (lod == m_shadowLod && texelError == m_lodTexelError)
+        {
+            return;
+        }
+
+        // the levels of the maps may change
+        m_shadowLod = lod;
+        m_lodTexelError = texelError;
+        std::fill(m_shadowMapDirty.begin(), m_shadowMapDirty.end(), 1);
+    }
+
+    void InstantRadiosity::setParaboloid(bool paraboloid)
+    {
+        if (paraboloid == m_paraboloid)
+        {
+            return;
+        }
+
+        m_paraboloid = paraboloid;
+        for (LightSource& light : m_indirectLights)
+        {
+            light.setProjection(m_paraboloid ? LightSource::Projection_Paraboloid : LightSource::Projection_Perspective);
+        }
+        std::fill(m_shadowMapDirty.begin(), m_shadowMapDirty.end(), 1);
+    }
+
+    void InstantRadiosity::setShadowFilter(const ShadowFilterSettings& settings, float depthScale)
+    {
+        if (settings == m_shadowFilter && depthScale == m_filterDepthScale)
+        {
+            return;
+        }
+
+        m_shadowFilter = settings;
+        m_filterDepthScale = depthScale;
+        std::fill(m_shadowMapDirty.begin(), m_shadowMapDirty.end(), 1);
+    }
+
+    void InstantRadiosity::setUseAtlas(bool useAtlas)
+    {
+        if (useAtlas == m_useAtlas)
+        {
+            return;
+        }
+
+        // The maps live somewhere else now; render them all again.
+        m_useAtlas = useAtlas;
+        std::fill(m_shadowMapDirty.begin(), m_shadowMapDirty.end(), 1);
+
+        if (!m_useAtlas)
+        {
+            m_atlas.free();
+        }
+    }
+
+    void InstantRadiosity::layoutAtlas()
+    {
+        std::vector<int> sizes(m_indirectLights.size(), 0);
+
+        if (m_adaptiveResolution)
+        {
+            chooseResolutions(sizes);
+        }
+        else
+        {
+            for (size_t i = 0; i < m_indirectLights.size(); ++i)
+            {
+                sizes[i] = m_indirectLights[i].isEnabled() ? m_smResolution.x : 0;
+            }
+        }
+
+        // Only the lights that got a new cell need their maps rendered again.
+        std::vector<int> changed;
+        m_atlas.layout(sizes, changed);
+
+        for (int slot : changed)
+        {
+            m_shadowMapDirty[slot] = 1;
+        }
+    }
+
+    void InstantRadiosity::chooseResolutions(std::vector<int>& sizes)
+    {
+        int num = (int)m_indirectLights.size();
+
+        // The VPLs lie on the scene's surfaces, so their bounds give its scale; a light's surroundings
+        // are taken to be a sphere a quarter of that across.
+        Vec3f lo(+std::numeric_limits<float>::max());
+        Vec3f hi(-std::numeric_limits<float>::max());
+        for (const LightSource& light : m_indirectLights)
+        {
+            if (light.isEnabled())
+            {
+                lo = FW::min(lo, light.getPosition());
+                hi = FW::max(hi, light.getPosition());
+            }
+        }
+
+        float radius = lo.x <= hi.x ? 0.125f * (hi - lo).length() : 0.f;
+
+        std::vector<float> weight(num, 0.f);
+        std::vector<int> enabled;
+        float sumWeight = 0.f;
+
+        for (int i = 0; i < num; ++i)
+        {
+            const LightSource& light = m_indirectLights[i];
+            if (light.isEnabled())
+            {
+                Vec3f E = light.getEmission();
+                weight[i] = (E.x + E.y + E.z) * getViewCoverage(light.getPosition(), radius);
+                sumWeight += weight[i];
+                enabled.push_back(i);
+            }
+        }
+
+        // Every light gets the minimum; the rest of the budget is shared in proportion to the weights.
+        S64 minTexels = S64(m_minResolution) * m_minResolution;
+        double spare = FW::max(0.0, double(m_texelBudget - S64(enabled.size()) * minTexels));
+        S64 used = 0;
+
+        for (int i : enabled)
+        {
+            double ideal = double(minTexels) + (sumWeight > 0.f ? spare * weight[i] / sumWeight : 0.0);
+            float level = 0.5f * FW::log2(float(ideal));
+
+            // Keep the current size while the ideal one is within a level of it, so that small camera and
+            // light motions don't resize (and re-render) the maps; otherwise round down to fit the budget.
+            int size = 1 << FW::max(0, (int)FW::floor(level));
+            if (m_atlas.hasCell(i) && FW::abs(level - FW::log2(float(m_atlas.getCellSize(i)))) < 1.f)
+            {
+                size = m_atlas.getCellSize(i);
+            }
+
+            sizes[i] = FW::clamp(size, m_minResolution, m_maxResolution);
+            used += S64(sizes[i]) * sizes[i];
+        }
+
+        // Least weight per texel first: the maps halved when the kept sizes overshoot the budget, and the
+        // last ones to be doubled into the space that rounding down left over.
+        std::sort(enabled.begin(), enabled.end(), [&](int a, int b)
+        {
+            return weight[a] * float(sizes[b]) * float(sizes[b]) < weight[b] * float(sizes[a]) * float(sizes[a]);
+        });
+
+        for (int i : enabled)
+        {
+            if (used <= m_texelBudget)
+            {
+                break;
+            }
+
+            if (sizes[i] > m_minResolution)
+            {
+                used -= 3 * S64(sizes[i] / 2) * (sizes[i] / 2);
+                sizes[i] /= 2;
+            }
+        }
+
+        for (auto it = enabled.rbegin(); it != enabled.rend(); ++it)
+        {
+            S64 extra = 3 * S64(sizes[*it]) * sizes[*it];
+            if (sizes[*it] < m_maxResolution && weight[*it] > 0.f && used + extra <= m_texelBudget)
+            {
+                sizes[*it] *= 2;
+                used += extra;
+            }
+        }
+    }
+
+    float InstantRadiosity::getViewCoverage(const Vec3f& position, float radius) const
+    {
+        // The sphere's projection bounded by a square in normalized device coordinates, clipped to the
+        // screen: an estimate of the fraction of the view's pixels the light's shadows can fall on.
+        Vec4f clip = m_worldToClip * Vec4f(position, 1.0f);
+
+        if (clip.w <= radius)
+        {
+            return 1.f;
+        }
+
+        // The lengths of the first two rows of the rotation and scaling part give the screen extent of a unit offset.
+        Vec2f extent = Vec2f(Vec3f(m_worldToClip.m00, m_worldToClip.m01, m_worldToClip.m02).length(),
+                             Vec3f(m_worldToClip.m10, m_worldToClip.m11, m_worldToClip.m12).length()) * (radius / clip.w);
+        Vec2f center = Vec2f(clip.x, clip.y) / clip.w;
+
+        Vec2f lo = FW::max(center - extent, Vec2f(-1.f));
+        Vec2f hi = FW::min(center + extent, Vec2f(1.f));
+
+        if (lo.x >= hi.x || lo.y >= hi.y)
+        {
+            return 0.f;
+        }
+
+        return (hi.x - lo.x) * (hi.y - lo.y) * 0.25f;
+    }
+
+    void InstantRadiosity::renderIndirect(MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection)
+    {
+        // Get or build the shader: the MeshBase::draw_generic shading, looped over a batch of lights
+        // whose shadow maps are cells of the same atlas page.
+        static const char* progId = "InstantRadiosity::renderIndirect";
+        GLContext::Program* prog = m_gl->getProgram(progId);
+        if (!prog)
+        {
+            prog = new GLContext::Program(
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    uniform mat4 posToClip;
+                    uniform mat4 posToCamera;
+                    uniform mat3 normalToCamera;
+                    attribute vec3 positionAttrib;
+                    attribute vec3 normalAttrib;
+                    attribute vec4 vcolorAttrib;
+                    attribute vec2 texCoordAttrib;
+                    centroid varying vec3 positionVarying;
+                    centroid varying vec3 normalVarying;
+                    centroid varying vec4 colorVarying;
+                    varying vec2 texCoordVarying;
+
+                    void main()
+                    {
+                        vec4 pos = vec4(positionAttrib, 1.0);
+                        gl_Position = posToClip * pos;
+                        positionVarying = (posToCamera * pos).xyz;
+                        normalVarying = normalToCamera * normalAttrib;
+                        colorVarying = vcolorAttrib;
+                        texCoordVarying = texCoordAttrib;
+                    }
+                ),
+                String("#version 120\n") + LightSource::getLightingShaderSource() +
+                FW_GL_SHADER_SOURCE(
+                    uniform bool hasDiffuseTexture;
+                    uniform bool hasAlphaTexture;
+                    uniform vec4 diffuseUniform;
+                    uniform sampler2D diffuseSampler;
+                    uniform sampler2D alphaSampler;
+                    centroid varying vec3 positionVarying;
+                    centroid varying vec3 normalVarying;
+                    centroid varying vec4 colorVarying;
+                    varying vec2 texCoordVarying;
+
+                    // per light, in eye coordinates; the clip matrices take eye coordinates to the light's clip space.
+                    // vec4 arrays because they upload with glUniform4fv; lightDirEye.w is the cosine of the half opening.
+                    // With paraboloid maps, the matrices go to the lights' view spaces instead, and depthRange holds
+                    // their near and far distances.
+                    uniform int numLights;
+                    uniform vec4 lightPosEye[16];
+                    uniform vec4 lightDirEye[16];
+                    uniform vec4 lightE[16];
+                    uniform mat4 eyeToLightClip[16];
+                    uniform vec4 cellRect[16];
+                    uniform float cellBorder[16];
+                    uniform bool paraboloid;
+                    uniform vec2 depthRange[16];
+                    uniform sampler2D shadowSampler;
+
+                    void main()
+                    {
+                        vec4 diffuseColor = diffuseUniform;
+
+                        if (hasDiffuseTexture) {
+                            diffuseColor.rgb = texture2D(diffuseSampler, texCoordVarying).rgb;
+                        }
+
+                        diffuseColor *= colorVarying;
+
+                        if (hasAlphaTexture) {
+                            diffuseColor.a = texture2D(alphaSampler, texCoordVarying).g;
+                        }
+
+                        if (diffuseColor.a <= 0.5) {
+                            discard;
+                        }
+
+                        vec3 normal = normalize(normalVarying);
+                        vec3 sum = vec3(0.0);
+
+                        for (int i = 0; i < 16; ++i)
+                        {
+                            if (i >= numLights) {
+                                break;
+                            }
+
+                            vec3 shading = getLightShading(positionVarying, normal, lightPosEye[i].xyz, lightDirEye[i].xyz, lightDirEye[i].w, lightE[i].xyz);
+
+                            // clamped to the cell like GL_CLAMP clamps a texture of its own
+                            vec4 coords = getShadowCoords(eyeToLightClip[i] * vec4(positionVarying, 1.0), paraboloid, depthRange[i]);
+                            vec2 uv = cellRect[i].xy + clamp(coords.xy, cellBorder[i], 1.0 - cellBorder[i]) * cellRect[i].zw;
+
+                            sum += shading * getDepthShadow(texture2D(shadowSampler, uv).x, coords);
+                        }
+
+                        float PI = 3.1415926535897932384626433832795;
+                        gl_FragColor = vec4(diffuseColor.rgb * sum / PI, 1.0);
+                    }
+                )
+            );
+            m_gl->setProgram(progId, prog);
+        }
+
+        int posAttrib = scene->findAttrib(MeshBase::AttribType_Position);
+        int normalAttrib = scene->findAttrib(MeshBase::AttribType_Normal);
+        int vcolorAttrib = scene->findAttrib(MeshBase::AttribType_Color);
+        int texCoordAttrib = scene->findAttrib(MeshBase::AttribType_TexCoord);
+        if (posAttrib == -1 || m_atlas.getNumPages() == 0)
+            return;
+
+        prog->use();
+        m_gl->setUniform(prog->getUniformLoc("posToClip"), projection * worldToCamera);
+        m_gl->setUniform(prog->getUniformLoc("posToCamera"), worldToCamera);
+        m_gl->setUniform(prog->getUniformLoc("normalToCamera"), worldToCamera.getXYZ().inverted().transposed());
+        m_gl->setUniform(prog->getUniformLoc("diffuseSampler"), 0);
+        m_gl->setUniform(prog->getUniformLoc("alphaSampler"), 1);
+        m_gl->setUniform(prog->getUniformLoc("shadowSampler"), 5);
+        m_gl->setUniform(prog->getUniformLoc("paraboloid"), m_paraboloid);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, scene->getVBO().getGLBuffer());
+        scene->setGLAttrib(m_gl, posAttrib, prog->getAttribLoc("positionAttrib"));
+
+        if (normalAttrib != -1)
+            scene->setGLAttrib(m_gl, normalAttrib, prog->getAttribLoc("normalAttrib"));
+        else
+            glVertexAttrib3f(prog->getAttribLoc("normalAttrib"), 0.0f, 0.0f, 0.0f);
+
+        if (vcolorAttrib != -1)
+            scene->setGLAttrib(m_gl, vcolorAttrib, prog->getAttribLoc("vcolorAttrib"));
+        else
+            glVertexAttrib4f(prog->getAttribLoc("vcolorAttrib"), 1.0f, 1.0f, 1.0f, 1.0f);
+
+        if (texCoordAttrib != -1)
+            scene->setGLAttrib(m_gl, texCoordAttrib, prog->getAttribLoc("texCoordAttrib"));
+        else
+            glVertexAttrib2f(prog->getAttribLoc("texCoordAttrib"), 0.0f, 0.0f);
+
+        Mat4f cameraToWorld = worldToCamera.inverted();
+
+        // Gather the enabled lights of each atlas page into batches: the per-light parameters go into
+        // uniform arrays, and the whole batch costs one pass over the scene.
+        for (int page = 0; page < m_atlas.getNumPages(); ++page)
+        {
+            std::vector<int> lights;
+            for (int i = 0; i < (int)m_indirectLights.size(); ++i)
+            {
+                if (m_indirectLights[i].isEnabled() && m_atlas.hasCell(i) && m_atlas.getPage(i) == page)
+                {
+                    lights.push_back(i);
+                }
+            }
+
+            glActiveTexture(GL_TEXTURE0 + 5);
+            glBindTexture(GL_TEXTURE_2D, m_atlas.getTexture(page));
+
+            for (size_t begin = 0; begin < lights.size(); begin += MaxLightsPerPass)
+            {
+                int num = FW::min(MaxLightsPerPass, int(lights.size() - begin));
+
+                Vec4f posEye[MaxLightsPerPass], dirEye[MaxLightsPerPass], E[MaxLightsPerPass];
+                Mat4f eyeToLightClip[MaxLightsPerPass];
+                Vec4f cellRect[MaxLightsPerPass];
+                float cellBorder[MaxLightsPerPass];
+                Vec2f depthRange[MaxLightsPerPass];
+
+                for (int k = 0; k < num; ++k)
+                {
+                    const LightSource& light = m_indirectLights[lights[begin + k]];
+                    posEye[k] = worldToCamera * Vec4f(light.getPosition(), 1.0f);
+                    dirEye[k] = Vec4f((worldToCamera * Vec4f(light.getNormal(), 0.0f)).getXYZ(), FW::cos(0.5f * light.getFOVRad()));
+                    E[k] = Vec4f(light.getEmission(), 0.0f);
+                    eyeToLightClip[k] = (m_paraboloid ? light.getPosToLightView() : light.getPosToLightClip()) * cameraToWorld;
+                    cellRect[k] = m_atlas.getCellRect(lights[begin + k]);
+                    cellBorder[k] = 0.5f / m_atlas.getCellSize(lights[begin + k]);
+                    depthRange[k] = Vec2f(light.getNear(), light.getFar());
+                }
+
+                m_gl->setUniform(prog->getUniformLoc("numLights"), num);
+                glUniform4fv(prog->getUniformLoc("lightPosEye[0]"), num, posEye[0].getPtr());
+                glUniform4fv(prog->getUniformLoc("lightDirEye[0]"), num, dirEye[0].getPtr());
+                glUniform4fv(prog->getUniformLoc("lightE[0]"), num, E[0].getPtr());
+                glUniformMatrix4fv(prog->getUniformLoc("eyeToLightClip[0]"), num, false, eyeToLightClip[0].getPtr());
+                glUniform4fv(prog->getUniformLoc("cellRect[0]"), num, cellRect[0].getPtr());
+                glUniform1fv(prog->getUniformLoc("cellBorder[0]"), num, cellBorder);
+                glUniform2fv(prog->getUniformLoc("depthRange[0]"), num, depthRange[0].getPtr());
+
+                for (int i = 0; i < scene->numSubmeshes(); i++)
+                {
+                    const MeshBase::Material& mat = scene->material(i);
+                    m_gl->setUniform(prog->getUniformLoc("diffuseUniform"), mat.diffuse);
+
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindTexture(GL_TEXTURE_2D, mat.textures[MeshBase::TextureType_Diffuse].getGLTexture());
+                    m_gl->setUniform(prog->getUniformLoc("hasDiffuseTexture"), mat.textures[MeshBase::TextureType_Diffuse].exists());
+
+                    glActiveTexture(GL_TEXTURE1);
+                    glBindTexture(GL_TEXTURE_2D, mat.textures[MeshBase::TextureType_Alpha].getGLTexture());
+                    m_gl->setUniform(prog->getUniformLoc("hasAlphaTexture"), mat.textures[MeshBase::TextureType_Alpha].exists());
+
+                    glDrawElements(GL_TRIANGLES, scene->vboIndexSize(i), GL_UNSIGNED_INT, (void*)(UPTR)scene->vboIndexOffset(i));
+                }
+            }
+        }
+
+        m_gl->resetAttribs();
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(0);
+    }
+
+    float InstantRadiosity::renderIndirectDeferred(const DeferredGBuffer& gbuffer, const Mat4f& worldToCamera, const Mat4f& projection,
+        int tileSize, float threshold)
+    {
+        // Get or build the shader: the lighting of renderIndirect(), with the surface read from the G-buffer and
+        // the lights' parameters from a texture. A pass either loops over the light list of the pixel's tile or
+        // shades the one light given by lightIndex.
+        static const char* progId = "InstantRadiosity::renderIndirectDeferred";
+        GLContext::Program* prog = m_gl->getProgram(progId);
+        if (!prog)
+        {
+            prog = new GLContext::Program(
+                "#version 120\n"
+                FW_GL_SHADER_SOURCE(
+                    attribute vec4 posAttrib;
+
+                    void main()
+                    {
+                        gl_Position = posAttrib;
+                    }
+                ),
+                String("#version 120\n") + LightSource::getLightingShaderSource() +
+                FW_GL_SHADER_SOURCE(
+                    uniform sampler2D positionSampler;
+                    uniform sampler2D normalSampler;
+                    uniform sampler2D albedoSampler;
+                    uniform vec2 viewSize;
+
+                    // A row of 9 texels per light, in eye coordinates like in renderIndirect(): the position and
+                    // the near distance, the direction and the cosine of the half opening, the emission and the
+                    // far distance, the cell rectangle, the four columns of the clip matrix and the cell border.
+                    uniform sampler2D lightSampler;
+                    uniform float numLights;
+                    uniform bool paraboloid;
+                    uniform sampler2D shadowSampler;
+
+                    // With tile lists, the offset and length of each tile's list, and the lists of light rows
+                    // in rows of indexSize.x texels; otherwise the one light of the pass.
+                    uniform bool tileLists;
+                    uniform float tileSize;
+                    uniform vec2 numTiles;
+                    uniform sampler2D tileSampler;
+                    uniform sampler2D indexSampler;
+                    uniform vec2 indexSize;
+                    uniform float lightIndex;
+
+                    // as in MeshBase::draw_generic, for the one light of a pass whose texture has moments
+                    uniform int shadowFilter;
+                    uniform sampler2D momentSampler;
+                    uniform vec4 momentParams;
+                    uniform float momentDepthScale;
+
+                    vec4 getLightTexel(float light, float texel)
+                    {
+                        return texture2D(lightSampler, vec2((texel + 0.5) / 9.0, (light + 0.5) / numLights));
+                    }
+
+                    vec3 shadeLight(float light, vec3 position, vec3 normal)
+                    {
+                        vec4 posEye = getLightTexel(light, 0.0);
+                        vec4 dirEye = getLightTexel(light, 1.0);
+                        vec4 E = getLightTexel(light, 2.0);
+                        vec4 cellRect = getLightTexel(light, 3.0);
+                        mat4 eyeToLightClip = mat4(getLightTexel(light, 4.0), getLightTexel(light, 5.0), getLightTexel(light, 6.0), getLightTexel(light, 7.0));
+                        float cellBorder = getLightTexel(light, 8.0).x;
+                        vec2 depthRange = vec2(posEye.w, E.w);
+
+                        vec3 shading = getLightShading(position, normal, posEye.xyz, dirEye.xyz, dirEye.w, E.xyz);
+
+                        vec4 coords = getShadowCoords(eyeToLightClip * vec4(position, 1.0), paraboloid, depthRange);
+                        vec2 uv = cellRect.xy + clamp(coords.xy, cellBorder, 1.0 - cellBorder) * cellRect.zw;
+                        float shadow = 1.0;
+
+                        if (shadowFilter == 0) {
+                            shadow = getDepthShadow(texture2D(shadowSampler, uv).x, coords);
+                        }
+                        else {
+                            shadow = getMomentShadow(texture2D(momentSampler, uv, momentParams.y), coords, depthRange.x, momentDepthScale, shadowFilter, momentParams);
+                        }
+
+                        return shading * shadow;
+                    }
+
+                    void main()
+                    {
+                        vec2 pixel = gl_FragCoord.xy / viewSize;
+                        vec4 position = texture2D(positionSampler, pixel);
+
+                        if (position.w == 0.0) {
+                            discard;
+                        }
+
+                        vec3 normal = normalize(texture2D(normalSampler, pixel).xyz);
+                        vec3 sum = vec3(0.0);
+
+                        if (tileLists) {
+                            vec2 tile = floor(gl_FragCoord.xy / tileSize);
+                            vec4 list = texture2D(tileSampler, (tile + 0.5) / numTiles);
+
+                            for (float i = 0.0; i < list.y; i += 1.0)
+                            {
+                                float entry = list.x + i;
+                                vec2 texel = vec2(mod(entry, indexSize.x), floor(entry / indexSize.x));
+                                sum += shadeLight(texture2D(indexSampler, (texel + 0.5) / indexSize).x, position.xyz, normal);
+                            }
+                        }
+                        else {
+                            sum = shadeLight(lightIndex, position.xyz, normal);
+                        }
+
+                        float PI = 3.1415926535897932384626433832795;
+                        gl_FragColor = vec4(texture2D(albedoSampler, pixel).rgb * sum / PI, 1.0);
+                    }
+                )
+            );
+            m_gl->setProgram(progId, prog);
+        }
+
+        // The lights with a map to shade with.
+        std::vector<int> slots;
+        std::vector<Vpl> vpls;
+        for (int i = 0; i < (int)m_indirectLights.size(); ++i)
+        {
+            const LightSource& light = m_indirectLights[i];
+            if (light.isEnabled() && (m_useAtlas ? m_atlas.hasCell(i) : light.getShadowTextureHandle() != 0))
+            {
+                slots.push_back(i);
+                vpls.push_back(Vpl(light));
+            }
+        }
+
+        // Without tiles, the whole screen is one tile with all the lights. The tiles are cut to the depths of
+        // their surfaces if the G-buffer has them for this tile size.
+        const Vec2i& size = gbuffer.getSize();
+        TileLightLists tiles;
+        if (tileSize > 0)
+        {
+            tiles.build(worldToCamera, projection, size, vpls, tileSize, threshold,
+                gbuffer.getDepthTileSize() == tileSize ? gbuffer.getTileDepths() : std::vector<Vec2f>());
+        }
+        else
+        {
+            tiles.build(worldToCamera, projection, size, vpls, FW::max(size.max(), 1), 0.0f, std::vector<Vec2f>());
+        }
+
+        if (slots.empty())
+        {
+            return 0.0f;
+        }
+
+        // The parameters of the lights, as the shader reads them.
+        Mat4f cameraToWorld = worldToCamera.inverted();
+        std::vector<Vec4f> params(slots.size() * LightTexels);
+        for (size_t k = 0; k < slots.size(); ++k)
+        {
+            int slot = slots[k];
+            const LightSource& light = m_indirectLights[slot];
+            Vec4f* texels = &params[k * LightTexels];
+            Mat4f eyeToLightClip = (m_paraboloid ? light.getPosToLightView() : light.getPosToLightClip()) * cameraToWorld;
+
+            texels[0] = Vec4f((worldToCamera * Vec4f(light.getPosition(), 1.0f)).getXYZ(), light.getNear());
+            texels[1] = Vec4f((worldToCamera * Vec4f(light.getNormal(), 0.0f)).getXYZ(), FW::cos(0.5f * light.getFOVRad()));
+            texels[2] = Vec4f(light.getEmission(), light.getFar());
+            // a texture of its own is the whole unit square, and GL_CLAMP does the clamping
+            texels[3] = m_useAtlas ? m_atlas.getCellRect(slot) : Vec4f(0.0f, 0.0f, 1.0f, 1.0f);
+            for (int c = 0; c < 4; ++c)
+            {
+                texels[4 + c] = eyeToLightClip.getCol(c);
+            }
+            texels[8] = Vec4f(m_useAtlas ? 0.5f / m_atlas.getCellSize(slot) : 0.0f, 0.0f, 0.0f, 0.0f);
+        }
+        uploadDeferredTexture(m_deferredLightTexture, GL_RGBA32F, GL_RGBA, Vec2i(LightTexels, (int)slots.size()), params.data());
+
+        static const F32 quad[] =
+        {
+            -1, -1, 0, 1,
+            1, -1, 0, 1,
+            -1, 1, 0, 1,
+            1, 1, 0, 1
+        };
+
+        prog->use();
+        m_gl->setUniform(prog->getUniformLoc("viewSize"), Vec2f(size));
+        m_gl->setUniform(prog->getUniformLoc("positionSampler"), 2);
+        m_gl->setUniform(prog->getUniformLoc("normalSampler"), 3);
+        m_gl->setUniform(prog->getUniformLoc("albedoSampler"), 4);
+        m_gl->setUniform(prog->getUniformLoc("shadowSampler"), 5);
+        m_gl->setUniform(prog->getUniformLoc("momentSampler"), 6);
+        m_gl->setUniform(prog->getUniformLoc("lightSampler"), 7);
+        m_gl->setUniform(prog->getUniformLoc("tileSampler"), 8);
+        m_gl->setUniform(prog->getUniformLoc("indexSampler"), 9);
+        m_gl->setUniform(prog->getUniformLoc("numLights"), (F32)slots.size());
+        m_gl->setUniform(prog->getUniformLoc("paraboloid"), m_paraboloid);
+
+        glActiveTexture(GL_TEXTURE0 + 2);
+        glBindTexture(GL_TEXTURE_2D, gbuffer.getTexture(DeferredGBuffer::Target_Position));
+        glActiveTexture(GL_TEXTURE0 + 3);
+        glBindTexture(GL_TEXTURE_2D, gbuffer.getTexture(DeferredGBuffer::Target_Normal));
+        glActiveTexture(GL_TEXTURE0 + 4);
+        glBindTexture(GL_TEXTURE_2D, gbuffer.getTexture(DeferredGBuffer::Target_Albedo));
+        glActiveTexture(GL_TEXTURE0 + 7);
+        glBindTexture(GL_TEXTURE_2D, m_deferredLightTexture);
+
+        int numTiles = tiles.getNumTiles().x * tiles.getNumTiles().y;
+
+        if (m_useAtlas)
+        {
+            // One fullscreen pass per atlas page, in which each pixel loops over the lights of the page in its
+            // tile's list; the lists are packed one after another into the index texture.
+            m_gl->setAttrib(prog->getAttribLoc("posAttrib"), 4, GL_FLOAT, 0, quad);
+            m_gl->setUniform(prog->getUniformLoc("tileLists"), true);
+            m_gl->setUniform(prog->getUniformLoc("shadowFilter"), 0);
+            m_gl->setUniform(prog->getUniformLoc("tileSize"), (F32)FW::max(tileSize > 0 ? tileSize : size.max(), 1));
+            m_gl->setUniform(prog->getUniformLoc("numTiles"), Vec2f(tiles.getNumTiles()));
+
+            for (int page = 0; page < m_atlas.getNumPages(); ++page)
+            {
+                std::vector<Vec4f> lists(numTiles);
+                std::vector<F32> indices;
+                for (int tile = 0; tile < numTiles; ++tile)
+                {
+                    lists[tile].x = (F32)indices.size();
+                    for (int index : tiles.getLights(tile))
+                    {
+                        if (m_atlas.getPage(slots[index]) == page)
+                        {
+                            indices.push_back((F32)index);
+                        }
+                    }
+                    lists[tile].y = (F32)indices.size() - lists[tile].x;
+                }
+
+                if (indices.empty())
+                    continue;
+
+                Vec2i indexSize(IndexTextureWidth, (int)(indices.size() + IndexTextureWidth - 1) / IndexTextureWidth);
+                indices.resize(indexSize.x * indexSize.y, 0.0f);
+                uploadDeferredTexture(m_deferredTileTexture, GL_RGBA32F, GL_RGBA, tiles.getNumTiles(), lists.data());
+                uploadDeferredTexture(m_deferredIndexTexture, GL_R32F, GL_RED, indexSize, indices.data());
+                m_gl->setUniform(prog->getUniformLoc("indexSize"), Vec2f(indexSize));
+
+                glActiveTexture(GL_TEXTURE0 + 5);
+                glBindTexture(GL_TEXTURE_2D, m_atlas.getTexture(page));
+                glActiveTexture(GL_TEXTURE0 + 8);
+                glBindTexture(GL_TEXTURE_2D, m_deferredTileTexture);
+                glActiveTexture(GL_TEXTURE0 + 9);
+                glBindTexture(GL_TEXTURE_2D, m_deferredIndexTexture);
+
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            }
+        }
+        else
         {
-            if (it->isEnabled())
+            // Each light has a texture of its own, so it is a pass of its own, drawn once over the tiles
+            // whose lists have it.
+            std::vector<std::vector<int>> lightTiles(slots.size());
+            for (int tile = 0; tile < numTiles; ++tile)
             {
-                it->renderShadowMap(m_gl, scene, &m_smContext);
+                for (int index : tiles.getLights(tile))
+                {
+                    lightTiles[index].push_back(tile);
+                }
+            }
+
+            m_gl->setUniform(prog->getUniformLoc("tileLists"), false);
+            std::vector<Vec4f> vertices;
+
+            for (size_t k = 0; k < slots.size(); ++k)
+            {
+                if (lightTiles[k].empty())
+                    continue;
+
+                // two triangles per tile, in clip coordinates
+                vertices.clear();
+                for (int tile : lightTiles[k])
+                {
+                    Vec2f lo = 2.0f * Vec2f(tiles.getTileOrigin(tile)) / Vec2f(size) - Vec2f(1.0f);
+                    Vec2f hi = 2.0f * Vec2f(tiles.getTileOrigin(tile) + tiles.getTileSize(tile)) / Vec2f(size) - Vec2f(1.0f);
+                    vertices.push_back(Vec4f(lo.x, lo.y, 0.0f, 1.0f));
+                    vertices.push_back(Vec4f(hi.x, lo.y, 0.0f, 1.0f));
+                    vertices.push_back(Vec4f(lo.x, hi.y, 0.0f, 1.0f));
+                    vertices.push_back(Vec4f(lo.x, hi.y, 0.0f, 1.0f));
+                    vertices.push_back(Vec4f(hi.x, lo.y, 0.0f, 1.0f));
+                    vertices.push_back(Vec4f(hi.x, hi.y, 0.0f, 1.0f));
+                }
+
+                const LightSource& light = m_indirectLights[slots[k]];
+                glActiveTexture(GL_TEXTURE0 + 5);
+                glBindTexture(GL_TEXTURE_2D, light.getShadowTextureHandle());
+
+                GLuint moments = light.getMomentTextureHandle();
+                m_gl->setUniform(prog->getUniformLoc("shadowFilter"), moments ? (S32)light.getMomentFilter().filter : 0);
+                if (moments)
+                {
+                    const ShadowFilterSettings& filter = light.getMomentFilter();
+                    glActiveTexture(GL_TEXTURE0 + 6);
+                    glBindTexture(GL_TEXTURE_2D, moments);
+                    m_gl->setUniform(prog->getUniformLoc("momentParams"), Vec4f(filter.exponent, filter.softness, filter.minVariance, filter.bleedReduction));
+                    m_gl->setUniform(prog->getUniformLoc("momentDepthScale"), light.getMomentDepthScale());
+                }
+
+                m_gl->setUniform(prog->getUniformLoc("lightIndex"), (F32)k);
+                m_gl->setAttrib(prog->getAttribLoc("posAttrib"), 4, GL_FLOAT, 0, vertices.data());
+                glDrawArrays(GL_TRIANGLES, 0, (int)vertices.size());
             }
         }
+
+        m_gl->resetAttribs();
+        glActiveTexture(GL_TEXTURE0);
+        glUseProgram(0);
+        return tiles.getAverageLights();
     }
 
     //////////// Stuff you probably will not need to touch:
@@ -115,6 +1515,8 @@ namespace FW
 
         // Set up the shadow map buffers
         m_smContext.setup(resolution);
+        m_smResolution = resolution;
+        std::fill(m_shadowMapDirty.begin(), m_shadowMapDirty.end(), 1);
     }
 
     void InstantRadiosity::draw(const Mat4f& worldToCamera, const Mat4f& projection)
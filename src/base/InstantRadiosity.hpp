@@ -11,12 +11,18 @@
 
 #include "RayTracer.hpp"
 #include "ShadowMap.hpp"
+#include "ShadowRasterizer.hpp"
+#include "ShadowAtlas.hpp"
+#include "ShadowCuller.hpp"
+#include "ShadowLod.hpp"
+#include "PrefilteredShadowMap.hpp"
 
 
 namespace FW
 {
     class RayTracer;
     class GLContext;
+    class DeferredGBuffer;
 
 
     //------------------------------------------------------------------------
@@ -32,27 +38,234 @@ namespace FW
     {
     public:
         InstantRadiosity() :
-            m_indirectFOV(150) // Use 150 degree cone by default
+            m_smResolution(256, 256),
+            m_useAtlas(false),
+            m_adaptiveResolution(false),
+            m_texelBudget(1 << 22),
+            m_minResolution(16),
+            m_maxResolution(1024),
+            m_shadowLod(nullptr),
+            m_lodTexelError(1.0f),
+            m_paraboloid(false),
+            m_filterDepthScale(1.0f),
+            m_indirectFOV(150), // Use 150 degree cone by default
+            m_numBounces(1),
+            m_emissionSampler(SamplerType_Sobol),
+            m_emissionSeed(1234),
+            m_incremental(true),
+            m_updateBudget(16),
+            m_cameraResampling(false),
+            m_oversampling(4),
+            m_numCameraSamples(256),
+            m_resampleThreshold(0.05f),
+            m_deferredLightTexture(0),
+            m_deferredTileTexture(0),
+            m_deferredIndexTexture(0),
+            m_cacheValid(false),
+            m_nextPathIndex(0),
+            m_pathsComplete(false)
         {};
         ~InstantRadiosity() {};
 
         void setup(GLContext* gl, Vec2i resolution);
 
         void draw(const Mat4f& worldToCamera, const Mat4f& projection);
+        // Traces light paths from ls and deposits VPLs at up to getNumBounces() vertices per path,
+        // until #num VPLs (the budget) are placed or #num paths have been traced.
         void castIndirect(RayTracer* rt, MeshWithColors* scene, const LightSource& ls, int num);
-        void renderShadowMaps(MeshWithColors* scene);
+
+        // Calls castIndirect() only if the scene or the VPL settings changed since the last call; sceneVersion is
+        // bumped by the caller whenever the geometry changes. When only the light changed and incremental updates
+        // are on, the still valid paths are kept and at most getUpdateBudget() new ones are traced per call.
+        // Returns true if any VPL changed.
+        bool updateIndirect(RayTracer* rt, MeshWithColors* scene, const LightSource& ls, int num, U32 sceneVersion);
+        void invalidate() { m_cacheValid = false; }
+
+        void setIncremental(bool incremental) { m_incremental = incremental; }
+        void setUpdateBudget(int paths) { m_updateBudget = FW::max(1, paths); }
+        int getUpdateBudget() const { return m_updateBudget; }
+
+        // Re-renders the shadow maps of the lights that moved since they were last rendered. With a culler,
+        // each map gets only the geometry in its light's frustum.
+        void renderShadowMaps(MeshWithColors* scene, ShadowCuller* culler = nullptr);
+        // The same with the software rasterizer, all the maps in parallel, uploaded into the GL textures.
+        // With a culler, its reordered geometry is rasterized instead of geometry. Returns the number of maps rendered.
+        int renderShadowMaps(const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer, const ShadowCuller* culler = nullptr);
+
+        // Triangles drawn into the maps by the last renderShadowMaps() call.
+        struct ShadowStats
+        {
+            int numMaps;
+            S64 triangles;
+            int minTriangles, maxTriangles;
+
+            ShadowStats() : numMaps(0), triangles(0), minTriangles(0), maxTriangles(0) {}
+            void add(int n) { minTriangles = numMaps ? FW::min(minTriangles, n) : n; maxTriangles = FW::max(maxTriangles, n); triangles += n; ++numMaps; }
+        };
+        const ShadowStats& getShadowStats() const { return m_shadowStats; }
+
+        // Renders each map from the coarsest level of lod whose error is within texelError of the map's texels,
+        // or from the full scene if lod is null.
+        void setShadowLod(const ShadowLod* lod, float texelError);
         GLContext::Program* getShader();
 
+        // Keeps the shadow maps of all the lights in one ShadowAtlas instead of a texture per light, and lets
+        // renderIndirect() shade up to MaxLightsPerPass lights in a single pass over the scene.
+        void setUseAtlas(bool useAtlas);
+        bool getUseAtlas() const { return m_useAtlas; }
+
+        // Adds the enabled indirect lights to the current render target from the atlas. The caller sets up
+        // the additive blending and the depth test, like for LightSource::renderShadowedScene().
+        void renderIndirect(MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection);
+        static const int MaxLightsPerPass = 16;
+
+        // The same as screen-space passes over the G-buffer of the view instead of passes over the scene. The caller
+        // sets up the additive blending; the depth test isn't needed. Prefiltered lights shade with their moments,
+        // like in MeshBase::draw_generic. With a tileSize, the screen is split into tiles that each shade only the
+        // lights that add threshold or more to them (see TileLightLists), cut to the depths of the G-buffer if it
+        // has them for that tile size (see DeferredGBuffer::reduceTileDepths()). With the atlas, each page is one
+        // fullscreen pass that loops over the tile lists; without it, each light is one pass over its tiles.
+        // Returns the average number of lights per tile.
+        float renderIndirectDeferred(const DeferredGBuffer& gbuffer, const Mat4f& worldToCamera, const Mat4f& projection,
+            int tileSize = 0, float threshold = 0.0f);
+
+        // With the atlas, sizes each light's shadow map by its importance instead of using the resolution of
+        // setup(): the emitted power times the fraction of the view its surroundings cover. The budget is
+        // shared in proportion to that, in powers of two between the minimum and maximum resolution.
+        void setAdaptiveResolution(bool adaptive) { m_adaptiveResolution = adaptive; }
+        void setTexelBudget(S64 texels) { m_texelBudget = FW::max(texels, S64(1)); }
+        void setResolutionRange(int minResolution, int maxResolution) { m_minResolution = minResolution; m_maxResolution = FW::max(minResolution, maxResolution); }
+        S64 getAllocatedTexels() const { return m_atlas.getAllocatedTexels(); }
+
+        // Gives the lights paraboloid shadow maps over their whole hemisphere instead of perspective ones of
+        // their FOV (see LightSource::Projection). At the center, a paraboloid map of half the resolution has
+        // about the texel density of a 150 degree frustum, and it doesn't clip the edges of the hemisphere.
+        void setParaboloid(bool paraboloid);
+        bool getParaboloid() const { return m_paraboloid; }
+
+        // Prefilters every rendered map into moments (see PrefilteredShadowMap) that the lights then shade with.
+        // The GL maps are read back for it. Only the maps of their own textures are filtered; the atlas ones are
+        // looked up with single depth comparisons. depthScale is the range of depths the moments cover.
+        void setShadowFilter(const ShadowFilterSettings& settings, float depthScale);
+
         void setFOV(float fov) { m_indirectFOV = fov; }
 
+        void setNumBounces(int bounces) { m_numBounces = FW::max(1, bounces); }
+        int getNumBounces() const { return m_numBounces; }
+
+        // Distribution of the paths leaving the main light in castIndirect().
+        void setEmissionSampler(SamplerType sampler) { m_emissionSampler = sampler; }
+        SamplerType getEmissionSampler() const { return m_emissionSampler; }
+        // Seeds the emitted point set and the bounces of the paths; a different seed gives an independent set of VPLs.
+        void setEmissionSeed(U32 seed) { m_emissionSeed = seed; }
+
+        // Camera-aware resampling: castIndirect() traces getOversampling() times as many light paths as there
+        // are slots, estimates what each candidate VPL contributes to the view given by setCameraView() from
+        // a few camera path samples, and keeps #num of them drawn in proportion to that, reweighted by the
+        // inverse of the selection probability. The candidates are kept while only the camera moves; once the
+        // camera samples have moved by more than getResampleThreshold() in normalized device coordinates on
+        // average, they are drawn again and the slots holding a candidate that is picked again keep their
+        // shadow maps. Incremental updates are not used.
+        void setCameraResampling(bool enabled) { m_cameraResampling = enabled; }
+        void setOversampling(int factor) { m_oversampling = FW::max(1, factor); }
+        int getOversampling() const { return m_oversampling; }
+        void setNumCameraSamples(int n) { m_numCameraSamples = FW::max(1, n); }
+        void setResampleThreshold(float ndc) { m_resampleThreshold = FW::max(0.f, ndc); }
+        float getResampleThreshold() const { return m_resampleThreshold; }
+        void setCameraView(const Mat4f& worldToClip) { m_worldToClip = worldToClip; }
+
         int getNumLights() const { return (int)m_indirectLights.size(); }
         LightSource& getLight(int i) { return m_indirectLights[i]; };
+        const LightSource& getLight(int i) const { return m_indirectLights[i]; };
 
     protected:
+        // A VPL deposited at a light path vertex.
+        struct IndirectLight
+        {
+            Vec3f position;
+            Vec3f normal;
+            Vec3f E;
+        };
+
+        // The VPLs deposited along one path from the light.
+        struct LightPath
+        {
+            Vec2f diskCoord;                // where the path leaves the light, in the unit disk of sampleEmittedRays()
+            float diskPdf;                  // density diskCoord was drawn with, per unit disk area of the current pose
+            float vertexPdf;                // the same per unit area at the first vertex, which moving the light keeps
+            std::vector<int> slots;         // indices to m_indirectLights, first bounce first
+            std::vector<Vec3f> throughput;  // of each VPL, i.e. its emission per unit of power on the path
+        };
+
+        void tracePath(RayTracer* rt, Ray ray, Vec3f power, float far, int pathIndex, std::vector<IndirectLight>& vpls) const;
+        void castResampled(RayTracer* rt, const LightSource& ls, int num, bool retrace);
+        float getViewChange() const;
+        void updateIncremental(RayTracer* rt, const LightSource& ls, bool lightChanged);
+        bool revalidatePath(RayTracer* rt, const LightSource& ls, LightPath& path) const;
+        static Vec2f toDiskCoord(const LightSource& ls, const Vec3f& dir);
+        static float getDiskJacobian(const LightSource& ls, const Vec3f& position, const Vec3f& normal);
+        void setPathPdf(LightPath& path, const LightSource& ls) const;
+        void writeSlot(int slot, const IndirectLight& vpl);
+        void applyPathPower(const LightSource& ls);
+        void layoutAtlas();
+        void chooseResolutions(std::vector<int>& sizes);
+        float getViewCoverage(const Vec3f& position, float radius) const;
+
         GLContext* m_gl;
         ShadowMapContext m_smContext;
+        Vec2i m_smResolution;
+        bool m_useAtlas;
+        ShadowAtlas m_atlas;
+        bool m_adaptiveResolution;
+        S64 m_texelBudget;
+        int m_minResolution;
+        int m_maxResolution;
+        const ShadowLod* m_shadowLod;
+        float m_lodTexelError;
+        bool m_paraboloid;
+        ShadowFilterSettings m_shadowFilter;
+        float m_filterDepthScale;
         float m_indirectFOV;
+        int m_numBounces;
+        SamplerType m_emissionSampler;
+        U32 m_emissionSeed;
         std::vector<LightSource> m_indirectLights;
+        std::vector<U8> m_shadowMapDirty;   // per light; set when it moves, cleared when its shadow map is rendered
+        ShadowStats m_shadowStats;
+
+        bool m_incremental;
+        int m_updateBudget;
+
+        bool m_cameraResampling;
+        int m_oversampling;
+        int m_numCameraSamples;
+        float m_resampleThreshold;
+        Mat4f m_worldToClip;
+        std::vector<IndirectLight> m_candidates;    // of the last castResampled(), with the light's power
+        std::vector<int> m_slotCandidates;          // per slot; index to m_candidates, or -1 if the slot is free
+        std::vector<Vec3f> m_cameraSamplePositions; // hit points of the camera samples of the last resampling
+
+        // renderIndirectDeferred(): the lights' parameters, each tile's range of the index texture, and the indices
+        GLuint m_deferredLightTexture;
+        GLuint m_deferredTileTexture;
+        GLuint m_deferredIndexTexture;
+
+        // State the current VPLs were cast with
+        bool m_cacheValid;
+        U32 m_cachedLightVersion;
+        U32 m_cachedSceneVersion;
+        int m_cachedNum;
+        int m_cachedBounces;
+        float m_cachedFOV;
+        SamplerType m_cachedSampler;
+        bool m_cachedResampling;
+        int m_cachedOversampling;
+        int m_cachedCameraSamples;
+        Mat4f m_cachedWorldToClip;          // the view of the last resampling, not the last call
+
+        std::vector<LightPath> m_paths;
+        int m_nextPathIndex;                // seeds the paths added incrementally
+        bool m_pathsComplete;               // no more paths fit in the free slots
     };
 
 
@@ -0,0 +1,315 @@
+#include "Lightcuts.hpp"
+
+#include "base/Random.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace FW
+{
+    namespace
+    {
+        float intensity(const Vec3f& E)
+        {
+            return E.x + E.y + E.z;
+        }
+    }
+
+    void LightTree::build(const std::vector<Vpl>& vpls)
+    {
+        m_vpls = vpls;
+        m_nodes.clear();
+
+        if (m_vpls.empty())
+        {
+            return;
+        }
+
+        // Normals are unit vectors, so scale them to a fraction of the scene extent to make a difference
+        // in orientation comparable to a difference in position.
+        AABB bounds(m_vpls[0].position, m_vpls[0].position);
+        for (const Vpl& vpl : m_vpls)
+        {
+            bounds.min = FW::min(bounds.min, vpl.position);
+            bounds.max = FW::max(bounds.max, vpl.position);
+        }
+        m_orientationScale = 0.25f * (bounds.max - bounds.min).length();
+
+        m_nodes.reserve(2 * m_vpls.size());
+
+        // Fixed seed so that the representatives, and thus the image, are the same on every frame.
+        Random rand(1234);
+        buildNode(0, int(m_vpls.size()), rand);
+    }
+
+    int LightTree::buildNode(int begin, int end, Random& rand)
+    {
+        int nodeIdx = int(m_nodes.size());
+        m_nodes.push_back(Node());
+
+        Node node;
+        node.bounds = AABB(m_vpls[begin].position, m_vpls[begin].position);
+        node.E = Vec3f(0.f);
+
+        Vec3f normalMin(1.f), normalMax(-1.f), normalSum(0.f);
+
+        for (int i = begin; i < end; ++i)
+        {
+            const Vpl& vpl = m_vpls[i];
+            node.bounds.min = FW::min(node.bounds.min, vpl.position);
+            node.bounds.max = FW::max(node.bounds.max, vpl.position);
+            normalMin = FW::min(normalMin, vpl.normal);
+            normalMax = FW::max(normalMax, vpl.normal);
+            normalSum += vpl.normal;
+            node.E += vpl.E;
+        }
+
+        // Cone around the mean normal; fall back to the full sphere when the normals cancel out.
+        node.coneAxis = normalSum.lenSqr() > 0.f ? normalSum.normalized() : Vec3f(0.f, 0.f, 1.f);
+        node.coneCos = normalSum.lenSqr() > 0.f ? 1.f : -1.f;
+
+        for (int i = begin; i < end; ++i)
+        {
+            node.coneCos = FW::min(node.coneCos, FW::dot(node.coneAxis, m_vpls[i].normal));
+        }
+
+        if (end - begin == 1)
+        {
+            node.representative = begin;
+            node.left = node.right = -1;
+            m_nodes[nodeIdx] = node;
+            return nodeIdx;
+        }
+
+        // Longest axis of the 6D bounds (position, scaled normal).
+        Vec3f positionExtent = node.bounds.max - node.bounds.min;
+        Vec3f normalExtent = (normalMax - normalMin) * m_orientationScale;
+
+        int axis = 0;
+        float longest = -1.f;
+
+        for (int i = 0; i < 6; ++i)
+        {
+            float extent = i < 3 ? positionExtent[i] : normalExtent[i - 3];
+            if (extent > longest)
+            {
+                longest = extent;
+                axis = i;
+            }
+        }
+
+        std::sort(m_vpls.begin() + begin, m_vpls.begin() + end, [axis](const Vpl& a, const Vpl& b)
+        {
+            return axis < 3 ? a.position[axis] < b.position[axis] : a.normal[axis - 3] < b.normal[axis - 3];
+        });
+
+        // Split where half of the power is on each side, keeping both children non-empty.
+        float total = intensity(node.E);
+        float accumulated = 0.f;
+        int mid = begin + 1;
+
+        for (int i = begin; i < end - 1; ++i)
+        {
+            accumulated += intensity(m_vpls[i].E);
+            mid = i + 1;
+
+            if (accumulated >= 0.5f * total)
+            {
+                break;
+            }
+        }
+
+        node.left = buildNode(begin, mid, rand);
+        node.right = buildNode(mid, end, rand);
+
+        // Pick the representative from one of the children with probability proportional to its power.
+        const Node& left = m_nodes[node.left];
+        const Node& right = m_nodes[node.right];
+        float leftIntensity = intensity(left.E);
+        float sum = leftIntensity + intensity(right.E);
+
+        node.representative = (sum <= 0.f || rand.getF32() * sum < leftIntensity) ? left.representative : right.representative;
+
+        m_nodes[nodeIdx] = node;
+        return nodeIdx;
+    }
+
+    float LightTree::geometryBound(const Node& node, const Vec3f& p, const Vec3f& n)
+    {
+        const AABB& bb = node.bounds;
+
+        Vec3f closest = FW::min(FW::max(p, bb.min), bb.max);
+        float minDistance = (closest - p).length();
+
+        // Largest value of dot(n, x - p) over the box is found at one of its corners, and the
+        // cosine is at most that divided by the smallest distance.
+        float maxSurfaceDot = 0.f;
+        float maxAxisDot = 0.f;
+        float maxDistance2 = 0.f;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            maxSurfaceDot += n[i] * (n[i] > 0.f ? bb.max[i] - p[i] : bb.min[i] - p[i]);
+            maxAxisDot += node.coneAxis[i] * (node.coneAxis[i] > 0.f ? p[i] - bb.min[i] : p[i] - bb.max[i]);
+            maxDistance2 += FW::sqr(FW::max(FW::abs(bb.min[i] - p[i]), FW::abs(bb.max[i] - p[i])));
+        }
+
+        if (maxSurfaceDot <= 0.f)
+        {
+            return 0.f;
+        }
+
+        float cosSurface = minDistance > 0.f ? FW::min(1.f, maxSurfaceDot / minDistance) : 1.f;
+
+        // Bound the angle between the cone axis and the directions towards p, then widen it by the cone.
+        float cosAxis = 1.f;
+        if (minDistance > 0.f)
+        {
+            cosAxis = maxAxisDot >= 0.f ? maxAxisDot / minDistance : maxAxisDot / FW::sqrt(maxDistance2);
+        }
+
+        float angle = std::acos(FW::clamp(cosAxis, -1.f, 1.f)) - std::acos(FW::clamp(node.coneCos, -1.f, 1.f));
+        float cosLight = angle <= 0.f ? 1.f : (angle >= 0.5f * FW_PI ? 0.f : FW::cos(angle));
+
+        if (cosLight <= 0.f)
+        {
+            return 0.f;
+        }
+
+        float inverseSquareDistance = minDistance > 0.f ? FW::min(10.f, 1.f / FW::sqr(minDistance)) : 10.f;
+
+        return cosSurface * cosLight * inverseSquareDistance / FW_PI;
+    }
+
+    void Lightcuts::shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, std::vector<Vec3f>& image)
+    {
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+        long long totalCutSize = 0;
+        long long totalShadowRays = 0;
+        int numShaded = 0;
+
+#pragma omp parallel for schedule(dynamic, 64) reduction(+:totalCutSize, totalShadowRays, numShaded)
+        for (int i = 0; i < gbuffer.getNumPixels(); ++i)
+        {
+            const GBufferSample& s = gbuffer[i];
+
+            if (!s.valid)
+            {
+                continue;
+            }
+
+            Vec3f irradiance = evalVpl(mainLight, s.position, s.normal);
+            int shadowRays = 0;
+
+            if (irradiance.max() > 0.f)
+            {
+                ++shadowRays;
+                if (!isVisible(rt, s, mainLight.position))
+                {
+                    irradiance = Vec3f(0.f);
+                }
+            }
+
+            int cutSize = 0;
+            Vec3f indirect = shadePoint(rt, s, cutSize, shadowRays);
+
+            image[i] = s.albedo * (irradiance + indirect);
+
+            totalCutSize += cutSize;
+            totalShadowRays += shadowRays;
+            ++numShaded;
+        }
+
+        m_stats.averageCutSize = numShaded ? double(totalCutSize) / numShaded : 0.0;
+        m_stats.averageShadowRays = numShaded ? double(totalShadowRays) / numShaded : 0.0;
+    }
+
+    Vec3f Lightcuts::shadePoint(const RayTracer& rt, const GBufferSample& s, int& cutSize, int& shadowRays) const
+    {
+        if (m_tree.empty())
+        {
+            return Vec3f(0.f);
+        }
+
+        const std::vector<LightTree::Node>& nodes = m_tree.getNodes();
+        auto byError = [](const CutEntry& a, const CutEntry& b) { return a.errorBound < b.errorBound; };
+
+        // The cut starts from the root and is refined at the cluster with the largest error bound
+        // until every bound is below the relative error of the total.
+        std::vector<CutEntry> heap;
+        const LightTree::Node& root = m_tree.getRoot();
+
+        float rootContribution = evalRepresentative(rt, s, root.representative, shadowRays);
+        Vec3f total = root.E * rootContribution;
+        cutSize = 1;
+
+        if (!root.isLeaf())
+        {
+            CutEntry entry = { 0, errorBound(root, s), rootContribution };
+            heap.push_back(entry);
+        }
+
+        while (!heap.empty() && cutSize < m_maxCutSize)
+        {
+            const CutEntry& worst = heap.front();
+
+            if (worst.errorBound <= m_relativeError * (s.albedo * total).max())
+            {
+                break;
+            }
+
+            CutEntry refined = worst;
+            std::pop_heap(heap.begin(), heap.end(), byError);
+            heap.pop_back();
+
+            const LightTree::Node& node = nodes[refined.node];
+            total -= node.E * refined.unitContribution;
+
+            const int children[] = { node.left, node.right };
+
+            for (int childIdx : children)
+            {
+                const LightTree::Node& child = nodes[childIdx];
+
+                // One of the children shares the parent's representative; reuse its shadow ray.
+                float contribution = child.representative == node.representative ?
+                    refined.unitContribution :
+                    evalRepresentative(rt, s, child.representative, shadowRays);
+
+                total += child.E * contribution;
+
+                if (!child.isLeaf())
+                {
+                    CutEntry entry = { childIdx, errorBound(child, s), contribution };
+                    heap.push_back(entry);
+                    std::push_heap(heap.begin(), heap.end(), byError);
+                }
+            }
+
+            ++cutSize;
+        }
+
+        return FW::max(total, Vec3f(0.f));
+    }
+
+    float Lightcuts::evalRepresentative(const RayTracer& rt, const GBufferSample& s, int vplIdx, int& shadowRays) const
+    {
+        const Vpl& vpl = m_tree.getVpls()[vplIdx];
+        float geometry = evalVplGeometry(vpl, s.position, s.normal);
+
+        if (geometry <= 0.f)
+        {
+            return 0.f;
+        }
+
+        ++shadowRays;
+        return isVisible(rt, s, vpl.position) ? geometry : 0.f;
+    }
+
+    float Lightcuts::errorBound(const LightTree::Node& node, const GBufferSample& s) const
+    {
+        return s.albedo.max() * node.E.max() * LightTree::geometryBound(node, s.position, s.normal);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+
+#include "ManyLights.hpp"
+#include "rtutil.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Binary tree over the VPLs. Every node is a cluster that can stand in for all the lights below it:
+    // its total emission is shaded with the geometry and visibility of one representative light.
+    class LightTree
+    {
+    public:
+        struct Node
+        {
+            AABB bounds;            // positions of the lights in the cluster
+            Vec3f coneAxis;         // the light normals lie within this cone
+            float coneCos;
+            Vec3f E;                // total emission of the cluster
+            int representative;     // index to getVpls()
+            int left, right;        // child node indices, -1 in leaves
+
+            bool isLeaf() const { return left < 0; }
+        };
+
+        // The split is chosen along the longest axis of the joint position/orientation bounds, at the
+        // power-weighted median, so bright lights end up in small clusters.
+        void build(const std::vector<Vpl>& vpls);
+
+        // Upper bound of evalVplGeometry() over all lights of the node at a point p with normal n.
+        static float geometryBound(const Node& node, const Vec3f& p, const Vec3f& n);
+
+        const std::vector<Vpl>& getVpls() const { return m_vpls; }
+        const std::vector<Node>& getNodes() const { return m_nodes; }
+        const Node& getRoot() const { return m_nodes[0]; }
+        bool empty() const { return m_nodes.empty(); }
+
+    private:
+        int buildNode(int begin, int end, Random& rand);
+
+        std::vector<Vpl> m_vpls;
+        std::vector<Node> m_nodes;
+        float m_orientationScale;   // weight of the normals relative to the positions when splitting
+    };
+
+
+    // Lightcuts: for every shading point, picks a cut through the light tree such that the upper bound
+    // of each cluster's error stays below a fraction of the total estimate, then shades with one
+    // representative per cluster. The cost grows roughly logarithmically with the number of VPLs.
+    class Lightcuts
+    {
+    public:
+        struct Stats
+        {
+            double averageCutSize;
+            double averageShadowRays;
+        };
+
+        Lightcuts() :
+            m_relativeError(0.02f),
+            m_maxCutSize(1000)
+        {}
+
+        void setRelativeError(float e) { m_relativeError = e; }
+        void setMaxCutSize(int n) { m_maxCutSize = n; }
+
+        void build(const std::vector<Vpl>& vpls) { m_tree.build(vpls); }
+        const LightTree& getTree() const { return m_tree; }
+
+        // Shades the G-buffer with the main light (exactly) and the VPLs (through the cuts).
+        void shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, std::vector<Vec3f>& image);
+
+        const Stats& getStats() const { return m_stats; }
+
+    private:
+        struct CutEntry
+        {
+            int node;
+            float errorBound;
+            float unitContribution;     // unshadowed geometry term * visibility of the representative, per unit emission
+        };
+
+        Vec3f shadePoint(const RayTracer& rt, const GBufferSample& s, int& cutSize, int& shadowRays) const;
+        float evalRepresentative(const RayTracer& rt, const GBufferSample& s, int vplIdx, int& shadowRays) const;
+        float errorBound(const LightTree::Node& node, const GBufferSample& s) const;
+
+        LightTree m_tree;
+        float m_relativeError;
+        int m_maxCutSize;
+        Stats m_stats;
+    };
+}
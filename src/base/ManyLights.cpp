@@ -0,0 +1,229 @@
+#include "ManyLights.hpp"
+#include "InstantRadiosity.hpp"
+
+#include <cfloat>
+#include <cmath>
+
+
+namespace FW
+{
+    Vpl::Vpl(const LightSource& ls) :
+        position(ls.getPosition()),
+        normal(ls.getNormal().normalized()),
+        E(ls.getEmission()),
+        cosHalfFov(FW::cos(0.5f * ls.getFOVRad()))
+    {
+    }
+
+    void collectVpls(const InstantRadiosity& ir, std::vector<Vpl>& vpls)
+    {
+        vpls.clear();
+        vpls.reserve(ir.getNumLights());
+
+        for (int i = 0; i < ir.getNumLights(); ++i)
+        {
+            if (ir.getLight(i).isEnabled())
+            {
+                vpls.push_back(Vpl(ir.getLight(i)));
+            }
+        }
+    }
+
+    float evalVplGeometry(const Vpl& vpl, const Vec3f& p, const Vec3f& n)
+    {
+        Vec3f d = p - vpl.position;
+        float distance2 = d.lenSqr();
+
+        if (distance2 <= 0.f)
+        {
+            return 0.f;
+        }
+
+        Vec3f incoming = d / FW::sqrt(distance2);
+        float cosSurface = FW::max(0.f, FW::dot(-incoming, n));
+        float cosLight = FW::max(0.f, FW::dot(incoming, vpl.normal));
+
+        if (cosSurface <= 0.f || cosLight <= 0.f)
+        {
+            return 0.f;
+        }
+
+        float inverseSquareDistance = FW::min(10.f, 1.f / distance2);
+        float cone = FW::clamp(4.f * (cosLight - vpl.cosHalfFov) / (1.f - vpl.cosHalfFov), 0.f, 1.f);
+
+        return cosSurface * cosLight * inverseSquareDistance * cone / FW_PI;
+    }
+
+    float getInfluenceRadius(const Vpl& vpl, float threshold)
+    {
+        if (threshold <= 0.f)
+        {
+            return FLT_MAX;
+        }
+
+        float E = vpl.E.max();
+        if (10.f * E < threshold * FW_PI)
+        {
+            return 0.f;
+        }
+
+        return FW::sqrt(E / (threshold * FW_PI));
+    }
+
+    bool influencesBox(const Vpl& vpl, float radius, const AABB& box)
+    {
+        if (radius <= 0.f)
+        {
+            return false;
+        }
+
+        // the nearest point of the box
+        Vec3f nearest = FW::clamp(vpl.position, box.min, box.max);
+        if (radius < FLT_MAX && (nearest - vpl.position).lenSqr() > radius * radius)
+        {
+            return false;
+        }
+
+        // the corner farthest along the normal
+        Vec3f corner(vpl.normal.x > 0.f ? box.max.x : box.min.x, vpl.normal.y > 0.f ? box.max.y : box.min.y, vpl.normal.z > 0.f ? box.max.z : box.min.z);
+        return FW::dot(corner - vpl.position, vpl.normal) > 0.f;
+    }
+
+    Vec3f evalAlbedo(const SurfaceInteraction& si)
+    {
+        const auto mat = si.material;
+
+        if (mat->textures[MeshBase::TextureType_Diffuse].exists())
+        {
+            // read diffuse texture like in assignment1
+            const Texture& tex = mat->textures[MeshBase::TextureType_Diffuse];
+            const Image& texImg = *tex.getImage();
+
+            return texImg.getVec4f(FW::getTexelCoords(si.uv, texImg.getSize())).getXYZ();
+        }
+
+        // no texture, use constant albedo from material structure.
+        return mat->diffuse.getXYZ();
+    }
+
+    void GBuffer::build(const RayTracer& rt, const Mat4f& worldToClip, const Vec2i& size)
+    {
+        m_size = size;
+        m_samples.assign(size.x * size.y, GBufferSample());
+
+        Mat4f clipToWorld = worldToClip.inverted();
+
+#pragma omp parallel for schedule(dynamic)
+        for (int y = 0; y < size.y; ++y)
+        {
+            for (int x = 0; x < size.x; ++x)
+            {
+                Vec2f ndc(2.f * (x + 0.5f) / size.x - 1.f, 2.f * (y + 0.5f) / size.y - 1.f);
+                traceCameraSample(rt, clipToWorld, ndc, m_samples[x + y * size.x]);
+            }
+        }
+    }
+
+    bool traceCameraSample(const RayTracer& rt, const Mat4f& clipToWorld, const Vec2f& ndc, GBufferSample& s)
+    {
+        // unproject the point at the near and far planes
+        Vec4f nearPoint = clipToWorld * Vec4f(ndc, -1.f, 1.f);
+        Vec4f farPoint = clipToWorld * Vec4f(ndc, 1.f, 1.f);
+        Vec3f orig = nearPoint.getXYZ() / nearPoint.w;
+        Vec3f dir = (farPoint.getXYZ() / farPoint.w - orig).normalized();
+
+        Hit hit;
+
+        if (!rt.intersect<TraceFeature_MaxDistance | TraceFeature_AlphaTest>(Ray(orig, dir), hit))
+        {
+            s.valid = false;
+            return false;
+        }
+
+        SurfaceInteraction si = rt.evaluateSurface(hit);
+
+        s.position = si.position;
+        s.geometricNormal = si.geometricNormal;
+        s.normal = si.normal.lenSqr() > 0.f ? si.normal.normalized() : si.geometricNormal;
+        s.albedo = evalAlbedo(si);
+        s.valid = true;
+        return true;
+    }
+
+    bool isVisible(const RayTracer& rt, const GBufferSample& s, const Vec3f& lightPos)
+    {
+        Vec3f d = lightPos - s.position;
+        float distance = d.length();
+
+        if (distance <= RayEpsilon)
+        {
+            return true;
+        }
+
+        Ray ray = Ray::spawn(s.position, s.geometricNormal, d / distance, distance - RayEpsilon);
+        return !rt.occluded<TraceFeature_MaxDistance | TraceFeature_AlphaTest>(ray);
+    }
+
+    Vec3f shadeSample(const RayTracer& rt, const GBufferSample& s, const Vpl& mainLight, const std::vector<Vpl>& vpls)
+    {
+        if (!s.valid)
+        {
+            return Vec3f(0.f);
+        }
+
+        Vec3f irradiance(0.f);
+
+        // skip the shadow ray for lights that wouldn't contribute anyway
+        Vec3f direct = evalVpl(mainLight, s.position, s.normal);
+        if (direct.max() > 0.f && isVisible(rt, s, mainLight.position))
+        {
+            irradiance += direct;
+        }
+
+        for (const Vpl& vpl : vpls)
+        {
+            Vec3f contribution = evalVpl(vpl, s.position, s.normal);
+            if (contribution.max() > 0.f && isVisible(rt, s, vpl.position))
+            {
+                irradiance += contribution;
+            }
+        }
+
+        return s.albedo * irradiance;
+    }
+
+    void shadeBruteForce(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight,
+        const std::vector<Vpl>& vpls, std::vector<Vec3f>& image)
+    {
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < gbuffer.getNumPixels(); ++i)
+        {
+            image[i] = shadeSample(rt, gbuffer[i], mainLight, vpls);
+        }
+    }
+
+    float relativeRmsError(const std::vector<Vec3f>& image, const std::vector<Vec3f>& reference)
+    {
+        if (image.size() != reference.size() || reference.empty())
+        {
+            return 0.f;
+        }
+
+        auto luminance = [](const Vec3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; };
+
+        double sumSquares = 0.0;
+        double sumReference = 0.0;
+
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            double diff = luminance(image[i]) - luminance(reference[i]);
+            sumSquares += diff * diff;
+            sumReference += luminance(reference[i]);
+        }
+
+        double mean = sumReference / reference.size();
+        return mean > 0.0 ? float(std::sqrt(sumSquares / image.size()) / mean) : 0.f;
+    }
+}
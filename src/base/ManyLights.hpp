@@ -0,0 +1,100 @@
+#pragma once
+
+
+#include "RayTracer.hpp"
+#include "ShadowMap.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    class InstantRadiosity;
+
+
+    // A spot light with a cosine falloff, i.e. a LightSource reduced to what shading needs.
+    // The CPU shading paths use these for the main light and for the VPLs alike.
+    struct Vpl
+    {
+        Vec3f position;
+        Vec3f normal;       // cone axis, unit length
+        Vec3f E;
+        float cosHalfFov;   // cosine of the half opening angle of the cone
+
+        Vpl() : position(), normal(0.f, 0.f, -1.f), E(), cosHalfFov(-1.f) {}
+        explicit Vpl(const LightSource& ls);
+    };
+
+    // The enabled indirect lights of the instant radiosity solution.
+    void collectVpls(const InstantRadiosity& ir, std::vector<Vpl>& vpls);
+
+    // Unshadowed irradiance per unit emission the light contributes to a point p with unit normal n, divided by
+    // PI so that multiplying with the emission and the albedo gives the outgoing radiance. This is the same
+    // expression the MeshBase::draw_generic shader evaluates: both cosines, the clamped inverse square distance
+    // and the cone falloff.
+    float evalVplGeometry(const Vpl& vpl, const Vec3f& p, const Vec3f& n);
+    inline Vec3f evalVpl(const Vpl& vpl, const Vec3f& p, const Vec3f& n) { return vpl.E * evalVplGeometry(vpl, p, n); }
+
+    // Distance beyond which the light adds less than threshold to the outgoing radiance of a white surface, from
+    // the bound min(10, 1 / d^2) / PI of evalVplGeometry(): 0 if it never adds that much, FLT_MAX if threshold is 0.
+    float getInfluenceRadius(const Vpl& vpl, float threshold);
+
+    // Whether the light can add threshold or more to any point of the box: its influence sphere has to reach the
+    // box, and the box can't lie wholly behind the light.
+    bool influencesBox(const Vpl& vpl, float radius, const AABB& box);
+
+    // Diffuse albedo at a hit: the diffuse texture if there is one, the material color otherwise.
+    Vec3f evalAlbedo(const SurfaceInteraction& si);
+
+
+    // The first hit of a camera ray, with everything the shading needs.
+    struct GBufferSample
+    {
+        Vec3f position;
+        Vec3f normal;           // shading normal
+        Vec3f geometricNormal;  // used for offsetting shadow rays
+        Vec3f albedo;
+        bool valid;             // false if the ray missed the scene
+
+        GBufferSample() : position(), normal(), geometricNormal(), albedo(), valid(false) {}
+    };
+
+    // Traces a camera ray through a point in normalized device coordinates; clipToWorld is the inverse of
+    // the camera's projection * worldToCamera. Returns false (and leaves s invalid) if the ray misses.
+    bool traceCameraSample(const RayTracer& rt, const Mat4f& clipToWorld, const Vec2f& ndc, GBufferSample& s);
+
+    // Primary visibility for the CPU shading paths, ray traced through every pixel center.
+    // Row 0 is the bottom row of the image, like in OpenGL textures.
+    class GBuffer
+    {
+    public:
+        GBuffer() : m_size(0, 0) {}
+
+        // worldToClip is the camera's projection * worldToCamera.
+        void build(const RayTracer& rt, const Mat4f& worldToClip, const Vec2i& size);
+
+        const Vec2i& getSize() const { return m_size; }
+        int getNumPixels() const { return m_size.x * m_size.y; }
+
+        const GBufferSample& operator[](int i) const { return m_samples[i]; }
+        const GBufferSample& get(int x, int y) const { return m_samples[x + y * m_size.x]; }
+
+    private:
+        Vec2i m_size;
+        std::vector<GBufferSample> m_samples;
+    };
+
+    // Shadow ray from a G-buffer point to a light.
+    bool isVisible(const RayTracer& rt, const GBufferSample& s, const Vec3f& lightPos);
+
+    // Outgoing radiance at a G-buffer point lit by the main light and every VPL, with one shadow ray per light.
+    Vec3f shadeSample(const RayTracer& rt, const GBufferSample& s, const Vpl& mainLight, const std::vector<Vpl>& vpls);
+
+    // Shades the G-buffer with the main light and every VPL, tracing one shadow ray per light and pixel.
+    // This is the reference the many-light methods are measured against.
+    void shadeBruteForce(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight,
+        const std::vector<Vpl>& vpls, std::vector<Vec3f>& image);
+
+    // Root mean square of the per-pixel luminance difference, relative to the mean luminance of the reference.
+    float relativeRmsError(const std::vector<Vec3f>& image, const std::vector<Vec3f>& reference);
+}
@@ -0,0 +1,264 @@
+#include "PrefilteredShadowMap.hpp"
+#include "InstantRadiosity.hpp"
+
+
+namespace FW
+{
+    void PrefilteredShadowMap::build(const DepthMap& map, const LightSource& light, float depthScale, const ShadowFilterSettings& settings)
+    {
+        m_settings = settings;
+        m_projection = light.getProjection();
+        m_posToLightClip = light.getPosToLightClip();
+        m_posToLightView = light.getPosToLightView();
+        m_near = light.getNear();
+        m_depthScale = FW::max(depthScale, 1e-6f);
+
+        // The moments of the linear depth; the cleared texels are as far as the far plane.
+        Vec2i size = map.size;
+        std::vector<Vec2f> moments(size.x * size.y);
+
+        for (int i = 0; i < size.x * size.y; ++i)
+        {
+            float t = FW::clamp((toLinearDepth(map.depth[i], light.getFar()) - m_near) / m_depthScale, 0.f, 1.f);
+            moments[i] = m_settings.filter == ShadowFilter_Exponential ? Vec2f(FW::exp(m_settings.exponent * t), 0.f) : Vec2f(t, t * t);
+        }
+
+        if (m_settings.filter != ShadowFilter_None)
+        {
+            blur(moments, size);
+        }
+
+        m_sizes.assign(1, size);
+        m_levels.clear();
+        m_levels.push_back(std::move(moments));
+
+        // Box filtered mips down to a single texel; the odd rows and columns are averaged into the last ones.
+        while (m_settings.filter != ShadowFilter_None && m_sizes.back().max() > 1)
+        {
+            const std::vector<Vec2f>& fine = m_levels.back();
+            Vec2i fineSize = m_sizes.back();
+            Vec2i coarseSize = FW::max(fineSize / 2, Vec2i(1));
+            std::vector<Vec2f> coarse(coarseSize.x * coarseSize.y, Vec2f(0.f));
+            std::vector<int> counts(coarse.size(), 0);
+
+            for (int y = 0; y < fineSize.y; ++y)
+            {
+                for (int x = 0; x < fineSize.x; ++x)
+                {
+                    int c = FW::min(x / 2, coarseSize.x - 1) + FW::min(y / 2, coarseSize.y - 1) * coarseSize.x;
+                    coarse[c] += fine[x + y * fineSize.x];
+                    ++counts[c];
+                }
+            }
+
+            for (size_t c = 0; c < coarse.size(); ++c)
+            {
+                coarse[c] *= 1.f / float(counts[c]);
+            }
+
+            m_sizes.push_back(coarseSize);
+            m_levels.push_back(std::move(coarse));
+        }
+    }
+
+    float PrefilteredShadowMap::toLinearDepth(float windowDepth, float far) const
+    {
+        if (m_projection == LightSource::Projection_Paraboloid)
+        {
+            return m_near + windowDepth * (far - m_near);
+        }
+
+        // inverse of the depth row of Mat4f::perspective(): the distance along the light's axis
+        float ndc = 2.f * windowDepth - 1.f;
+        return 2.f * far * m_near / ((far + m_near) - ndc * (far - m_near));
+    }
+
+    void PrefilteredShadowMap::blur(std::vector<Vec2f>& moments, const Vec2i& size) const
+    {
+        int r = m_settings.blurRadius;
+        if (r <= 0)
+        {
+            return;
+        }
+
+        // Separable box filter, clamped to the edges; rows first, then columns.
+        std::vector<Vec2f> temp(moments.size());
+        float weight = 1.f / float(2 * r + 1);
+
+        for (int y = 0; y < size.y; ++y)
+        {
+            for (int x = 0; x < size.x; ++x)
+            {
+                Vec2f sum(0.f);
+                for (int k = -r; k <= r; ++k)
+                {
+                    sum += moments[FW::clamp(x + k, 0, size.x - 1) + y * size.x];
+                }
+                temp[x + y * size.x] = sum * weight;
+            }
+        }
+
+        for (int y = 0; y < size.y; ++y)
+        {
+            for (int x = 0; x < size.x; ++x)
+            {
+                Vec2f sum(0.f);
+                for (int k = -r; k <= r; ++k)
+                {
+                    sum += temp[x + FW::clamp(y + k, 0, size.y - 1) * size.x];
+                }
+                moments[x + y * size.x] = sum * weight;
+            }
+        }
+    }
+
+    Vec2f PrefilteredShadowMap::sample(int level, const Vec2f& uv) const
+    {
+        // bilinear, clamped to the edges like GL_CLAMP
+        const Vec2i& size = m_sizes[level];
+        const std::vector<Vec2f>& texels = m_levels[level];
+
+        Vec2f p = uv * Vec2f(size) - Vec2f(0.5f);
+        int x0 = (int)FW::floor(p.x), y0 = (int)FW::floor(p.y);
+        float fx = p.x - float(x0), fy = p.y - float(y0);
+
+        int xa = FW::clamp(x0, 0, size.x - 1), xb = FW::clamp(x0 + 1, 0, size.x - 1);
+        int ya = FW::clamp(y0, 0, size.y - 1), yb = FW::clamp(y0 + 1, 0, size.y - 1);
+
+        Vec2f bottom = texels[xa + ya * size.x] * (1.f - fx) + texels[xb + ya * size.x] * fx;
+        Vec2f top = texels[xa + yb * size.x] * (1.f - fx) + texels[xb + yb * size.x] * fx;
+        return bottom * (1.f - fy) + top * fy;
+    }
+
+    float PrefilteredShadowMap::lookup(const Vec3f& p) const
+    {
+        if (m_levels.empty())
+        {
+            return 1.f;
+        }
+
+        Vec3f view = (m_posToLightView * Vec4f(p, 1.f)).getXYZ();
+        float depth;
+        Vec2f uv;
+
+        if (m_projection == LightSource::Projection_Paraboloid)
+        {
+            depth = view.length();
+            if (depth <= 0.f)
+            {
+                return 1.f;
+            }
+
+            Vec3f d = view / depth;
+            uv = 0.5f * Vec2f(d.x, d.y) / FW::max(1.f - d.z, 1e-4f) + Vec2f(0.5f);
+        }
+        else
+        {
+            // behind the light, where its cone doesn't reach anyway
+            Vec4f clip = m_posToLightClip * Vec4f(p, 1.f);
+            if (clip.w <= 0.f)
+            {
+                return 1.f;
+            }
+
+            depth = -view.z;
+            uv = 0.5f * Vec2f(clip.x, clip.y) / clip.w + Vec2f(0.5f);
+        }
+
+        float t = FW::clamp((depth - m_near) / m_depthScale, 0.f, 1.f);
+
+        // the nearest texel, like the GL_NEAREST depth textures; front faces are culled, so no bias is needed
+        if (m_settings.filter == ShadowFilter_None)
+        {
+            const Vec2i& size = m_sizes[0];
+            int x = FW::clamp((int)(uv.x * size.x), 0, size.x - 1);
+            int y = FW::clamp((int)(uv.y * size.y), 0, size.y - 1);
+            return t <= m_levels[0][x + y * size.x].x ? 1.f : 0.f;
+        }
+
+        // the two mip levels around the filter width, blended
+        float level = FW::clamp(m_settings.softness, 0.f, float(getNumLevels() - 1));
+        int l0 = (int)level;
+        int l1 = FW::min(l0 + 1, getNumLevels() - 1);
+        float f = level - float(l0);
+        Vec2f m = sample(l0, uv) * (1.f - f) + (f > 0.f ? sample(l1, uv) * f : Vec2f(0.f));
+
+        if (m_settings.filter == ShadowFilter_Exponential)
+        {
+            return FW::min(1.f, m.x * FW::exp(-m_settings.exponent * t));
+        }
+
+        if (t <= m.x)
+        {
+            return 1.f;
+        }
+
+        float variance = FW::max(m.y - m.x * m.x, m_settings.minVariance);
+        float d = t - m.x;
+        float pMax = variance / (variance + d * d);
+        return FW::clamp((pMax - m_settings.bleedReduction) / (1.f - m_settings.bleedReduction), 0.f, 1.f);
+    }
+
+    void buildPrefilteredShadowMaps(const InstantRadiosity& ir, const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer,
+        int resolution, float depthScale, const ShadowFilterSettings& settings, std::vector<PrefilteredShadowMap>& maps)
+    {
+        std::vector<int> lights;
+        for (int i = 0; i < ir.getNumLights(); ++i)
+        {
+            if (ir.getLight(i).isEnabled())
+            {
+                lights.push_back(i);
+            }
+        }
+
+        maps.assign(lights.size(), PrefilteredShadowMap());
+
+#pragma omp parallel for schedule(dynamic)
+        for (int k = 0; k < (int)lights.size(); ++k)
+        {
+            buildPrefilteredShadowMap(ir.getLight(lights[k]), geometry, rasterizer, resolution, depthScale, settings, maps[k]);
+        }
+    }
+
+    void buildPrefilteredShadowMap(const LightSource& light, const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer,
+        int resolution, float depthScale, const ShadowFilterSettings& settings, PrefilteredShadowMap& map)
+    {
+        bool paraboloid = light.getProjection() == LightSource::Projection_Paraboloid;
+
+        ShadowRasterizer projector = rasterizer;
+        projector.setProjection(light.getProjection(), Vec2f(light.getNear(), light.getFar()));
+
+        DepthMap depth;
+        depth.clear(Vec2i(resolution));
+        projector.render(geometry, paraboloid ? light.getPosToLightView() : light.getPosToLightClip(), depth);
+        map.build(depth, light, depthScale, settings);
+    }
+
+    Vec3f shadeSample(const RayTracer& rt, const GBufferSample& s, const Vpl& mainLight, const std::vector<Vpl>& vpls,
+        const std::vector<PrefilteredShadowMap>& maps)
+    {
+        if (!s.valid)
+        {
+            return Vec3f(0.f);
+        }
+
+        Vec3f irradiance(0.f);
+
+        Vec3f direct = evalVpl(mainLight, s.position, s.normal);
+        if (direct.max() > 0.f && isVisible(rt, s, mainLight.position))
+        {
+            irradiance += direct;
+        }
+
+        for (size_t i = 0; i < vpls.size(); ++i)
+        {
+            Vec3f contribution = evalVpl(vpls[i], s.position, s.normal);
+            if (contribution.max() > 0.f)
+            {
+                irradiance += contribution * maps[i].lookup(s.position);
+            }
+        }
+
+        return s.albedo * irradiance;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+
+#include "ManyLights.hpp"
+#include "ShadowRasterizer.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // A shadow map turned into moments of linear depth, blurred and mip mapped, so that a lookup returns
+    // a soft visibility from a single filtered fetch instead of many depth comparisons. The depth is the
+    // distance along the light's axis for perspective maps and the distance to the light for paraboloid
+    // ones, measured from the near plane and divided by a depth scale, normally the scene's extent, so
+    // that it falls in [0, 1] where the exponent of ESM is meaningful. With ShadowFilter_None, the map
+    // keeps just the linear depth, unblurred and without mips, for hard comparisons.
+    class PrefilteredShadowMap
+    {
+    public:
+        PrefilteredShadowMap() : m_projection(LightSource::Projection_Perspective), m_near(0.f), m_depthScale(1.f) {}
+
+        // Builds the moments of a map the ShadowRasterizer (or the GL depth pass) rendered for light.
+        void build(const DepthMap& map, const LightSource& light, float depthScale, const ShadowFilterSettings& settings);
+
+        // Visibility of p in [0, 1], filtered over about 2^softness texels by blending two mip levels.
+        float lookup(const Vec3f& p) const;
+
+        const ShadowFilterSettings& getSettings() const { return m_settings; }
+        float getDepthScale() const { return m_depthScale; }
+        int getNumLevels() const { return (int)m_levels.size(); }
+        const Vec2i& getSize(int level) const { return m_sizes[level]; }
+        // Row 0 at the bottom, like DepthMap; ESM uses only x.
+        const std::vector<Vec2f>& getLevel(int level) const { return m_levels[level]; }
+
+    private:
+        float toLinearDepth(float windowDepth, float far) const;
+        Vec2f sample(int level, const Vec2f& uv) const;
+        void blur(std::vector<Vec2f>& moments, const Vec2i& size) const;
+
+        ShadowFilterSettings m_settings;
+        LightSource::Projection m_projection;
+        Mat4f m_posToLightClip;
+        Mat4f m_posToLightView;
+        float m_near;
+        float m_depthScale;
+        std::vector<Vec2i> m_sizes;
+        std::vector<std::vector<Vec2f>> m_levels;
+    };
+
+    // Rasterizes and prefilters the map of one light, with the light's projection.
+    void buildPrefilteredShadowMap(const LightSource& light, const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer,
+        int resolution, float depthScale, const ShadowFilterSettings& settings, PrefilteredShadowMap& map);
+
+    // The same for every enabled light of ir, in the order of collectVpls(), so that
+    // maps[i] belongs to vpls[i]. The rasterizer is used with each light's projection.
+    void buildPrefilteredShadowMaps(const InstantRadiosity& ir, const ShadowGeometry& geometry, const ShadowRasterizer& rasterizer,
+        int resolution, float depthScale, const ShadowFilterSettings& settings, std::vector<PrefilteredShadowMap>& maps);
+
+    // shadeSample() with the visibility of each VPL looked up from its map; the main light keeps its shadow ray.
+    Vec3f shadeSample(const RayTracer& rt, const GBufferSample& s, const Vpl& mainLight, const std::vector<Vpl>& vpls,
+        const std::vector<PrefilteredShadowMap>& maps);
+}
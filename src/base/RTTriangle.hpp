@@ -4,6 +4,8 @@
 #include "3d/Mesh.hpp"
 #include "base/math.hpp"
 
+#include <utility>
+
 
 namespace FW {
 
@@ -22,6 +24,33 @@ namespace FW {
             N = -M * v0;
         }
     };
+
+    // Per-ray constants of the watertight ray/triangle test [Woop13]: the ray is sheared and scaled so that
+    // it points along +z of a permuted coordinate frame whose z axis is the dominant direction component.
+    // Computed once per ray and shared by every triangle the ray is tested against.
+    struct WatertightRay {
+        Vec3f orig;
+        int kx, ky, kz;     // permutation of the axes; kz is the dominant direction
+        float Sx, Sy, Sz;   // shear and scale constants
+
+        WatertightRay() : orig(), kx(0), ky(1), kz(2), Sx(0.f), Sy(0.f), Sz(1.f) {}
+        WatertightRay(const Vec3f& orig, const Vec3f& dir) : orig(orig) {
+            Vec3f absDir = FW::abs(dir);
+            kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+
+            // swap to preserve the winding of the triangle
+            if (dir[kz] < 0.0f) {
+                std::swap(kx, ky);
+            }
+
+            Sx = dir[kx] / dir[kz];
+            Sy = dir[ky] / dir[kz];
+            Sz = 1.0f / dir[kz];
+        }
+    };
+
     // The user pointer member can be used for identifying the triangle in the "parent" mesh representation.
     struct RTTriangle {
 
@@ -98,6 +127,50 @@ namespace FW {
             return u > .0f && v > .0f && u + v < 1.0f;
         }
 
+        // Watertight triangle intersection as suggested in [Woop13]. Edges and vertices shared by two
+        // triangles are hit by at least one of them. u and v follow the same convention as intersect_woop.
+        bool intersect_watertight(const WatertightRay& ray, float& t, float& u, float& v) const {
+
+            const Vec3f A = m_vertices[0].p - ray.orig,
+                B = m_vertices[1].p - ray.orig,
+                C = m_vertices[2].p - ray.orig;
+
+            // shear and scale the vertices into ray space
+            const float Ax = A[ray.kx] - ray.Sx * A[ray.kz], Ay = A[ray.ky] - ray.Sy * A[ray.kz],
+                Bx = B[ray.kx] - ray.Sx * B[ray.kz], By = B[ray.ky] - ray.Sy * B[ray.kz],
+                Cx = C[ray.kx] - ray.Sx * C[ray.kz], Cy = C[ray.ky] - ray.Sy * C[ray.kz];
+
+            // scaled barycentric coordinates
+            float U = Cx * By - Cy * Bx,
+                V = Ax * Cy - Ay * Cx,
+                W = Bx * Ay - By * Ax;
+
+            // fall back to double precision when the ray runs exactly along an edge
+            if (U == 0.0f || V == 0.0f || W == 0.0f) {
+                U = float((double)Cx * (double)By - (double)Cy * (double)Bx);
+                V = float((double)Ax * (double)Cy - (double)Ay * (double)Cx);
+                W = float((double)Bx * (double)Ay - (double)By * (double)Ax);
+            }
+
+            if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) {
+                return false;
+            }
+
+            const float det = U + V + W;
+            if (det == 0.0f) {
+                return false;
+            }
+
+            const float T = U * ray.Sz * A[ray.kz] + V * ray.Sz * B[ray.kz] + W * ray.Sz * C[ray.kz];
+
+            const float invDet = 1.0f / det;
+            t = T * invDet;
+            u = V * invDet;
+            v = W * invDet;
+
+            return true;
+        }
+
     };
 
 
@@ -0,0 +1,67 @@
+#pragma once
+
+
+#include "base/Math.hpp"
+
+#include <limits>
+
+
+namespace FW
+{
+    // Default distance rays are started away from their origin so that they don't hit the surface they left.
+    static const float RayEpsilon = 1e-4f;
+
+    // A ray with an explicit interval [tMin, tMax]. The direction is unit length, so t is a distance along it.
+    // The reciprocal direction and the direction signs are computed once here and reused by every box test.
+    struct Ray
+    {
+        Vec3f orig;
+        Vec3f dir;
+        float tMin, tMax;
+        Vec3f iDir;         // 1 / dir
+        int dirIsNeg[3];    // 1 for negative direction components; picks the near and far planes of a box
+
+        Ray() :
+            orig(), dir(0.f, 0.f, 1.f),
+            tMin(0.f), tMax(std::numeric_limits<float>::max())
+        {
+            setup();
+        }
+
+        // dir must be normalized.
+        Ray(const Vec3f& orig, const Vec3f& dir, float tMin = 0.f, float tMax = std::numeric_limits<float>::max()) :
+            orig(orig), dir(dir),
+            tMin(tMin), tMax(tMax)
+        {
+            setup();
+        }
+
+        // The ray from 'from' towards 'to', ending epsilon short of 'to' (e.g. a shadow ray towards a light).
+        static Ray segment(const Vec3f& from, const Vec3f& to, float epsilon = RayEpsilon)
+        {
+            Vec3f d = to - from;
+            float length = d.length();
+            return Ray(from, length > 0.f ? d / length : Vec3f(0.f, 0.f, 1.f), epsilon, FW::max(epsilon, length - epsilon));
+        }
+
+        // A ray leaving a surface. The origin is pushed off the surface along the geometric normal,
+        // on the side the ray leaves towards, which avoids self-intersection also at grazing angles.
+        static Ray spawn(const Vec3f& p, const Vec3f& n, const Vec3f& dir, float tMax = std::numeric_limits<float>::max(),
+            float epsilon = RayEpsilon)
+        {
+            Vec3f offset = n * (FW::dot(n, dir) >= 0.f ? epsilon : -epsilon);
+            return Ray(p + offset, dir, 0.f, tMax);
+        }
+
+        Vec3f at(float t) const { return orig + t * dir; }
+
+    private:
+        void setup()
+        {
+            iDir = 1.f / dir;
+            dirIsNeg[0] = dir.x < 0.f;
+            dirIsNeg[1] = dir.y < 0.f;
+            dirIsNeg[2] = dir.z < 0.f;
+        }
+    };
+}
@@ -87,7 +87,13 @@ namespace FW
     // --------------------------------------------------------------------------
 
 
-    RayTracer::RayTracer()
+    RayTracer::RayTracer() :
+        m_rayCount(0),
+        m_statRays(0), m_statNodes(0), m_statTriangles(0),
+        m_intersectMode(IntersectMode_Woop),
+        m_alphaTest(nullptr),
+        m_alphaTestData(nullptr),
+        m_alphaOpaque(nullptr)
     {
     }
 
@@ -109,90 +115,396 @@ namespace FW
         m_bvh.save(ofs);
     }
 
-    void RayTracer::constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode) {
-        m_bvh = Bvh(triangles, splitMode);
+    void RayTracer::constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode,
+        const BvhBuildParams& params) {
+        m_bvh = Bvh(triangles, splitMode, params);
         m_triangles = &triangles;
     }
 
 
     RaycastResult RayTracer::raycast(const Vec3f& orig, const Vec3f& dir) const {
-        ++m_rayCount;
+        // Legacy interface: dir spans the whole segment and t is returned as a fraction of it.
+        float length = dir.length();
 
-        float tMin = 1.f;
-        Vec3f iDir = 1.f / dir;
+        if (length <= 0.f)
+        {
+            return RaycastResult();
+        }
+
+        RaycastResult result = raycast(Ray(orig, dir / length, 0.f, length));
+
+        if (result.tri)
+        {
+            result.t /= length;
+            result.dir = dir;
+        }
 
-        return intersectNode(orig, dir, iDir, m_bvh.root(), tMin);
+        return result;
     }
 
-    RaycastResult RayTracer::intersectNode(const Vec3f& orig, const Vec3f& dir, const Vec3f& iDir, const BvhNode& node,
-        float& tMin) const
-    {
-        if (!isIntersectedWithBB(orig, iDir, node.bb, tMin))
+    RaycastResult RayTracer::raycast(const Ray& ray) const {
+        Hit hit;
+
+        if (!intersect(ray, hit))
         {
             return RaycastResult();
         }
 
-        if (!node.left && !node.right)
+        const RTTriangle* tri = &(*m_triangles)[hit.triIdx];
+        return RaycastResult(tri, hit.t, hit.u, hit.v, ray.at(hit.t), ray.orig, ray.dir);
+    }
+
+    SurfaceInteraction RayTracer::evaluateSurface(const Hit& hit) const {
+        SurfaceInteraction si;
+
+        if (!hit.valid())
         {
-            return intersectTriangles(orig, dir, node.startPrim, node.endPrim, tMin);
+            return si;
         }
 
-        RaycastResult leftResult = intersectNode(orig, dir, iDir, *node.left, tMin);
-        RaycastResult rightResult = intersectNode(orig, dir, iDir, *node.right, tMin);
+        const RTTriangle& tri = (*m_triangles)[hit.triIdx];
+        float w = 1.f - hit.u - hit.v;
+
+        si.tri = &tri;
+        si.material = tri.m_material;
+
+        // interpolating the vertices is more precise than orig + t * dir far from the origin
+        si.position = w * tri.m_vertices[0].p + hit.u * tri.m_vertices[1].p + hit.v * tri.m_vertices[2].p;
+        si.geometricNormal = tri.normal();
+        si.normal = (w * tri.m_vertices[0].n + hit.u * tri.m_vertices[1].n + hit.v * tri.m_vertices[2].n).normalized();
+        si.uv = w * tri.m_vertices[0].t + hit.u * tri.m_vertices[1].t + hit.v * tri.m_vertices[2].t;
+
+        return si;
+    }
+
+    TraceStats RayTracer::getStats() const
+    {
+        TraceStats stats;
+        stats.rays = m_statRays;
+        stats.nodes = m_statNodes;
+        stats.triangles = m_statTriangles;
+        return stats;
+    }
+
+    void RayTracer::resetStats()
+    {
+        m_statRays = 0;
+        m_statNodes = 0;
+        m_statTriangles = 0;
+    }
+
+
+    // --------------------------------------------------------------------------
+    // Traversal queries. A query tells the kernel how far the ray currently reaches (tMax) and gets
+    // every accepted hit through report(), which returns true when traversal can stop.
+
+    namespace
+    {
+        struct ClosestHitQuery
+        {
+            Hit hit;
 
-        if (!leftResult.tri && !rightResult.tri)
+            float tMax() const { return hit.t; }
+
+            bool report(int triIdx, float t, float u, float v)
+            {
+                hit.triIdx = triIdx;
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                return false;
+            }
+        };
+
+        struct AnyHitQuery
         {
-            return RaycastResult();
+            float rayTMax;
+            bool hit;
+
+            float tMax() const { return rayTMax; }
+
+            bool report(int, float, float, float)
+            {
+                hit = true;
+                return true;
+            }
+        };
+
+        struct CountHitsQuery
+        {
+            float rayTMax;
+            int count;
+
+            float tMax() const { return rayTMax; }
+
+            bool report(int, float, float, float)
+            {
+                ++count;
+                return false;
+            }
+        };
+
+        struct FilteredHitQuery : ClosestHitQuery
+        {
+            HitFilterFunc filter;
+            void* userData;
+
+            bool report(int triIdx, float t, float u, float v)
+            {
+                Hit candidate;
+                candidate.triIdx = triIdx;
+                candidate.t = t;
+                candidate.u = u;
+                candidate.v = v;
+
+                if (filter(userData, candidate))
+                {
+                    hit = candidate;
+                }
+
+                return false;
+            }
+        };
+
+        template <unsigned Features>
+        inline float initialTMax(const Ray& ray)
+        {
+            return (Features & TraceFeature_MaxDistance) ? ray.tMax : std::numeric_limits<float>::max();
         }
+    }
+
+    template <unsigned Features>
+    bool RayTracer::intersect(const Ray& ray, Hit& hit) const
+    {
+        ClosestHitQuery query;
+        query.hit.t = initialTMax<Features>(ray);
+
+        dispatch<Features>(ray, query);
+
+        hit = query.hit;
+        return hit.valid();
+    }
 
-        return leftResult.t < rightResult.t ? leftResult : rightResult;
+    template <unsigned Features>
+    bool RayTracer::occluded(const Ray& ray) const
+    {
+        AnyHitQuery query;
+        query.rayTMax = initialTMax<Features>(ray);
+        query.hit = false;
+
+        dispatch<Features>(ray, query);
+
+        return query.hit;
     }
 
-    bool RayTracer::isIntersectedWithBB(const Vec3f& orig, const Vec3f& iDir, const AABB& bb, float& tMin) const
+    template <unsigned Features>
+    int RayTracer::countHits(const Ray& ray) const
     {
-        Vec3f t1 = (bb.min - orig) * iDir;
-        Vec3f t2 = (bb.max - orig) * iDir;
+        CountHitsQuery query;
+        query.rayTMax = initialTMax<Features>(ray);
+        query.count = 0;
+
+        dispatch<Features>(ray, query);
 
-        float start = FW::min(t1, t2).max();
-        float end = FW::max(t1, t2).min();
+        return query.count;
+    }
+
+    template <unsigned Features>
+    bool RayTracer::intersectFiltered(const Ray& ray, Hit& hit, HitFilterFunc filter, void* userData) const
+    {
+        FilteredHitQuery query;
+        query.hit.t = initialTMax<Features>(ray);
+        query.filter = filter;
+        query.userData = userData;
 
-        if (start > end || end < 0 || start > tMin)
+        dispatch<Features>(ray, query);
+
+        hit = query.hit;
+        return hit.valid();
+    }
+
+    // The intersection mode is a runtime setting; branch on it once per ray rather than once per triangle.
+    template <unsigned Features, class Query>
+    void RayTracer::dispatch(const Ray& ray, Query& query) const
+    {
+        ++m_rayCount;
+
+        if (m_intersectMode == IntersectMode_Watertight)
         {
-            return false;
+            traverse<Features, true>(ray, query);
+        }
+        else
+        {
+            traverse<Features, false>(ray, query);
         }
-
-        return true;
     }
 
-    RaycastResult RayTracer::intersectTriangles(const Vec3f& orig, const Vec3f& dir, const size_t startPrim,
-        const size_t endPrim, float& tMin) const
+    template <unsigned Features, bool Watertight, class Query>
+    void RayTracer::traverse(const Ray& ray, Query& query) const
     {
-        float tmin = 1.0f, umin = 0.0f, vmin = 0.0f;
-        int imin = -1;
+        // the shear constants are set up once here and reused for every triangle the ray meets
+        WatertightRay wtRay;
+        if (Watertight)
+        {
+            wtRay = WatertightRay(ray.orig, ray.dir);
+        }
+
+        U64 numNodes = 0, numTriangles = 0;
+
+        // Deeper trees than the fixed stack holds, e.g. SAH trees over many coincident triangles, spill the
+        // rest into the vector; it allocates nothing unless that happens.
+        const int MaxStackSize = 128;
+        const BvhNode* stack[MaxStackSize];
+        int stackSize = 0;
+        std::vector<const BvhNode*> overflow;
+        const BvhNode* node = &m_bvh.root();
 
-        for (size_t i = startPrim; i <= endPrim; ++i)
+        float tNear;
+        if (!isIntersectedWithBB(ray, node->bb, query.tMax(), tNear))
         {
-            float t, u, v;
+            node = nullptr;
+        }
+
+        while (node)
+        {
+            if (Features & TraceFeature_Stats)
+            {
+                ++numNodes;
+            }
+
+            if (node->hasChildren())
+            {
+                // Descend into the nearer child first; push the farther one if the ray reaches it at all.
+                float tLeft, tRight;
+                bool hitLeft = isIntersectedWithBB(ray, node->left->bb, query.tMax(), tLeft);
+                bool hitRight = isIntersectedWithBB(ray, node->right->bb, query.tMax(), tRight);
 
-            if ((*m_triangles)[m_bvh.getIndex(i)].intersect_woop(orig, dir, t, u, v))
+                if (hitLeft && hitRight)
+                {
+                    bool leftFirst = tLeft <= tRight;
+                    const BvhNode* farther = leftFirst ? node->right.get() : node->left.get();
+                    if (stackSize < MaxStackSize)
+                        stack[stackSize++] = farther;
+                    else
+                        overflow.push_back(farther);
+                    node = leftFirst ? node->left.get() : node->right.get();
+                    continue;
+                }
+
+                if (hitLeft || hitRight)
+                {
+                    node = hitLeft ? node->left.get() : node->right.get();
+                    continue;
+                }
+            }
+            else
             {
-                if (t > 0.0f && t < tmin)
+                for (size_t i = node->startPrim; i <= node->endPrim; ++i)
                 {
-                    imin = i;
-                    tmin = t;
-                    umin = u;
-                    vmin = v;
+                    uint32_t triIdx = m_bvh.getIndex(uint32_t(i));
+                    const RTTriangle& tri = (*m_triangles)[triIdx];
+
+                    if (Features & TraceFeature_Stats)
+                    {
+                        ++numTriangles;
+                    }
+
+                    // The third row of the Woop matrix is the scaled plane normal of the triangle.
+                    if ((Features & TraceFeature_CullBackfaces) &&
+                        tri.m_data.M(2, 0) * ray.dir.x + tri.m_data.M(2, 1) * ray.dir.y + tri.m_data.M(2, 2) * ray.dir.z > 0.f)
+                    {
+                        continue;
+                    }
+
+                    float t, u, v;
+                    bool hit = Watertight
+                        ? tri.intersect_watertight(wtRay, t, u, v)
+                        : tri.intersect_woop(ray.orig, ray.dir, t, u, v);
+
+                    if (!hit || t <= ray.tMin || t >= query.tMax())
+                    {
+                        continue;
+                    }
+
+                    if ((Features & TraceFeature_AlphaTest) && m_alphaTest && !(m_alphaOpaque && m_alphaOpaque[triIdx]) &&
+                        !m_alphaTest(m_alphaTestData, int(triIdx), u, v))
+                    {
+                        continue;
+                    }
+
+                    if (query.report(int(triIdx), t, u, v))
+                    {
+                        stackSize = 0;
+                        overflow.clear();
+                        break;
+                    }
+                }
+            }
+
+            // Pop the next node, skipping the ones that a closer hit has made unreachable.
+            node = nullptr;
+
+            while (stackSize > 0 || !overflow.empty())
+            {
+                // the overflow holds the most recently pushed nodes
+                const BvhNode* candidate;
+                if (!overflow.empty())
+                {
+                    candidate = overflow.back();
+                    overflow.pop_back();
+                }
+                else
+                    candidate = stack[--stackSize];
+
+                if (isIntersectedWithBB(ray, candidate->bb, query.tMax(), tNear))
+                {
+                    node = candidate;
+                    break;
                 }
             }
         }
 
-        if (imin != -1)
+        if (Features & TraceFeature_Stats)
         {
-            tMin = tmin;
-            return RaycastResult(&(*m_triangles)[m_bvh.getIndex(imin)], tmin, umin, vmin, orig + tmin * dir, orig, dir);
+            ++m_statRays;
+            m_statNodes += numNodes;
+            m_statTriangles += numTriangles;
         }
+    }
 
-        return RaycastResult();
+    bool RayTracer::isIntersectedWithBB(const Ray& ray, const AABB& bb, float tMax, float& tNear)
+    {
+        // The direction signs tell which slab plane is hit first, so no per-axis min/max is needed.
+        float txNear = (bb[ray.dirIsNeg[0]].x - ray.orig.x) * ray.iDir.x;
+        float txFar = (bb[1 - ray.dirIsNeg[0]].x - ray.orig.x) * ray.iDir.x;
+        float tyNear = (bb[ray.dirIsNeg[1]].y - ray.orig.y) * ray.iDir.y;
+        float tyFar = (bb[1 - ray.dirIsNeg[1]].y - ray.orig.y) * ray.iDir.y;
+        float tzNear = (bb[ray.dirIsNeg[2]].z - ray.orig.z) * ray.iDir.z;
+        float tzFar = (bb[1 - ray.dirIsNeg[2]].z - ray.orig.z) * ray.iDir.z;
+
+        tNear = FW::max(txNear, tyNear, tzNear, ray.tMin);
+        float tFar = FW::min(txFar, tyFar, tzFar, tMax);
+
+        return tNear <= tFar;
     }
 
+
+    // --------------------------------------------------------------------------
+    // Kernels compiled for the application. Each feature set yields a Woop and a watertight variant.
+
+#define INSTANTIATE_TRACE_KERNELS(FEATURES) \
+    template bool RayTracer::intersect<FEATURES>(const Ray&, Hit&) const; \
+    template bool RayTracer::occluded<FEATURES>(const Ray&) const; \
+    template int RayTracer::countHits<FEATURES>(const Ray&) const; \
+    template bool RayTracer::intersectFiltered<FEATURES>(const Ray&, Hit&, HitFilterFunc, void*) const;
+
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_None)
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_MaxDistance)
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_MaxDistance | TraceFeature_Stats)
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_MaxDistance | TraceFeature_CullBackfaces)
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_MaxDistance | TraceFeature_AlphaTest)
+    INSTANTIATE_TRACE_KERNELS(TraceFeature_MaxDistance | TraceFeature_AlphaTest | TraceFeature_Stats)
+
+#undef INSTANTIATE_TRACE_KERNELS
+
 } // namespace FW
\ No newline at end of file
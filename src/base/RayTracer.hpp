@@ -3,6 +3,8 @@
 
 #include "RTTriangle.hpp"
 #include "RaycastResult.hpp"
+#include "Ray.hpp"
+#include "Hit.hpp"
 #include "rtlib.hpp"
 #include "Bvh.hpp"
 
@@ -21,6 +23,36 @@ namespace FW
     Vec2f getTexelCoords(Vec2f uv, const Vec2i size);
 
 
+    // Optional traversal features. They are combined into a bitmask template argument of the RayTracer
+    // queries, so every kernel is compiled with only the checks its call site asked for.
+    enum TraceFeature
+    {
+        TraceFeature_None = 0,
+        TraceFeature_MaxDistance = 1 << 0,      // clip hits to ray.tMax; without it the ray is unbounded
+        TraceFeature_AlphaTest = 1 << 1,        // let the alpha test callback discard hits
+        TraceFeature_CullBackfaces = 1 << 2,    // ignore triangles whose normal faces along the ray
+        TraceFeature_Stats = 1 << 3,            // count visited nodes and tested triangles
+
+        TraceFeature_Default = TraceFeature_MaxDistance
+    };
+
+    // Traversal counters gathered by the kernels compiled with TraceFeature_Stats.
+    struct TraceStats
+    {
+        U64 rays;
+        U64 nodes;
+        U64 triangles;
+
+        TraceStats() : rays(0), nodes(0), triangles(0) {}
+    };
+
+    // Alpha test callback: returns false if the hit at barycentrics (u, v) of the triangle should be ignored.
+    typedef bool (*AlphaTestFunc)(const void* userData, int triIdx, float u, float v);
+
+    // Filter callback of intersectFiltered(): returns false to skip a candidate hit.
+    typedef bool (*HitFilterFunc)(void* userData, const Hit& candidate);
+
+
     // Main class for tracing rays using BVHs.
     class RayTracer
     {
@@ -28,11 +60,29 @@ namespace FW
         RayTracer(void);
         ~RayTracer(void);
 
-        void constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode);
+        void constructHierarchy(std::vector<RTTriangle>& triangles, SplitMode splitMode,
+            const BvhBuildParams& params = BvhBuildParams());
 
         void saveHierarchy(const char* filename, const std::vector<RTTriangle>& triangles);
         void loadHierarchy(const char* filename, std::vector<RTTriangle>& triangles);
 
+        // Closest hit along the ray within [ray.tMin, ray.tMax]. This is the hot path; it only records
+        // the triangle, distance and barycentrics. Use evaluateSurface() for the hits that need shading.
+        bool intersect(const Ray& ray, Hit& hit) const { return intersect<TraceFeature_Default>(ray, hit); }
+        SurfaceInteraction evaluateSurface(const Hit& hit) const;
+
+        // Specialized kernels. The feature combinations in use are instantiated in RayTracer.cpp;
+        // add a line there when a call site needs a new one.
+        template <unsigned Features> bool intersect(const Ray& ray, Hit& hit) const;     // closest hit
+        template <unsigned Features> bool occluded(const Ray& ray) const;                // any hit, stops at the first
+        template <unsigned Features> int countHits(const Ray& ray) const;                // all hits along the ray
+        template <unsigned Features> bool intersectFiltered(const Ray& ray, Hit& hit,    // closest hit the filter accepts
+            HitFilterFunc filter, void* userData) const;
+
+        // Closest hit as a full RaycastResult; t of the result is a distance.
+        RaycastResult raycast(const Ray& ray) const;
+
+        // Legacy segment interface: dir spans the tested segment and t is a fraction of it.
         RaycastResult raycast(const Vec3f& orig, const Vec3f& dir) const;
 
         // This function computes an MD5 checksum of the input scene data,
@@ -41,19 +91,40 @@ namespace FW
 
         std::vector<RTTriangle>* m_triangles;
 
+        const Bvh& getBvh() const { return m_bvh; }
+
         void resetRayCounter() { m_rayCount = 0; }
         int getRayCount() { return m_rayCount; }
 
+        TraceStats getStats() const;
+        void resetStats();
+
+        void setIntersectMode(IntersectMode mode) { m_intersectMode = mode; }
+        IntersectMode getIntersectMode() const { return m_intersectMode; }
+
+        // opaqueFlags (optional, one per triangle) marks triangles for which the callback is skipped.
+        void setAlphaTest(AlphaTestFunc func, const void* userData, const U8* opaqueFlags = nullptr)
+        {
+            m_alphaTest = func;
+            m_alphaTestData = userData;
+            m_alphaOpaque = opaqueFlags;
+        }
+
     private:
         mutable std::atomic<int> m_rayCount;
+        mutable std::atomic<U64> m_statRays, m_statNodes, m_statTriangles;
         Bvh m_bvh;
+        IntersectMode m_intersectMode;
+        AlphaTestFunc m_alphaTest;
+        const void* m_alphaTestData;
+        const U8* m_alphaOpaque;
 
-        RaycastResult intersectNode(const Vec3f& orig, const Vec3f& dir, const Vec3f& iDir, const BvhNode& node,
-            float& tMin) const;
+        template <unsigned Features, class Query>
+        void dispatch(const Ray& ray, Query& query) const;
 
-        bool isIntersectedWithBB(const Vec3f& orig, const Vec3f& iDir, const AABB& bb, float& tMin) const;
+        template <unsigned Features, bool Watertight, class Query>
+        void traverse(const Ray& ray, Query& query) const;
 
-        RaycastResult intersectTriangles(const Vec3f& orig, const Vec3f& dir, const size_t startPrim,
-            const size_t endPrim, float& tMin) const;
+        static bool isIntersectedWithBB(const Ray& ray, const AABB& bb, float tMax, float& tNear);
     };
 } // namespace FW
@@ -10,7 +10,8 @@
 
 namespace FW
 {
-    // Result information of a raycast.
+    // Result information of a raycast. Kept for the reference library interface; the ray tracer itself
+    // works with the leaner Hit and derives shading data on demand with RayTracer::evaluateSurface().
     struct RaycastResult {
         const RTTriangle* tri; // The triangle that was hit.
         float t;               // Hit position is orig + t * dir.
@@ -0,0 +1,284 @@
+#include "RowColumnSampling.hpp"
+
+#include "base/Timer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace FW
+{
+    namespace
+    {
+        float luminance(const Vec3f& c)
+        {
+            return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+        }
+    }
+
+    void RowColumnSampling::shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight,
+        const std::vector<Vpl>& vpls, std::vector<Vec3f>& image)
+    {
+        // Fixed seed so that the rows and the representatives are the same on every frame.
+        Random rand(1234);
+        Timer timer(true);
+
+        sampleRows(gbuffer, rand);
+        computeRows(rt, gbuffer, vpls);
+        m_stats.rowTime = timer.end();
+
+        clusterColumns(rand);
+        m_stats.clusterTime = timer.end();
+
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int i = 0; i < gbuffer.getNumPixels(); ++i)
+        {
+            const GBufferSample& s = gbuffer[i];
+
+            if (!s.valid)
+            {
+                continue;
+            }
+
+            Vec3f irradiance(0.f);
+
+            Vec3f direct = evalVpl(mainLight, s.position, s.normal);
+            if (direct.max() > 0.f && isVisible(rt, s, mainLight.position))
+            {
+                irradiance += direct;
+            }
+
+            for (const Representative& rep : m_representatives)
+            {
+                const Vpl& vpl = vpls[rep.vpl];
+                Vec3f contribution = evalVpl(vpl, s.position, s.normal);
+
+                if (contribution.max() > 0.f && isVisible(rt, s, vpl.position))
+                {
+                    irradiance += contribution * rep.scale;
+                }
+            }
+
+            image[i] = s.albedo * irradiance;
+        }
+
+        m_stats.shadeTime = timer.end();
+        m_stats.numRows = int(m_rows.size());
+        m_stats.numClusters = int(m_representatives.size());
+    }
+
+    void RowColumnSampling::sampleRows(const GBuffer& gbuffer, Random& rand)
+    {
+        m_rows.clear();
+
+        // Stratify the rows over a grid of tiles, one random covered pixel per tile.
+        const Vec2i& size = gbuffer.getSize();
+        int tilesX = FW::max(1, int(FW::sqrt(float(m_numRows) * size.x / FW::max(1, size.y))));
+        int tilesY = FW::max(1, (m_numRows + tilesX - 1) / tilesX);
+
+        for (int ty = 0; ty < tilesY; ++ty)
+        {
+            for (int tx = 0; tx < tilesX; ++tx)
+            {
+                Vec2i lo(tx * size.x / tilesX, ty * size.y / tilesY);
+                Vec2i hi((tx + 1) * size.x / tilesX, (ty + 1) * size.y / tilesY);
+
+                if (hi.x <= lo.x || hi.y <= lo.y)
+                {
+                    continue;
+                }
+
+                // a few tries to land on geometry; tiles that only see background get no row
+                for (int attempt = 0; attempt < 8; ++attempt)
+                {
+                    int x = lo.x + int(rand.getU32(U32(hi.x - lo.x)));
+                    int y = lo.y + int(rand.getU32(U32(hi.y - lo.y)));
+
+                    if (gbuffer.get(x, y).valid)
+                    {
+                        m_rows.push_back(x + y * size.x);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    void RowColumnSampling::computeRows(const RayTracer& rt, const GBuffer& gbuffer, const std::vector<Vpl>& vpls)
+    {
+        int numRows = int(m_rows.size());
+        int numColumns = int(vpls.size());
+
+        m_matrix.assign(size_t(numRows) * numColumns, 0.f);
+        m_columnNorms.assign(numColumns, 0.f);
+
+#pragma omp parallel for schedule(dynamic, 16)
+        for (int j = 0; j < numColumns; ++j)
+        {
+            float* col = &m_matrix[size_t(j) * numRows];
+            double normSqr = 0.0;
+
+            for (int r = 0; r < numRows; ++r)
+            {
+                const GBufferSample& s = gbuffer[m_rows[r]];
+                float value = luminance(s.albedo * evalVpl(vpls[j], s.position, s.normal));
+
+                if (value > 0.f && isVisible(rt, s, vpls[j].position))
+                {
+                    col[r] = value;
+                    normSqr += double(value) * value;
+                }
+            }
+
+            m_columnNorms[j] = float(std::sqrt(normSqr));
+        }
+    }
+
+    float RowColumnSampling::clusterCost(const std::vector<int>& columns) const
+    {
+        // Sum over all pairs of norm_i * norm_j * |x_i - x_j|^2 with x the normalized columns.
+        // Since the x are unit vectors this collapses to 2 * (sum of norms)^2 - 2 * |sum of columns|^2.
+        int numRows = int(m_rows.size());
+        std::vector<double> sum(numRows, 0.0);
+        double normSum = 0.0;
+
+        for (int j : columns)
+        {
+            const float* col = column(j);
+            for (int r = 0; r < numRows; ++r)
+            {
+                sum[r] += col[r];
+            }
+            normSum += m_columnNorms[j];
+        }
+
+        double sumSqr = 0.0;
+        for (double v : sum)
+        {
+            sumSqr += v * v;
+        }
+
+        return float(FW::max(0.0, 2.0 * (normSum * normSum - sumSqr)));
+    }
+
+    void RowColumnSampling::clusterColumns(Random& rand)
+    {
+        m_representatives.clear();
+
+        int numRows = int(m_rows.size());
+
+        // Columns that are zero in every row carry no information; they're dropped, as in the paper.
+        Cluster all;
+        for (int j = 0; j < int(m_columnNorms.size()); ++j)
+        {
+            if (m_columnNorms[j] > 0.f)
+            {
+                all.columns.push_back(j);
+            }
+        }
+
+        if (all.columns.empty())
+        {
+            return;
+        }
+
+        all.cost = clusterCost(all.columns);
+
+        std::vector<Cluster> clusters;
+        clusters.push_back(std::move(all));
+
+        // Top-down: keep splitting the most expensive cluster along a random projection of its
+        // normalized columns, at the norm-weighted median.
+        std::vector<float> line(numRows);
+
+        while (int(clusters.size()) < m_numClusters)
+        {
+            int worst = 0;
+            for (int c = 1; c < int(clusters.size()); ++c)
+            {
+                if (clusters[c].cost > clusters[worst].cost)
+                {
+                    worst = c;
+                }
+            }
+
+            if (clusters[worst].cost <= 0.f || clusters[worst].columns.size() < 2)
+            {
+                break;
+            }
+
+            for (float& v : line)
+            {
+                v = rand.getF32(-1.f, 1.f);
+            }
+
+            std::vector<std::pair<float, int>> projected;
+            float normSum = 0.f;
+
+            for (int j : clusters[worst].columns)
+            {
+                const float* col = column(j);
+                float dot = 0.f;
+
+                for (int r = 0; r < numRows; ++r)
+                {
+                    dot += col[r] * line[r];
+                }
+
+                projected.push_back(std::make_pair(dot / m_columnNorms[j], j));
+                normSum += m_columnNorms[j];
+            }
+
+            std::sort(projected.begin(), projected.end());
+
+            Cluster left, right;
+            float accumulated = 0.f;
+
+            for (size_t i = 0; i < projected.size(); ++i)
+            {
+                int j = projected[i].second;
+                bool toLeft = i == 0 || (i + 1 < projected.size() && accumulated < 0.5f * normSum);
+
+                (toLeft ? left : right).columns.push_back(j);
+                accumulated += m_columnNorms[j];
+            }
+
+            left.cost = clusterCost(left.columns);
+            right.cost = clusterCost(right.columns);
+
+            clusters[worst] = std::move(left);
+            clusters.push_back(std::move(right));
+        }
+
+        // One representative per cluster, picked with probability norm_j / sum of norms and scaled by the
+        // inverse of that probability, so that the cluster total is estimated without bias.
+        for (const Cluster& cluster : clusters)
+        {
+            float normSum = 0.f;
+            for (int j : cluster.columns)
+            {
+                normSum += m_columnNorms[j];
+            }
+
+            float target = rand.getF32() * normSum;
+            int chosen = cluster.columns.back();
+
+            for (int j : cluster.columns)
+            {
+                target -= m_columnNorms[j];
+                if (target <= 0.f)
+                {
+                    chosen = j;
+                    break;
+                }
+            }
+
+            Representative rep;
+            rep.vpl = chosen;
+            rep.scale = normSum / m_columnNorms[chosen];
+            m_representatives.push_back(rep);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+
+#include "ManyLights.hpp"
+
+#include "base/Random.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Matrix row-column sampling: the image is a pixels x VPLs matrix of contributions. A few sampled
+    // pixels (rows) are shaded against every VPL with ray traced visibility; the VPLs (columns) are then
+    // clustered by their reduced contribution vectors, and every pixel is shaded with one representative
+    // per cluster. The per-pixel cost depends on the number of clusters only, not on the number of VPLs.
+    class RowColumnSampling
+    {
+    public:
+        struct Stats
+        {
+            int numRows;
+            int numClusters;
+            float rowTime;          // seconds spent in the full rows
+            float clusterTime;
+            float shadeTime;
+        };
+
+        RowColumnSampling() :
+            m_numRows(256),
+            m_numClusters(256)
+        {}
+
+        void setNumRows(int n) { m_numRows = n; }
+        void setNumClusters(int n) { m_numClusters = n; }
+
+        // Shades the G-buffer with the main light (exactly) and the VPLs (through the cluster representatives).
+        void shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight,
+            const std::vector<Vpl>& vpls, std::vector<Vec3f>& image);
+
+        const Stats& getStats() const { return m_stats; }
+
+    private:
+        // A VPL standing in for its cluster; its contribution is scaled by the cluster norm over its own.
+        struct Representative
+        {
+            int vpl;
+            float scale;
+        };
+
+        struct Cluster
+        {
+            std::vector<int> columns;
+            float cost;
+        };
+
+        void sampleRows(const GBuffer& gbuffer, Random& rand);
+        void computeRows(const RayTracer& rt, const GBuffer& gbuffer, const std::vector<Vpl>& vpls);
+        void clusterColumns(Random& rand);
+        float clusterCost(const std::vector<int>& columns) const;
+        const float* column(int vpl) const { return &m_matrix[size_t(vpl) * m_rows.size()]; }
+
+        int m_numRows;
+        int m_numClusters;
+
+        std::vector<int> m_rows;                // pixel indices of the sampled rows
+        std::vector<float> m_matrix;            // reduced matrix, one column of m_rows.size() values per VPL
+        std::vector<float> m_columnNorms;
+        std::vector<Representative> m_representatives;
+        Stats m_stats;
+    };
+}
@@ -0,0 +1,219 @@
+#include "Sampler.hpp"
+
+#include "base/Random.hpp"
+
+#include <algorithm>
+
+
+namespace FW
+{
+    namespace
+    {
+        // Direction numbers of the first two Sobol dimensions: the van der Corput sequence,
+        // and the one from the primitive polynomial x + 1.
+        struct SobolMatrices
+        {
+            U32 v[2][32];
+
+            SobolMatrices()
+            {
+                for (int i = 0; i < 32; ++i)
+                {
+                    v[0][i] = 1u << (31 - i);
+                    v[1][i] = i == 0 ? 1u << 31 : v[1][i - 1] ^ (v[1][i - 1] >> 1);
+                }
+            }
+        };
+
+        const SobolMatrices& getSobolMatrices()
+        {
+            static const SobolMatrices matrices;
+            return matrices;
+        }
+
+        // Largest float below one; keeps the fixed point conversions in [0, 1).
+        const float OneMinusEpsilon = 0.99999994f;
+
+        float fixedPointToFloat(U32 bits)
+        {
+            return FW::min(float(bits) * (1.f / 4294967296.f), OneMinusEpsilon);
+        }
+
+        void randomPermutation(U32 base, Random& rand, std::vector<U16>& permutation)
+        {
+            permutation.resize(base);
+            for (U32 i = 0; i < base; ++i)
+            {
+                permutation[i] = U16(i);
+            }
+
+            for (U32 i = base - 1; i > 0; --i)
+            {
+                std::swap(permutation[i], permutation[rand.getU32(i + 1)]);
+            }
+        }
+    }
+
+    const char* getSamplerName(SamplerType type)
+    {
+        switch (type)
+        {
+        case SamplerType_Halton:    return "Halton";
+        case SamplerType_Sobol:     return "Sobol";
+        default:                    return "random";
+        }
+    }
+
+    U32 sobolBits(U32 index, int dimension)
+    {
+        const U32* v = getSobolMatrices().v[dimension];
+        U32 bits = 0;
+
+        // XOR of the direction numbers of the set index bits; masked instead of branched.
+        for (int b = 0; b < 32; ++b)
+        {
+            bits ^= v[b] & (0u - ((index >> b) & 1u));
+        }
+
+        return bits;
+    }
+
+    void generateSobolBatch(int num, U32 scramble0, U32 scramble1, std::vector<Vec2f>& samples)
+    {
+        const SobolMatrices& m = getSobolMatrices();
+        samples.resize(num);
+
+        // The loop over the index bits is the outer one, so the inner loop over the points is the masked XOR
+        // of sobolBits() with the same direction number for every point and no state carried between points,
+        // which the compiler vectorizes. Only the bits some index below num has set are visited.
+        std::vector<U32> bits0(num, scramble0), bits1(num, scramble1);
+        for (int b = 0; b < 32 && (U32(FW::max(num - 1, 0)) >> b) != 0; ++b)
+        {
+            U32 v0 = m.v[0][b], v1 = m.v[1][b];
+            for (int i = 0; i < num; ++i)
+            {
+                U32 mask = 0u - ((U32(i) >> b) & 1u);
+                bits0[i] ^= v0 & mask;
+                bits1[i] ^= v1 & mask;
+            }
+        }
+
+        for (int i = 0; i < num; ++i)
+        {
+            samples[i] = Vec2f(fixedPointToFloat(bits0[i]), fixedPointToFloat(bits1[i]));
+        }
+    }
+
+    float scrambledRadicalInverse(U32 index, U32 base, const std::vector<U16>& permutation)
+    {
+        double invBase = 1.0 / base;
+        double invBaseN = 1.0;
+        U64 reversed = 0;
+
+        while (index)
+        {
+            U32 next = index / base;
+            U32 digit = index - next * base;
+            reversed = reversed * base + permutation[digit];
+            invBaseN *= invBase;
+            index = next;
+        }
+
+        // The leading zero digits are permuted too; their sum is a geometric series.
+        double value = invBaseN * (reversed + invBase * permutation[0] / (1.0 - invBase));
+        return FW::min(float(value), OneMinusEpsilon);
+    }
+
+    void generateSamples2D(SamplerType type, int num, U32 seed, std::vector<Vec2f>& samples)
+    {
+        samples.resize(num);
+        Random rand(seed);
+
+        switch (type)
+        {
+        case SamplerType_Sobol:
+        {
+            U32 scramble0 = rand.getU32();
+            U32 scramble1 = rand.getU32();
+            generateSobolBatch(num, scramble0, scramble1, samples);
+            break;
+        }
+
+        case SamplerType_Halton:
+        {
+            std::vector<U16> permutation2, permutation3;
+            randomPermutation(2, rand, permutation2);
+            randomPermutation(3, rand, permutation3);
+
+            // Index 0 is the same permuted-zero point in both bases; start from 1.
+            for (int i = 0; i < num; ++i)
+            {
+                samples[i] = Vec2f(scrambledRadicalInverse(U32(i + 1), 2, permutation2), scrambledRadicalInverse(U32(i + 1), 3, permutation3));
+            }
+            break;
+        }
+
+        default:
+            for (int i = 0; i < num; ++i)
+            {
+                samples[i].x = rand.getF32();
+                samples[i].y = rand.getF32();
+            }
+            break;
+        }
+    }
+
+    Vec2f concentricSampleDisk(const Vec2f& u)
+    {
+        Vec2f offset = 2.f * u - Vec2f(1.f);
+
+        if (offset.x == 0.f && offset.y == 0.f)
+        {
+            return Vec2f(0.f);
+        }
+
+        float r, theta;
+
+        if (FW::abs(offset.x) > FW::abs(offset.y))
+        {
+            r = offset.x;
+            theta = 0.25f * FW_PI * (offset.y / offset.x);
+        }
+        else
+        {
+            r = offset.y;
+            theta = 0.5f * FW_PI - 0.25f * FW_PI * (offset.x / offset.y);
+        }
+
+        return r * Vec2f(FW::cos(theta), FW::sin(theta));
+    }
+
+    void generateDiskSamples(SamplerType type, int num, U32 seed, std::vector<Vec2f>& samples)
+    {
+        if (type == SamplerType_Random)
+        {
+            // The sampler castIndirect originally used: rejection from the enclosing square.
+            Random rand(seed);
+            samples.resize(num);
+
+            for (int i = 0; i < num; ++i)
+            {
+                Vec2f p;
+                do {
+                    p.x = rand.getF32(-1.f, 1.f);
+                    p.y = rand.getF32(-1.f, 1.f);
+                } while (p.x * p.x + p.y * p.y > 1.f);
+
+                samples[i] = p;
+            }
+            return;
+        }
+
+        generateSamples2D(type, num, seed, samples);
+
+        for (Vec2f& p : samples)
+        {
+            p = concentricSampleDisk(p);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+
+#include "base/Math.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    enum SamplerType
+    {
+        SamplerType_Random = 0,     // independent uniform random numbers, with rejection where a disk is needed
+        SamplerType_Halton,         // bases 2 and 3, with random digit permutations
+        SamplerType_Sobol,          // first two Sobol dimensions, with random digit (XOR) scrambling
+    };
+
+    const char* getSamplerName(SamplerType type);
+
+    // Fills samples with num points in [0, 1)^2. The scrambling (and for SamplerType_Random the sequence)
+    // is derived from the seed, so a seed always gives the same point set. The low-discrepancy points are
+    // computed independently of each other in branch-free loops, so the batch vectorizes (see generateSobolBatch()).
+    void generateSamples2D(SamplerType type, int num, U32 seed, std::vector<Vec2f>& samples);
+
+    // Uniform square to uniform unit disk mapping that preserves the stratification of the input
+    // (Shirley & Chiu's concentric map). Unlike rejection, every input point is used.
+    Vec2f concentricSampleDisk(const Vec2f& u);
+
+    // Uniform points in the unit disk: concentric mapping of the low-discrepancy sets, and the original
+    // rejection sampling for SamplerType_Random.
+    void generateDiskSamples(SamplerType type, int num, U32 seed, std::vector<Vec2f>& samples);
+
+    // The building blocks, exposed for other samplers.
+    U32 sobolBits(U32 index, int dimension);    // dimension 0 or 1; unscrambled, as a 0.32 fixed point number
+
+    // Scrambled points 0..num-1 of the first two Sobol dimensions, in the natural order: one pass per index bit
+    // below num, each a masked XOR of that bit's direction number into every point, without state carried from
+    // one point to the next, so the passes vectorize.
+    void generateSobolBatch(int num, U32 scramble0, U32 scramble1, std::vector<Vec2f>& samples);
+    float scrambledRadicalInverse(U32 index, U32 base, const std::vector<U16>& permutation);
+}
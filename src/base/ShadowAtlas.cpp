@@ -0,0 +1,249 @@
+#include "ShadowAtlas.hpp"
+#include "ShadowRasterizer.hpp"
+
+#include "gpu/GLContext.hpp"
+
+#include <algorithm>
+
+
+namespace FW
+{
+    void ShadowAtlas::layout(const std::vector<int>& sizes, std::vector<int>& changed)
+    {
+        changed.clear();
+
+        GLint maxSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+
+        // Square pages about as large as all the cells together, but no larger than the texture size limit.
+        // Pages only grow; a new page size starts the layout over.
+        int largest = 0;
+        S64 total = 0;
+        for (int size : sizes)
+        {
+            largest = FW::max(largest, size);
+            total += S64(size) * size;
+        }
+
+        int pageSize = FW::max(largest, 1);
+        while (pageSize < maxSize && S64(pageSize) * pageSize < total)
+        {
+            pageSize *= 2;
+        }
+        pageSize = FW::min(pageSize, int(maxSize));
+
+        if (pageSize > m_pageSize)
+        {
+            free();
+            m_pageSize = pageSize;
+            m_freeBlocks.resize(getLevel(1) + 1);
+        }
+
+        for (int slot = (int)sizes.size(); slot < (int)m_cells.size(); ++slot)
+        {
+            release(slot);
+        }
+        m_cells.resize(sizes.size());
+
+        // Release every cell that changes before placing any, and place the largest first, so that the
+        // small cells fill the gaps the large ones leave instead of splitting the blocks they'd need.
+        for (int slot = 0; slot < (int)sizes.size(); ++slot)
+        {
+            if (FW::min(sizes[slot], m_pageSize) != m_cells[slot].size)
+            {
+                release(slot);
+                changed.push_back(slot);
+            }
+        }
+
+        std::vector<int> order = changed;
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return sizes[a] > sizes[b]; });
+
+        for (int slot : order)
+        {
+            if (sizes[slot] > 0)
+            {
+                m_cells[slot] = takeBlock(FW::min(sizes[slot], m_pageSize));
+                m_allocatedTexels += S64(m_cells[slot].size) * m_cells[slot].size;
+            }
+        }
+    }
+
+    void ShadowAtlas::free()
+    {
+        if (!m_pages.empty())
+        {
+            glDeleteTextures((GLsizei)m_pages.size(), m_pages.data());
+            m_pages.clear();
+        }
+
+        if (m_framebuffer)
+        {
+            glDeleteFramebuffers(1, &m_framebuffer);
+            m_framebuffer = 0;
+        }
+
+        m_cells.clear();
+        m_freeBlocks.clear();
+        m_pageSize = 0;
+        m_allocatedTexels = 0;
+    }
+
+    int ShadowAtlas::getLevel(int size) const
+    {
+        int level = 0;
+        while ((m_pageSize >> level) > size)
+        {
+            ++level;
+        }
+        return level;
+    }
+
+    ShadowAtlas::Cell ShadowAtlas::takeBlock(int size)
+    {
+        int level = getLevel(size);
+
+        // The smallest free block that fits; a new page if there is none.
+        int from = level;
+        while (from >= 0 && m_freeBlocks[from].empty())
+        {
+            --from;
+        }
+
+        if (from < 0)
+        {
+            addPage();
+            from = 0;
+        }
+
+        Cell block = m_freeBlocks[from].back();
+        m_freeBlocks[from].pop_back();
+
+        // Split it down to the requested size, keeping the lower left quarter each time.
+        for (; from < level; ++from)
+        {
+            block.size /= 2;
+            m_freeBlocks[from + 1].push_back(Cell(block.page, block.origin + Vec2i(block.size, 0), block.size));
+            m_freeBlocks[from + 1].push_back(Cell(block.page, block.origin + Vec2i(0, block.size), block.size));
+            m_freeBlocks[from + 1].push_back(Cell(block.page, block.origin + Vec2i(block.size, block.size), block.size));
+        }
+
+        return block;
+    }
+
+    void ShadowAtlas::returnBlock(Cell block)
+    {
+        // Merge with the three siblings while they're all free.
+        for (int level = getLevel(block.size); level > 0; --level)
+        {
+            std::vector<Cell>& blocks = m_freeBlocks[level];
+            Vec2i parent = block.origin / (block.size * 2) * (block.size * 2);
+            int siblings[3];
+            int numSiblings = 0;
+
+            for (int i = 0; i < (int)blocks.size() && numSiblings < 3; ++i)
+            {
+                const Cell& b = blocks[i];
+                if (b.page == block.page && b.origin / (block.size * 2) * (block.size * 2) == parent)
+                {
+                    siblings[numSiblings++] = i;
+                }
+            }
+
+            if (numSiblings < 3)
+            {
+                break;
+            }
+
+            // Remove from the back so the other indices stay valid.
+            for (int i = 2; i >= 0; --i)
+            {
+                blocks[siblings[i]] = blocks.back();
+                blocks.pop_back();
+            }
+
+            block = Cell(block.page, parent, block.size * 2);
+        }
+
+        m_freeBlocks[getLevel(block.size)].push_back(block);
+    }
+
+    void ShadowAtlas::release(int slot)
+    {
+        if (hasCell(slot))
+        {
+            m_allocatedTexels -= S64(m_cells[slot].size) * m_cells[slot].size;
+            returnBlock(m_cells[slot]);
+            m_cells[slot] = Cell();
+        }
+    }
+
+    void ShadowAtlas::addPage()
+    {
+        printf("Allocating shadow atlas page %d, %d x %d\n", (int)m_pages.size(), m_pageSize, m_pageSize);
+
+        GLuint tex = 0;
+        glGenTextures(1, &tex);
+
+        // the same format and sampling as ShadowMapContext::allocateDepthTexture()
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, m_pageSize, m_pageSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        if (!m_framebuffer)
+        {
+            glGenFramebuffers(1, &m_framebuffer);
+        }
+
+        GLContext::checkErrors();
+
+        m_freeBlocks[0].push_back(Cell((int)m_pages.size(), Vec2i(0), m_pageSize));
+        m_pages.push_back(tex);
+    }
+
+    Vec4f ShadowAtlas::getCellRect(int slot) const
+    {
+        const Cell& cell = m_cells[slot];
+        float scale = float(cell.size) / float(m_pageSize);
+        return Vec4f(Vec2f(cell.origin) / float(m_pageSize), scale, scale);
+    }
+
+    void ShadowAtlas::attach(int slot)
+    {
+        FW_ASSERT(hasCell(slot));
+        const Cell& cell = m_cells[slot];
+
+        glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_pages[cell.page], 0);
+        glDrawBuffers(0, nullptr);
+
+        // The scissor keeps the clear inside the cell; the viewport alone wouldn't.
+        glViewport(cell.origin.x, cell.origin.y, cell.size, cell.size);
+        glScissor(cell.origin.x, cell.origin.y, cell.size, cell.size);
+        glEnable(GL_SCISSOR_TEST);
+
+        glClearDepth(1.0f);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    void ShadowAtlas::detach()
+    {
+        glDisable(GL_SCISSOR_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void ShadowAtlas::upload(int slot, const DepthMap& map)
+    {
+        FW_ASSERT(hasCell(slot) && map.size == Vec2i(m_cells[slot].size));
+        const Cell& cell = m_cells[slot];
+
+        glBindTexture(GL_TEXTURE_2D, m_pages[cell.page]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, cell.origin.x, cell.origin.y, cell.size, cell.size, GL_DEPTH_COMPONENT, GL_FLOAT, map.depth.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLContext::checkErrors();
+    }
+}
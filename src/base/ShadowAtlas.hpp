@@ -0,0 +1,81 @@
+#pragma once
+
+
+#include "ShadowMap.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // The shadow maps of all the VPLs in a few large depth textures (pages), one square cell per light.
+    // Lights are addressed by slot; the shading pass reads a batch of lights from one page without
+    // rebinding textures, and no textures are created or deleted when the lights move or switch on and off.
+    //
+    // Cells can differ in size. They are power of two squares handed out by a quadtree buddy allocator:
+    // a free block is split into four until it has the requested size, and a released cell is merged back
+    // with its three siblings when they are all free. A slot that keeps its size keeps its cell, so
+    // resizing a few lights doesn't move the maps of the others.
+    //
+    // Pages are separate 2D textures rather than the layers of one texture array: the shaders are GLSL 1.20,
+    // which has no sampler2DArray without EXT_texture_array.
+    class ShadowAtlas
+    {
+    public:
+        ShadowAtlas() :
+            m_pageSize(0),
+            m_allocatedTexels(0),
+            m_framebuffer(0)
+        {}
+        ~ShadowAtlas() { free(); }
+
+        // Gives slot i a cell of sizes[i]^2 texels, or none if sizes[i] is 0; the sizes are powers of two.
+        // Slots beyond sizes.size() are released. The slots that got a new cell, whose maps have to be
+        // rendered again, are returned in changed.
+        void layout(const std::vector<int>& sizes, std::vector<int>& changed);
+        void free();
+
+        int getPageSize() const { return m_pageSize; }
+        int getNumPages() const { return (int)m_pages.size(); }
+        GLuint getTexture(int page) const { return m_pages[page]; }
+        S64 getAllocatedTexels() const { return m_allocatedTexels; }
+
+        bool hasCell(int slot) const { return slot < (int)m_cells.size() && m_cells[slot].size > 0; }
+        int getCellSize(int slot) const { return m_cells[slot].size; }
+        int getPage(int slot) const { return m_cells[slot].page; }
+
+        // Offset (xy) and scale (zw) that take the texture coordinates of a single shadow map to the cell.
+        Vec4f getCellRect(int slot) const;
+
+        // Binds the cell as the depth target, with the viewport and the scissor on it, and clears it.
+        void attach(int slot);
+        void detach();
+
+        // Copies a map rendered on the CPU into the cell; it has to have the cell's resolution.
+        void upload(int slot, const DepthMap& map);
+
+    private:
+        struct Cell
+        {
+            int page;
+            Vec2i origin;
+            int size;       // 0 if the slot has no cell
+
+            Cell() : page(-1), origin(0), size(0) {}
+            Cell(int p, const Vec2i& o, int s) : page(p), origin(o), size(s) {}
+        };
+
+        int getLevel(int size) const;
+        Cell takeBlock(int size);
+        void returnBlock(Cell block);
+        void release(int slot);
+        void addPage();
+
+        int m_pageSize;
+        S64 m_allocatedTexels;
+        std::vector<Cell> m_cells;                      // per slot
+        std::vector<std::vector<Cell>> m_freeBlocks;    // per level; the blocks of level l are m_pageSize >> l texels wide
+        std::vector<GLuint> m_pages;
+        GLuint m_framebuffer;
+    };
+}
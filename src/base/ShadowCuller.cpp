@@ -0,0 +1,247 @@
+#include "ShadowCuller.hpp"
+#include "RayTracer.hpp"
+
+#include "gpu/GLContext.hpp"
+
+
+namespace FW
+{
+    void ShadowCuller::build(const RayTracer& rt, const MeshWithColors& mesh)
+    {
+        static const std::vector<RTTriangle> none;
+        build(rt.getBvh(), rt.m_triangles ? *rt.m_triangles : none, mesh.numVertices());
+    }
+
+    void ShadowCuller::build(const MeshWithColors& mesh)
+    {
+        // the triangles like App::constructTracer() collects them
+        std::vector<RTTriangle> triangles;
+        triangles.reserve(mesh.numTriangles());
+
+        for (int i = 0; i < mesh.numSubmeshes(); ++i)
+        {
+            const Array<Vec3i>& idx = mesh.indices(i);
+            for (int j = 0; j < idx.getSize(); ++j)
+            {
+                RTTriangle t(mesh.vertex(idx[j][0]), mesh.vertex(idx[j][1]), mesh.vertex(idx[j][2]));
+                t.m_data.vertex_indices = idx[j];
+                triangles.push_back(t);
+            }
+        }
+
+        if (triangles.empty())
+        {
+            build(Bvh(), triangles, mesh.numVertices());
+            return;
+        }
+
+        Bvh bvh(triangles, SplitMode_Sah);
+        build(bvh, triangles, mesh.numVertices());
+    }
+
+    void ShadowCuller::build(const Bvh& bvh, const std::vector<RTTriangle>& triangles, int numVertices)
+    {
+        m_nodes.clear();
+        m_clusters.clear();
+        m_meshTriangles.clear();
+        m_geometry = ShadowGeometry();
+        m_indexBufferValid = false;
+
+        if (triangles.empty())
+        {
+            return;
+        }
+
+        std::vector<int> vertexMap(numVertices, -1);
+        addNode(bvh.root(), bvh, triangles, vertexMap);
+    }
+
+    int ShadowCuller::addNode(const BvhNode& node, const Bvh& bvh, const std::vector<RTTriangle>& triangles, std::vector<int>& vertexMap)
+    {
+        int index = (int)m_nodes.size();
+        m_nodes.push_back(Node());
+        m_nodes[index].lo = node.bb.min;
+        m_nodes[index].hi = node.bb.max;
+        m_nodes[index].firstCluster = (int)m_clusters.size();
+        m_nodes[index].left = m_nodes[index].right = -1;
+
+        if (node.hasChildren() && int(node.endPrim - node.startPrim) > m_clusterSize)
+        {
+            int left = addNode(*node.left, bvh, triangles, vertexMap);
+            int right = addNode(*node.right, bvh, triangles, vertexMap);
+            m_nodes[index].left = left;
+            m_nodes[index].right = right;
+        }
+        else
+        {
+            // A cluster: the node's triangles, and a copy of the vertices they use.
+            ShadowRange cluster;
+            cluster.firstTriangle = m_geometry.getNumTriangles();
+            cluster.numTriangles = int(node.endPrim - node.startPrim);
+            cluster.firstVertex = m_geometry.getNumVertices();
+
+            std::vector<int> used;
+
+            for (size_t i = node.startPrim; i < node.endPrim; ++i)
+            {
+                const RTTriangle& tri = triangles[bvh.getIndex(U32(i))];
+                Vec3i local;
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    int v = tri.m_data.vertex_indices[k];
+
+                    if (vertexMap[v] < 0)
+                    {
+                        vertexMap[v] = m_geometry.getNumVertices();
+                        used.push_back(v);
+
+                        const Vec3f& p = tri.m_vertices[k].p;
+                        m_geometry.x.push_back(p.x);
+                        m_geometry.y.push_back(p.y);
+                        m_geometry.z.push_back(p.z);
+                    }
+
+                    local[k] = vertexMap[v];
+                }
+
+                m_geometry.triangles.push_back(local);
+                m_meshTriangles.push_back(tri.m_data.vertex_indices);
+            }
+
+            for (int v : used)
+            {
+                vertexMap[v] = -1;
+            }
+
+            cluster.numVertices = m_geometry.getNumVertices() - cluster.firstVertex;
+            m_clusters.push_back(cluster);
+        }
+
+        m_nodes[index].endCluster = (int)m_clusters.size();
+        return index;
+    }
+
+    int ShadowCuller::cull(const Mat4f& posToClip, std::vector<ShadowRange>& ranges) const
+    {
+        if (m_nodes.empty())
+        {
+            return 0;
+        }
+
+        // The frustum planes -w <= x, y, z <= w as row combinations of the matrix, pointing inside.
+        Vec4f planes[6];
+        Vec4f row3 = posToClip.getRow(3);
+        for (int i = 0; i < 3; ++i)
+        {
+            planes[2 * i + 0] = row3 + posToClip.getRow(i);
+            planes[2 * i + 1] = row3 - posToClip.getRow(i);
+        }
+
+        int numTriangles = 0;
+        int firstNew = (int)ranges.size();
+
+        auto emit = [&](int firstCluster, int endCluster)
+        {
+            const ShadowRange& first = m_clusters[firstCluster];
+            const ShadowRange& last = m_clusters[endCluster - 1];
+
+            ShadowRange range;
+            range.firstTriangle = first.firstTriangle;
+            range.numTriangles = last.firstTriangle + last.numTriangles - first.firstTriangle;
+            range.firstVertex = first.firstVertex;
+            range.numVertices = last.firstVertex + last.numVertices - first.firstVertex;
+            numTriangles += range.numTriangles;
+
+            // The nodes are visited in cluster order, so a range can only continue the previous one.
+            if ((int)ranges.size() > firstNew)
+            {
+                ShadowRange& prev = ranges.back();
+                if (prev.firstTriangle + prev.numTriangles == range.firstTriangle)
+                {
+                    prev.numTriangles += range.numTriangles;
+                    prev.numVertices += range.numVertices;
+                    return;
+                }
+            }
+
+            ranges.push_back(range);
+        };
+
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0)
+        {
+            const Node& node = m_nodes[stack[--stackSize]];
+            bool inside = true;
+            bool outside = false;
+
+            for (const Vec4f& plane : planes)
+            {
+                // the corners farthest along and against the plane normal
+                Vec3f farthest(plane.x >= 0.f ? node.hi.x : node.lo.x, plane.y >= 0.f ? node.hi.y : node.lo.y, plane.z >= 0.f ? node.hi.z : node.lo.z);
+                Vec3f nearest(plane.x >= 0.f ? node.lo.x : node.hi.x, plane.y >= 0.f ? node.lo.y : node.hi.y, plane.z >= 0.f ? node.lo.z : node.hi.z);
+
+                if (dot(plane.getXYZ(), farthest) + plane.w < 0.f)
+                {
+                    outside = true;
+                    break;
+                }
+
+                if (dot(plane.getXYZ(), nearest) + plane.w < 0.f)
+                {
+                    inside = false;
+                }
+            }
+
+            if (outside)
+            {
+                continue;
+            }
+
+            if (inside || node.left < 0 || stackSize + 2 > 64)
+            {
+                emit(node.firstCluster, node.endCluster);
+                continue;
+            }
+
+            // right first, so the left child is visited first and the ranges come out in order
+            stack[stackSize++] = node.right;
+            stack[stackSize++] = node.left;
+        }
+
+        return numTriangles;
+    }
+
+    int ShadowCuller::draw(GLContext* gl, MeshWithColors* scene, GLContext::Program* prog, const Mat4f& posToClip)
+    {
+        int posAttrib = scene->findAttrib(MeshBase::AttribType_Position);
+        if (posAttrib == -1 || m_nodes.empty())
+        {
+            return 0;
+        }
+
+        if (!m_indexBufferValid)
+        {
+            m_indexBuffer.set(m_meshTriangles.data(), S64(m_meshTriangles.size() * sizeof(Vec3i)));
+            m_indexBufferValid = true;
+        }
+
+        std::vector<ShadowRange> ranges;
+        int numTriangles = cull(posToClip, ranges);
+
+        // The positions come from the mesh's vertex buffer, the triangles from the reordered index buffer.
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer.getGLBuffer());
+        scene->setGLAttrib(gl, posAttrib, prog->getAttribLoc("positionAttrib"));
+
+        for (const ShadowRange& range : ranges)
+        {
+            glDrawElements(GL_TRIANGLES, range.numTriangles * 3, GL_UNSIGNED_INT, (void*)(UPTR)(range.firstTriangle * sizeof(Vec3i)));
+        }
+
+        gl->resetAttribs();
+        return numTriangles;
+    }
+}
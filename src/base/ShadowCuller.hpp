@@ -0,0 +1,67 @@
+#pragma once
+
+
+#include "ShadowRasterizer.hpp"
+
+#include "gpu/Buffer.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    class RayTracer;
+    class Bvh;
+    struct BvhNode;
+    struct RTTriangle;
+
+    // Culls the scene against light frusta before shadow map rendering. The top levels of the ray tracer's
+    // BVH are copied down to nodes of at most a cluster's worth of triangles; the triangles are reordered
+    // so that every node covers a contiguous run of them, in a GL index buffer for the GL shadow pass and
+    // in a ShadowGeometry, with the vertices of each cluster copied next to each other, for the
+    // ShadowRasterizer. Culling walks the copied nodes against the frustum planes and returns the runs
+    // of the clusters that intersect it, merged where they are adjacent.
+    class ShadowCuller
+    {
+    public:
+        ShadowCuller() : m_clusterSize(256), m_indexBufferValid(false) {}
+
+        void setClusterSize(int triangles) { m_clusterSize = FW::max(1, triangles); }
+
+        // Rebuilds everything from the hierarchy of rt, whose triangles come from mesh.
+        void build(const RayTracer& rt, const MeshWithColors& mesh);
+        // The same for a mesh with no ray tracer, e.g. a simplified one; builds a hierarchy of its own.
+        void build(const MeshWithColors& mesh);
+        bool empty() const { return m_nodes.empty(); }
+
+        // Appends the visible ranges to ranges; returns the number of triangles in them.
+        int cull(const Mat4f& posToClip, std::vector<ShadowRange>& ranges) const;
+
+        // Culls, then draws the visible triangles of scene with the current program, which takes the
+        // positions in positionAttrib. Returns the number of triangles drawn.
+        int draw(GLContext* gl, MeshWithColors* scene, GLContext::Program* prog, const Mat4f& posToClip);
+
+        const ShadowGeometry& getGeometry() const { return m_geometry; }
+        int getNumTriangles() const { return m_geometry.getNumTriangles(); }
+        int getNumClusters() const { return (int)m_clusters.size(); }
+
+    private:
+        struct Node
+        {
+            Vec3f lo, hi;
+            int firstCluster, endCluster;
+            int left, right;        // -1 for a cluster
+        };
+
+        void build(const Bvh& bvh, const std::vector<RTTriangle>& triangles, int numVertices);
+        int addNode(const BvhNode& node, const Bvh& bvh, const std::vector<RTTriangle>& triangles, std::vector<int>& vertexMap);
+
+        int m_clusterSize;
+        std::vector<Node> m_nodes;
+        std::vector<ShadowRange> m_clusters;
+        std::vector<Vec3i> m_meshTriangles;     // the mesh's vertex indices, in cluster order
+        ShadowGeometry m_geometry;
+        Buffer m_indexBuffer;
+        bool m_indexBufferValid;
+    };
+}
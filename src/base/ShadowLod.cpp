@@ -0,0 +1,86 @@
+#include "ShadowLod.hpp"
+
+#include "base/Timer.hpp"
+
+#include <fstream>
+
+
+namespace FW
+{
+    void ShadowLod::build(const MeshWithColors& scene, const std::string& cacheBase, int numLevels, float firstError)
+    {
+        m_levels.clear();
+
+        Vec3f lo, hi;
+        scene.getBBox(lo, hi);
+        m_center = 0.5f * (lo + hi);
+        m_diagonal = (hi - lo).length();
+
+        Timer timer(true);
+        const MeshWithColors* previous = &scene;
+        float maxError = 0.f;
+
+        for (int i = 0; i < numLevels; ++i)
+        {
+            // Each level is simplified from the previous one, so a vertex can drift by the errors of all
+            // the levels up to it.
+            float step = firstError * float(1 << i) * m_diagonal;
+            maxError += step;
+
+            Level level;
+            level.maxError = maxError;
+
+            String cacheFile = sprintf("%s.shadowlod%d.bin", cacheBase.c_str(), i + 1);
+
+            if (!cacheBase.empty() && std::ifstream(cacheFile.getPtr()).good())
+            {
+                String oldError = clearError();
+                std::unique_ptr<MeshBase> mesh(importMesh(cacheFile));
+                restoreError(oldError);
+
+                if (mesh)
+                {
+                    level.mesh.reset(new MeshWithColors(*mesh));
+                }
+            }
+
+            if (!level.mesh)
+            {
+                level.mesh.reset(new MeshWithColors(*previous));
+                level.mesh->simplify(step);
+
+                if (!cacheBase.empty())
+                {
+                    exportMesh(cacheFile, level.mesh.get());
+                }
+            }
+
+            level.culler.reset(new ShadowCuller());
+            level.culler->build(*level.mesh);
+
+            ::printf("Shadow LOD level %d: %d triangles, error %g\n", i + 1, level.mesh->numTriangles(), level.maxError);
+
+            previous = level.mesh.get();
+            m_levels.push_back(std::move(level));
+        }
+
+        ::printf("Built %d shadow LOD levels in %.2f s\n", numLevels, timer.end());
+    }
+
+    int ShadowLod::selectLevel(const LightSource& light, int resolution, float texelError) const
+    {
+        // The footprint of a texel at the given distance; the opening is clamped below 180 degrees,
+        // where the map's texels grow without bound at the edges.
+        float distance = FW::max((light.getPosition() - m_center).length(), 0.01f * m_diagonal);
+        float halfFov = FW::min(0.5f * light.getFOVRad(), 85.0f * FW_PI / 180.0f);
+        float texel = 2.0f * distance * FW::tan(halfFov) / float(FW::max(resolution, 1));
+
+        int level = 0;
+        while (level + 1 < getNumLevels() && getMaxError(level + 1) <= texelError * texel)
+        {
+            ++level;
+        }
+
+        return level;
+    }
+}
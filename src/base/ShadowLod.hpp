@@ -0,0 +1,49 @@
+#pragma once
+
+
+#include "ShadowCuller.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace FW
+{
+    // Simplified copies of the scene for the indirect light shadow maps, whose shadows are soft and low
+    // resolution enough not to show the missing detail. Level 0 is the scene itself, which the caller keeps;
+    // each further level is the previous one simplified with MeshBase::simplify(), allowing twice the error.
+    // The levels are saved next to the mesh and loaded from there the next time.
+    class ShadowLod
+    {
+    public:
+        ShadowLod() : m_diagonal(0.f) {}
+
+        // firstError is relative to the diagonal of the scene's bounding box.
+        void build(const MeshWithColors& scene, const std::string& cacheBase, int numLevels = 4, float firstError = 0.0025f);
+        void clear() { m_levels.clear(); }
+
+        int getNumLevels() const { return (int)m_levels.size() + 1; }
+        float getMaxError(int level) const { return level > 0 ? m_levels[level - 1].maxError : 0.f; }
+
+        // The simplified levels, from 1 up.
+        MeshWithColors* getMesh(int level) const { return m_levels[level - 1].mesh.get(); }
+        ShadowCuller& getCuller(int level) const { return *m_levels[level - 1].culler; }
+
+        // The coarsest level whose error stays within texelError texels of a shadow map of the given resolution
+        // at the light's distance from the scene's center, i.e. where the bulk of its shadow casters are.
+        int selectLevel(const LightSource& light, int resolution, float texelError) const;
+
+    private:
+        struct Level
+        {
+            float maxError;
+            std::unique_ptr<MeshWithColors> mesh;
+            std::unique_ptr<ShadowCuller> culler;
+        };
+
+        std::vector<Level> m_levels;
+        Vec3f m_center;
+        float m_diagonal;
+    };
+}
@@ -1,4 +1,8 @@
 #include "ShadowMap.hpp"
+#include "ShadowRasterizer.hpp"
+#include "ShadowAtlas.hpp"
+#include "ShadowCuller.hpp"
+#include "PrefilteredShadowMap.hpp"
 
 
 namespace FW
@@ -12,6 +16,72 @@ namespace FW
         return Mat4f::perspective(getFOV(), getNear(), getFar()) * m_xform.inverted();
     }
 
+    const char* LightSource::getLightingShaderSource()
+    {
+        return FW_GL_SHADER_SOURCE(
+            // The light a spot light at lightPos, aimed along lightDir and with cosHalfFOV the cosine of its half
+            // opening, sends to a point at pos with the unit normal, before shadowing: both cosines, the clamped
+            // inverse square distance and the cone that fades to black at its edge. All in eye coordinates.
+            vec3 getLightShading(vec3 pos, vec3 normal, vec3 lightPos, vec3 lightDir, float cosHalfFOV, vec3 lightE)
+            {
+                vec3 incoming = normalize(pos - lightPos);
+                float incomingVsSurfaceNormal = max(0.0, dot(-incoming, normal));
+                float incomingVsLightDirection = max(0.0, dot(incoming, normalize(lightDir)));
+
+                float distance = length(pos - lightPos);
+                float inverseSquareDistance = min(10.0, 1.0 / (distance * distance));
+                float cone = max(0.0, min(1.0, 4.0 * (incomingVsLightDirection - cosHalfFOV) / (1.0 - cosHalfFOV)));
+
+                return incomingVsSurfaceNormal * incomingVsLightDirection * inverseSquareDistance * cone * lightE;
+            }
+
+            // Where a point reads the shadow map: the uv in xy, the NDC depth the depth map compares against in z,
+            // and the distance from the light the moments are of in w. posLight is the point in the light's clip
+            // space, or with the paraboloid warp (see LightSource::Projection) in its view space, and depthRange
+            // holds the light's near and far distances.
+            vec4 getShadowCoords(vec4 posLight, bool paraboloid, vec2 depthRange)
+            {
+                // the same warp as the depth pass; the light looks down -z
+                if (paraboloid) {
+                    float lightDistance = length(posLight.xyz);
+                    vec3 d = posLight.xyz / lightDistance;
+                    return vec4(0.5 * d.xy / max(1.0 - d.z, 1e-4) + 0.5, 2.0 * (lightDistance - depthRange.x) / (depthRange.y - depthRange.x) - 1.0, lightDistance);
+                }
+
+                // w of the perspective projection is the depth along the light's axis
+                return vec4(0.5 * posLight.xy / posLight.w + 0.5, posLight.z / posLight.w, posLight.w);
+            }
+
+            // 0 if the depth map, read at the coordinates, has something in front of the point, and 1 otherwise.
+            float getDepthShadow(float mapDepth, vec4 coords)
+            {
+                return 2.0 * mapDepth - 1.0 < coords.z ? 0.0 : 1.0;
+            }
+
+            // The same from the prefiltered moments of the linear depth (see PrefilteredShadowMap), which fade in
+            // between: shadowFilter is 1 for ESM and 2 for VSM, and momentParams holds the ESM exponent, the mip
+            // bias, the VSM minimum variance and its light bleeding reduction. The moments are of the depths past
+            // the near distance divided by depthScale.
+            float getMomentShadow(vec4 moments, vec4 coords, float nearDistance, float depthScale, int shadowFilter, vec4 momentParams)
+            {
+                float t = clamp((coords.w - nearDistance) / depthScale, 0.0, 1.0);
+
+                if (shadowFilter == 1) {
+                    return min(1.0, moments.r * exp(-momentParams.x * t));
+                }
+
+                if (t <= moments.r) {
+                    return 1.0;
+                }
+
+                float variance = max(moments.a - moments.r * moments.r, momentParams.z);
+                float d = t - moments.r;
+                float pMax = variance / (variance + d * d);
+                return clamp((pMax - momentParams.w) / (1.0 - momentParams.w), 0.0, 1.0);
+            }
+        );
+    }
+
     void LightSource::renderShadowedScene(GLContext* gl, MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection, bool fromLight)
     {
         // Get or build the shader that renders the scene using the shadow map
@@ -58,6 +128,11 @@ namespace FW
                     // of the light, just like gl_Position is in the clip space of the camera.
                     varying vec4 posLightClip;
 
+                    // For the paraboloid shadow maps (see LightSource::Projection), the warp is not linear, so
+                    // the position in the light's view space is interpolated and warped per pixel instead.
+                    uniform mat4 posToLightView;
+                    varying vec3 posLightView;
+
                     // Feel free to define whatever else you might need. Use uniforms to bring in stuff from the caller ("C++ side"),
                     // and varyings to pass computation results to the fragment shader.
 
@@ -80,6 +155,7 @@ namespace FW
 
                         // YOUR CODE HERE (R3): Compute the position of vertex in the light's clip space and pass it to the fragment shader.
                         posLightClip = posToLightClip * pos;
+                        posLightView = (posToLightView * pos).xyz;
 
                         // Debug hack that renders the scene from the light's view, activated by a toggle button in the UI:
                         if (renderFromLight) {
@@ -88,7 +164,7 @@ namespace FW
                     }
                     // VERTEX SHADER ENDS HERE
                 ),
-                "#version 120\n"
+                String("#version 120\n") + getLightingShaderSource() +
                 FW_GL_SHADER_SOURCE(
                     // FRAGMENT SHADER BEGINS HERE. This part is executed for every pixel after the vertex shader is done.
                     // The ultimate task of the fragment shader is to assign a value to vec4 gl_FragColor. That value
@@ -120,6 +196,17 @@ namespace FW
                     // Interpolated varying variables. Note that the names correspond to those in the vertex shader.
                     // So whatever you computed and assigned to these in the vertex shader, it's now here.
                     varying vec4 posLightClip;
+                    varying vec3 posLightView;
+                    uniform bool paraboloid;
+                    uniform vec2 depthRange; // the light's near and far distances
+
+                    // Prefiltered moments of the linear depth (see PrefilteredShadowMap), used instead of the
+                    // depth comparison when shadowFilter is 1 (ESM) or 2 (VSM). momentParams holds the ESM
+                    // exponent, the mip bias, the VSM minimum variance and its light bleeding reduction.
+                    uniform int shadowFilter;
+                    uniform sampler2D momentSampler;
+                    uniform vec4 momentParams;
+                    uniform float momentDepthScale;
 
                     void main()
                     {
@@ -156,16 +243,10 @@ namespace FW
                         //
                         // Be careful with the lightFOVRad -- it contains the angle of full angle of opening,
                         // which is twice the angle of the cone against its axis. Often times you want the latter.
-                        vec3 incoming = normalize(positionVarying - lightPosEye);
-                        float incomingVsSurfaceNormal = max(0.0, dot(-incoming, normalize(normalVarying)));
-                        float incomingVsLightDirection = max(0.0, dot(incoming, normalize(lightDirEye)));
-
-                        float distance = length(positionVarying - lightPosEye);
-                        float inverseSquareDistance = min(10.0, 1.0 / (distance * distance));
-                        vec3 shading = incomingVsSurfaceNormal * incomingVsLightDirection * inverseSquareDistance * lightE;
-
-                        float cosf2 = cos(lightFOVRad / 2.0);
-                        float cone = max(0.0, min(1.0, 4.0 * (incomingVsLightDirection - cosf2) / (1.0 - cosf2)));
+                        //
+                        // The computation is getLightShading() of getLightingShaderSource(), which the other shadow
+                        // mapped shaders share.
+                        vec3 shading = getLightShading(positionVarying, normalize(normalVarying), lightPosEye, lightDirEye, cos(lightFOVRad / 2.0), lightE);
 
                         // YOUR CODE HERE (R3):
                         // Here you need to transform the position in light's clip space into light's NDC space to get the depth value and
@@ -175,16 +256,18 @@ namespace FW
                         // Be aware, though, that the NDC coordinates will  be in range [-1, 1] whereas UV coordinates need to be in range [0, 1],
                         // and the value fetch from the GL_DEPTH_COMPONENT depth texture will return a number in range [0, 1].
                         // You can transform between these spaces by affine transformations, i.e. multiply, then add.
-                        vec2 uv = 0.5 * posLightClip.xy / posLightClip.w + 0.5;
-                        float depth = posLightClip.z / posLightClip.w;
+                        vec4 coords = getShadowCoords(paraboloid ? vec4(posLightView, 1.0) : posLightClip, paraboloid, depthRange);
                         float shadow = 1.0;
 
-                        if (2.0 * texture2D(shadowSampler, uv).x - 1.0 < depth) {
-                            shadow = 0.0;
+                        if (shadowFilter == 0) {
+                            shadow = getDepthShadow(texture2D(shadowSampler, coords.xy).x, coords);
+                        }
+                        else {
+                            shadow = getMomentShadow(texture2D(momentSampler, coords.xy, momentParams.y), coords, depthRange.x, momentDepthScale, shadowFilter, momentParams);
                         }
 
                         float PI = 3.1415926535897932384626433832795;
-                        diffuseColor.rgb *= shading * shadow * cone / PI;
+                        diffuseColor.rgb *= shading * shadow / PI;
 
                         // Set the alpha value to 1.0, we're not using it for anything and other values might or might not
                         // cause weird things.
@@ -205,10 +288,22 @@ namespace FW
         glBindTexture(GL_TEXTURE_2D, m_shadowMapTexture);
         gl->setUniform(prog->getUniformLoc("shadowSampler"), 5);
 
+        // The prefiltered moments, if the map has them, go to slot 6.
+        gl->setUniform(prog->getUniformLoc("shadowFilter"), (S32)m_momentFilter.filter);
+        gl->setUniform(prog->getUniformLoc("momentSampler"), 6);
+        if (m_momentFilter.filter != ShadowFilter_None)
+        {
+            glActiveTexture(GL_TEXTURE0 + 6);
+            glBindTexture(GL_TEXTURE_2D, m_momentTexture);
+            gl->setUniform(prog->getUniformLoc("momentParams"), Vec4f(m_momentFilter.exponent, m_momentFilter.softness, m_momentFilter.minVariance, m_momentFilter.bleedReduction));
+            gl->setUniform(prog->getUniformLoc("momentDepthScale"), m_momentDepthScale);
+        }
+
         // Set the input parameters to the shader.
 
-        // Here we set the light source transformation according to your getPosToLightClip() implementation.
-        gl->setUniform(prog->getUniformLoc("posToLightClip"), getPosToLightClip());
+        // Here we set the light source transformation according to your getPosToLightClip() implementation,
+        // and the paraboloid warp if the map uses one.
+        setProjectionUniforms(gl, prog);
 
         // Other light source parameters.
         gl->setUniform(prog->getUniformLoc("lightPosEye"), (worldToCamera * Vec4f(getPosition(), 1.0f)).getXYZ()); // Transformed to eye coords.
@@ -222,11 +317,8 @@ namespace FW
         glUseProgram(0);
     }
 
-    void LightSource::renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowMapContext* sm, bool debug)
+    GLContext::Program* LightSource::getDepthProgram(GLContext* gl)
     {
-        // suppress unused warning
-        (void)debug;
-
         // Get or build the shader that outputs depth values
         static const char* progId = "ShadowMap::renderDepthTexture";
         GLContext::Program* prog = gl->getProgram(progId);
@@ -252,10 +344,28 @@ namespace FW
                     uniform mat4 posToLightClip;
                     attribute vec3 positionAttrib;
 
+                    // The paraboloid projection (see LightSource::Projection): the hemisphere in front of the
+                    // light, which looks down -z in its view space, maps to the unit disk, and the depth is the
+                    // distance to the light, linear between the near and far planes.
+                    uniform bool paraboloid;
+                    uniform mat4 posToLightView;
+                    uniform vec2 depthRange;
+
                     void main()
                     {
                         // YOUR CODE HERE (R3): Transform the vertex to the light's clip space.
                         gl_Position = posToLightClip * vec4(positionAttrib, 1.0);
+
+                        if (paraboloid) {
+                            vec3 v = (posToLightView * vec4(positionAttrib, 1.0)).xyz;
+                            float distance = length(v);
+                            vec3 d = v / distance;
+                            float depth = 2.0 * (distance - depthRange.x) / (depthRange.y - depthRange.x) - 1.0;
+
+                            // Vertices behind the light go beyond the far plane, which clips the triangles
+                            // that lie behind it entirely.
+                            gl_Position = vec4(d.xy / max(1.0 - d.z, 1e-4), d.z < 0.0 ? depth : 2.0, 1.0);
+                        }
                     }
                 ),
                 FW_GL_SHADER_SOURCE(
@@ -269,6 +379,16 @@ namespace FW
 
             gl->setProgram(progId, prog);
         }
+
+        return prog;
+    }
+
+    void LightSource::renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowMapContext* sm, bool debug, ShadowCuller* culler)
+    {
+        // suppress unused warning
+        (void)debug;
+
+        GLContext::Program* prog = getDepthProgram(gl);
         prog->use();
 
         // If this light source does not yet have an allocated OpenGL texture, then get one
@@ -278,6 +398,7 @@ namespace FW
 
         // Attach the shadow rendering state (off-screen buffers, render target texture)
         sm->attach(gl, m_shadowMapTexture);
+        m_momentFilter.filter = ShadowFilter_None;
 
         // Here's a trick: we can cull the front faces instead of the backfaces; this
         // moves the shadow map bias nastiness problems to the dark side of the objects
@@ -294,9 +415,9 @@ namespace FW
         glEnable(GL_DEPTH_TEST);
 
         // Set the transformation matrix uniform.
-        gl->setUniform(prog->getUniformLoc("posToLightClip"), getPosToLightClip());
+        setProjectionUniforms(gl, prog);
 
-        renderSceneRaw(gl, scene, prog);
+        renderShadowCasters(gl, scene, prog, culler);
 
         GLContext::checkErrors();
 
@@ -305,14 +426,103 @@ namespace FW
         glDrawBuffer(GL_BACK);
     }
 
-    void LightSource::sampleEmittedRays(int num, std::vector<Vec3f>& origs, std::vector<Vec3f>& dirs, std::vector<Vec3f>& E_times_pdf) const
+    void LightSource::renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowAtlas* atlas, int slot, ShadowCuller* culler)
+    {
+        GLContext::Program* prog = getDepthProgram(gl);
+        prog->use();
+
+        // Binds the atlas page and clears only this light's cell.
+        atlas->attach(slot);
+        m_momentFilter.filter = ShadowFilter_None;
+
+        // front faces culled like in the single texture version above
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glEnable(GL_DEPTH_TEST);
+
+        setProjectionUniforms(gl, prog);
+
+        renderShadowCasters(gl, scene, prog, culler);
+
+        GLContext::checkErrors();
+
+        atlas->detach();
+        glDrawBuffer(GL_BACK);
+    }
+
+    void LightSource::setProjectionUniforms(FW::GLContext* gl, GLContext::Program* prog) const
+    {
+        gl->setUniform(prog->getUniformLoc("posToLightClip"), getPosToLightClip());
+        gl->setUniform(prog->getUniformLoc("paraboloid"), m_projection == Projection_Paraboloid);
+        gl->setUniform(prog->getUniformLoc("posToLightView"), getPosToLightView());
+        gl->setUniform(prog->getUniformLoc("depthRange"), Vec2f(m_near, m_far));
+    }
+
+    void LightSource::uploadShadowMap(ShadowMapContext* sm, const DepthMap& map)
+    {
+        FW_ASSERT(map.size == sm->getResolution());
+
+        if (m_shadowMapTexture == 0) {
+            m_shadowMapTexture = sm->allocateDepthTexture();
+        }
+
+        glBindTexture(GL_TEXTURE_2D, m_shadowMapTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, map.size.x, map.size.y, GL_DEPTH_COMPONENT, GL_FLOAT, map.depth.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLContext::checkErrors();
+        m_momentFilter.filter = ShadowFilter_None;
+    }
+
+    void LightSource::downloadShadowMap(ShadowMapContext* sm, DepthMap& map) const
+    {
+        map.clear(sm->getResolution());
+        if (m_shadowMapTexture == 0) {
+            return;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, m_shadowMapTexture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_FLOAT, map.depth.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLContext::checkErrors();
+    }
+
+    void LightSource::uploadMomentMap(const PrefilteredShadowMap& map)
     {
-        Random rand(1234); // Use this random number generator, so that we'll get the same rays on every frame. Otherwise it'll flicker.
+        if (m_momentTexture == 0) {
+            glGenTextures(1, &m_momentTexture);
+            glBindTexture(GL_TEXTURE_2D, m_momentTexture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        }
 
-        // Pre-allocate space in the output vectors (just a slight optimization)
-        origs.reserve(num);
-        dirs.reserve(num);
-        E_times_pdf.reserve(num);
+        // The whole mip chain from the CPU, so that GL filters exactly what PrefilteredShadowMap::lookup() does;
+        // the two moments go to the luminance and the alpha.
+        glBindTexture(GL_TEXTURE_2D, m_momentTexture);
+        for (int level = 0; level < map.getNumLevels(); ++level)
+        {
+            const Vec2i& size = map.getSize(level);
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA32F, size.x, size.y, 0, GL_LUMINANCE_ALPHA, GL_FLOAT, map.getLevel(level).data());
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLContext::checkErrors();
+
+        m_momentFilter = map.getSettings();
+        m_momentDepthScale = map.getDepthScale();
+    }
+
+    void LightSource::sampleEmittedRays(int num, std::vector<Vec3f>& origs, std::vector<Vec3f>& dirs, std::vector<Vec3f>& E_times_pdf,
+        SamplerType sampler, U32 seed) const
+    {
+        // Use a fixed seed, so that we'll get the same rays on every frame. Otherwise it'll flicker.
+        std::vector<Vec2f> disk;
+        generateDiskSamples(sampler, num, seed, disk);
+
+        // Allocate the output vectors; the loop below writes them by index.
+        origs.resize(num);
+        dirs.resize(num);
+        E_times_pdf.resize(num);
 
         // YOUR CODE HERE (R4):
         // Fill the three vectors with #num ray origins, directions, and intensities divided by probability density.
@@ -322,18 +532,12 @@ namespace FW
 
         for (int i = 0; i < num; ++i)
         {
-            Vec3f rp;
-
-            do {
-                rp.x = rand.getF32(-1.f, 1.f);
-                rp.y = rand.getF32(-1.f, 1.f);
-            } while ((rp.x * rp.x + rp.y * rp.y) > 1.f);
-
-            rp *= r;
+            // Uniform points on the disk lift to a cosine distribution within the cone.
+            Vec3f rp(disk[i] * r, 0.f);
             rp.z = FW::sqrt(1.f - rp.x * rp.x - rp.y * rp.y);
 
             origs[i] = getPosition();
-            dirs[i] = rotationMatrix * rp * getFar();
+            dirs[i] = rotationMatrix * rp; // unit length; trace up to getFar() with a Ray
             E_times_pdf[i] = (r * r / num) * getEmission();
         }
     }
@@ -431,6 +635,19 @@ namespace FW
         gl->resetAttribs();
     }
 
+    void LightSource::renderShadowCasters(FW::GLContext* gl, MeshWithColors* scene, GLContext::Program* prog, ShadowCuller* culler)
+    {
+        if (culler && !culler->empty())
+        {
+            m_shadowMapTriangles = culler->draw(gl, scene, prog, getPosToLightClip());
+        }
+        else
+        {
+            renderSceneRaw(gl, scene, prog);
+            m_shadowMapTriangles = scene->numTriangles();
+        }
+    }
+
     void LightSource::draw(const Mat4f& worldToCamera, const Mat4f& projection, bool show_axis, bool show_frame, bool show_square)
     {
         glUseProgram(0);
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "RayTracer.hpp"
+#include "Sampler.hpp"
 
 namespace FW
 {
@@ -21,6 +22,38 @@ namespace FW
 
 
     class GLContext;
+    struct DepthMap;
+    class ShadowAtlas;
+    class ShadowCuller;
+    class PrefilteredShadowMap;
+
+    // How shadow maps are looked up: a single depth comparison, or one of the prefiltered maps that
+    // store moments of the depth, which can be blurred and mip mapped like any texture (see PrefilteredShadowMap).
+    enum ShadowFilter
+    {
+        ShadowFilter_None = 0,
+        ShadowFilter_Exponential,   // ESM: exp(c * depth); visibility exp(c * (occluder - receiver)), at most 1
+        ShadowFilter_Variance,      // VSM: depth and depth^2; visibility bounded by Chebyshev's inequality
+    };
+
+    struct ShadowFilterSettings
+    {
+        ShadowFilter filter;
+        float exponent;         // ESM sharpness; the depths are normalized to [0, 1]
+        int blurRadius;         // texels of the separable box blur
+        float softness;         // mip level bias of the lookups, i.e. log2 of the extra filter width
+        float minVariance;      // VSM: keeps flat receivers from shadowing themselves
+        float bleedReduction;   // VSM: this much of the upper bound is cut off, against light bleeding
+
+        ShadowFilterSettings() : filter(ShadowFilter_None), exponent(80.f), blurRadius(2), softness(0.f), minVariance(1e-5f), bleedReduction(0.2f) {}
+
+        bool operator==(const ShadowFilterSettings& o) const
+        {
+            return filter == o.filter && exponent == o.exponent && blurRadius == o.blurRadius && softness == o.softness &&
+                minVariance == o.minVariance && bleedReduction == o.bleedReduction;
+        }
+        bool operator!=(const ShadowFilterSettings& o) const { return !(*this == o); }
+    };
 
     // This is a technical thing that holds the off-screen buffers related
     // to shadow map rendering; no need to touch this for the standard requirements.
@@ -40,6 +73,7 @@ namespace FW
 
         GLuint allocateDepthTexture();
         void attach(GLContext* gl, GLuint texture);
+        const Vec2i& getResolution() const { return m_resolution; }
 
     protected:
         GLuint m_depthRenderbuffer;
@@ -51,61 +85,120 @@ namespace FW
     class LightSource
     {
     public:
+        // How the shadow map covers the light's surroundings. The perspective frustum has the light's FOV and
+        // texels that grow denser towards its edges. The paraboloid covers the whole hemisphere in front of the
+        // light with texels of nearly equal solid angle, and stores the distance to the light linearly between
+        // the near and far planes. Its warp is applied per vertex, so long triangles are bent less than they
+        // should be; the scenes are tessellated finely enough for that not to show.
+        enum Projection
+        {
+            Projection_Perspective = 0,
+            Projection_Paraboloid,
+        };
+
         LightSource() :
             m_E(1, 1, 1),
             m_size(0.125f, 0.125f),
             m_fov(20.0f),
             m_near(0.01f),
             m_far(100.0f),
+            m_projection(Projection_Perspective),
+            m_enabled(true),
             m_shadowMapTexture(0),
-            m_enabled(true)
+            m_momentTexture(0),
+            m_momentDepthScale(1.0f),
+            m_shadowMapTriangles(0),
+            m_version(0)
         { }
 
         Vec3f getPosition(void) const { return Vec4f(m_xform.getCol(3)).getXYZ(); }
-        void setPosition(const Vec3f& p) { m_xform.setCol(3, Vec4f(p, 1.0f)); }
+        void setPosition(const Vec3f& p) { if (p != getPosition()) { m_xform.setCol(3, Vec4f(p, 1.0f)); ++m_version; } }
 
         Mat3f getOrientation(void) const { return m_xform.getXYZ(); }
-        void setOrientation(const Mat3f& R) { m_xform.setCol(0, Vec4f(R.getCol(0), 0.0f)); m_xform.setCol(1, Vec4f(R.getCol(1), 0.0f)); m_xform.setCol(2, Vec4f(R.getCol(2), 0.0f)); }
+        void setOrientation(const Mat3f& R) { if (R != getOrientation()) { m_xform.setCol(0, Vec4f(R.getCol(0), 0.0f)); m_xform.setCol(1, Vec4f(R.getCol(1), 0.0f)); m_xform.setCol(2, Vec4f(R.getCol(2), 0.0f)); ++m_version; } }
 
         Vec3f getNormal(void) const { return -Vec4f(m_xform.getCol(2)).getXYZ(); }
 
         Vec2f getSize(void) const { return m_size; }
-        void setSize(const Vec2f& s) { m_size = s; }
+        void setSize(const Vec2f& s) { if (s != m_size) { m_size = s; ++m_version; } }
 
         Vec3f getEmission(void) const { return m_E; }
-        void setEmission(const Vec3f& E) { m_E = E; }
+        void setEmission(const Vec3f& E) { if (E != m_E) { m_E = E; ++m_version; } }
 
         float getFOV(void) const { return m_fov; }
         float getFOVRad(void) const { return m_fov * 3.1415926f / 180.0f; }
-        void setFOV(float fov) { m_fov = fov; }
+        void setFOV(float fov) { if (fov != m_fov) { m_fov = fov; ++m_version; } }
 
         float getFar(void) const { return m_far; }
-        void setFar(float f) { m_far = f; }
+        void setFar(float f) { if (f != m_far) { m_far = f; ++m_version; } }
 
         float getNear(void) const { return m_near; }
-        void setNear(float n) { m_near = n; }
+        void setNear(float n) { if (n != m_near) { m_near = n; ++m_version; } }
+
+        Projection getProjection(void) const { return m_projection; }
+        void setProjection(Projection p) { if (p != m_projection) { m_projection = p; ++m_version; } }
 
 
         void draw(const Mat4f& worldToCamera, const Mat4f& projection, bool show_axis = false, bool show_frame = false, bool show_square = false); // for visualization
 
-        void readState(StateDump& d) { d.pushOwner("areaLight"); d.get(m_xform, "xform"); d.get(m_size, "size"); d.get(m_E, "E"); d.popOwner(); }
+        void readState(StateDump& d) { d.pushOwner("areaLight"); d.get(m_xform, "xform"); d.get(m_size, "size"); d.get(m_E, "E"); d.popOwner(); ++m_version; }
         void writeState(StateDump& d) const { d.pushOwner("areaLight"); d.set(m_xform, "xform"); d.set(m_size, "size"); d.set(m_E, "E"); d.popOwner(); }
 
         void setEnabled(bool e) { m_enabled = e; };
         bool isEnabled() const { return m_enabled; }
 
-        void renderShadowedScene(GLContext* gl, MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection, bool fromLight = false);
-        void renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowMapContext* sm, bool debug = false);
+        // Incremented by every change of the pose, opening, clipping range, size or emission, i.e.
+        // anything that affects the shadow map or the light it casts. Caches compare against it.
+        U32 getVersion() const { return m_version; }
 
+        void renderShadowedScene(GLContext* gl, MeshWithColors* scene, const Mat4f& worldToCamera, const Mat4f& projection, bool fromLight = false);
+        // GLSL functions of the per-light shading that every shader lighting with shadow maps shares: the spot
+        // light term, the shadow map coordinates and the depth and moment shadow tests. The fragment shaders of
+        // renderShadowedScene() and InstantRadiosity paste it in after their "#version".
+        static const char* getLightingShaderSource();
+        // With a culler, only the parts of the scene inside the light's frustum are drawn.
+        void renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowMapContext* sm, bool debug = false, ShadowCuller* culler = nullptr);
+        // Renders into the light's cell of a shared atlas instead of a texture of its own.
+        void renderShadowMap(FW::GLContext* gl, MeshWithColors* scene, ShadowAtlas* atlas, int slot, ShadowCuller* culler = nullptr);
+        // Number of triangles drawn into the shadow map the last time it was rendered.
+        int getShadowMapTriangles() const { return m_shadowMapTriangles; }
+        // Replaces the shadow map with one rendered elsewhere, e.g. by the ShadowRasterizer; it has to have the
+        // resolution of the context.
+        void uploadShadowMap(ShadowMapContext* sm, const DepthMap& map);
+        // Reads the depth map back from GL, e.g. for prefiltering it on the CPU.
+        void downloadShadowMap(ShadowMapContext* sm, DepthMap& map) const;
+        // Shades with a prefiltered map instead, with its mip chain, until the next depth map is rendered or uploaded.
+        void uploadMomentMap(const PrefilteredShadowMap& map);
+
+        // The perspective frustum of the light. For a paraboloid map it still bounds everything the light
+        // illuminates, so culling uses it in both modes.
         Mat4f getPosToLightClip() const;
+        // World to the light's view space, where the light looks down -z; the paraboloid warp starts from here.
+        Mat4f getPosToLightView() const { return m_xform.inverted(); }
 
-        void sampleEmittedRays(int num, std::vector<Vec3f>& origs, std::vector<Vec3f>& dirs, std::vector<Vec3f>& E_times_pdf) const;
+        // Directions are unit length; trace them with a Ray ending at getFar(). The sampler picks the points
+        // on the unit disk that are lifted to the cone of directions, and the seed its point set.
+        void sampleEmittedRays(int num, std::vector<Vec3f>& origs, std::vector<Vec3f>& dirs, std::vector<Vec3f>& E_times_pdf,
+            SamplerType sampler = SamplerType_Random, U32 seed = 1234) const;
 
         // OpenGL stuff:
         GLuint getShadowTextureHandle() const { return m_shadowMapTexture; }
-        void freeShadowMap() { glDeleteTextures(1, &m_shadowMapTexture); m_shadowMapTexture = 0; }
+        // The moments uploadMomentMap() set and their settings; 0 while the light shades with the depth map.
+        GLuint getMomentTextureHandle() const { return m_momentFilter.filter != ShadowFilter_None ? m_momentTexture : 0; }
+        const ShadowFilterSettings& getMomentFilter() const { return m_momentFilter; }
+        float getMomentDepthScale() const { return m_momentDepthScale; }
+        void freeShadowMap()
+        {
+            if (m_shadowMapTexture) glDeleteTextures(1, &m_shadowMapTexture);
+            if (m_momentTexture) glDeleteTextures(1, &m_momentTexture);
+            m_shadowMapTexture = m_momentTexture = 0;
+            m_momentFilter.filter = ShadowFilter_None;
+        }
     protected:
         static void renderSceneRaw(FW::GLContext* gl, MeshWithColors* scene, GLContext::Program* prog);
+        void renderShadowCasters(FW::GLContext* gl, MeshWithColors* scene, GLContext::Program* prog, ShadowCuller* culler);
+        static GLContext::Program* getDepthProgram(FW::GLContext* gl);
+        void setProjectionUniforms(FW::GLContext* gl, GLContext::Program* prog) const;
 
         Mat4f m_xform; // encodes position and orientation in world space
         Vec2f m_size; // physical size of the emitting surface (ignored in the basic implementation)
@@ -113,8 +206,14 @@ namespace FW
         float m_fov; // field of view in degrees
         float m_near; // near clipping distance
         float m_far; // far clipping distance
+        Projection m_projection; // see Projection
 
         bool m_enabled; // Is the light on, i.e. will we bother to render with it?
         GLuint m_shadowMapTexture; // OpenGL texture handle
+        GLuint m_momentTexture; // prefiltered moments, used when m_momentFilter.filter isn't ShadowFilter_None
+        ShadowFilterSettings m_momentFilter;
+        float m_momentDepthScale;
+        int m_shadowMapTriangles; // see getShadowMapTriangles()
+        U32 m_version; // see getVersion()
     };
 }
@@ -0,0 +1,473 @@
+#include "ShadowRasterizer.hpp"
+
+#include <algorithm>
+#include <limits>
+
+
+namespace FW
+{
+    namespace
+    {
+        const int TileSize = 64;
+        const int BlockSize = 8;
+    }
+
+    struct ShadowRasterizer::Triangle
+    {
+        float a[3], b[3], c[3];     // edge functions e = a * x + b * y + c at pixel centers, positive inside
+        bool inclusive[3];          // top-left rule: pixel centers exactly on the edge are covered
+        float d0, dx, dy;           // window depth plane, d = d0 + dx * x + dy * y
+        float minDepth;
+        Vec2i lo, hi;               // covered pixels, hi exclusive
+    };
+
+    struct ShadowRasterizer::Scratch
+    {
+        std::vector<float> cx, cy, cz, cw;
+        std::vector<Triangle> triangles;
+        std::vector<std::vector<int>> bins;
+        std::vector<float> blockMax;
+    };
+
+    void ShadowGeometry::build(const MeshWithColors& mesh)
+    {
+        int numVertices = mesh.numVertices();
+        x.resize(numVertices);
+        y.resize(numVertices);
+        z.resize(numVertices);
+
+        for (int i = 0; i < numVertices; ++i)
+        {
+            const Vec3f& p = mesh.vertex(i).p;
+            x[i] = p.x;
+            y[i] = p.y;
+            z[i] = p.z;
+        }
+
+        triangles.clear();
+        triangles.reserve(mesh.numTriangles());
+
+        for (int s = 0; s < mesh.numSubmeshes(); ++s)
+        {
+            const Array<Vec3i>& indices = mesh.indices(s);
+            triangles.insert(triangles.end(), indices.getPtr(), indices.getPtr() + indices.getSize());
+        }
+    }
+
+    void ShadowRasterizer::render(const ShadowGeometry& geometry, const Mat4f& posToClip, DepthMap& map) const
+    {
+        render(geometry, std::vector<ShadowRange>(1, geometry.getAll()), posToClip, map);
+    }
+
+    void ShadowRasterizer::render(const ShadowGeometry& geometry, const std::vector<ShadowRange>& ranges, const Mat4f& posToClip, DepthMap& map) const
+    {
+        const Vec2i& size = map.size;
+
+        if (size.min() <= 0)
+        {
+            return;
+        }
+
+        Scratch scratch;
+        setupTriangles(geometry, ranges, posToClip, size, scratch);
+
+        // Bin the triangles into tiles, keeping the submission order within each tile.
+        Vec2i numTiles = (size + Vec2i(TileSize - 1)) / TileSize;
+        scratch.bins.resize(numTiles.x * numTiles.y);
+
+        for (int t = 0; t < (int)scratch.triangles.size(); ++t)
+        {
+            const Triangle& tri = scratch.triangles[t];
+
+            for (int ty = tri.lo.y / TileSize; ty <= (tri.hi.y - 1) / TileSize; ++ty)
+            {
+                for (int tx = tri.lo.x / TileSize; tx <= (tri.hi.x - 1) / TileSize; ++tx)
+                {
+                    scratch.bins[tx + ty * numTiles.x].push_back(t);
+                }
+            }
+        }
+
+        // The farthest depth stored in each block, for rejecting the triangles behind it.
+        Vec2i numBlocks = (size + Vec2i(BlockSize - 1)) / BlockSize;
+        scratch.blockMax.resize(numBlocks.x * numBlocks.y);
+
+        for (int by = 0; by < numBlocks.y; ++by)
+        {
+            for (int bx = 0; bx < numBlocks.x; ++bx)
+            {
+                float farthest = 0.f;
+                for (int y = by * BlockSize; y < FW::min(size.y, (by + 1) * BlockSize); ++y)
+                {
+                    for (int x = bx * BlockSize; x < FW::min(size.x, (bx + 1) * BlockSize); ++x)
+                    {
+                        farthest = FW::max(farthest, map.get(x, y));
+                    }
+                }
+                scratch.blockMax[bx + by * numBlocks.x] = farthest;
+            }
+        }
+
+        for (int ty = 0; ty < numTiles.y; ++ty)
+        {
+            for (int tx = 0; tx < numTiles.x; ++tx)
+            {
+                Vec2i lo(tx * TileSize, ty * TileSize);
+                Vec2i hi = FW::min(lo + Vec2i(TileSize), size);
+
+                for (int t : scratch.bins[tx + ty * numTiles.x])
+                {
+                    rasterizeTile(scratch.triangles[t], lo, hi, map, scratch.blockMax, numBlocks.x);
+                }
+            }
+        }
+    }
+
+    void ShadowRasterizer::renderMany(const ShadowGeometry& geometry, const std::vector<Mat4f>& posToClip, std::vector<DepthMap>& maps) const
+    {
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int)maps.size(); ++i)
+        {
+            render(geometry, posToClip[i], maps[i]);
+        }
+    }
+
+    void ShadowRasterizer::renderMany(const ShadowGeometry& geometry, const std::vector<std::vector<ShadowRange>>& ranges, const std::vector<Mat4f>& posToClip, std::vector<DepthMap>& maps) const
+    {
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int)maps.size(); ++i)
+        {
+            render(geometry, ranges[i], posToClip[i], maps[i]);
+        }
+    }
+
+    void ShadowRasterizer::setupTriangles(const ShadowGeometry& geometry, const std::vector<ShadowRange>& ranges, const Mat4f& posToClip, const Vec2i& size, Scratch& scratch) const
+    {
+        // Transform the vertices of the ranges. The loop reads and writes separate float arrays with no
+        // branches, so the compiler turns it into SIMD code.
+        int numVertices = geometry.getNumVertices();
+        scratch.cx.resize(numVertices);
+        scratch.cy.resize(numVertices);
+        scratch.cz.resize(numVertices);
+        scratch.cw.resize(numVertices);
+
+        const Mat4f& m = posToClip;
+        const float* px = geometry.x.data();
+        const float* py = geometry.y.data();
+        const float* pz = geometry.z.data();
+        float* cx = scratch.cx.data();
+        float* cy = scratch.cy.data();
+        float* cz = scratch.cz.data();
+        float* cw = scratch.cw.data();
+
+        for (const ShadowRange& range : ranges)
+        {
+            int end = range.firstVertex + range.numVertices;
+
+            for (int i = range.firstVertex; i < end; ++i)
+            {
+                cx[i] = m.m00 * px[i] + m.m01 * py[i] + m.m02 * pz[i] + m.m03;
+                cy[i] = m.m10 * px[i] + m.m11 * py[i] + m.m12 * pz[i] + m.m13;
+                cz[i] = m.m20 * px[i] + m.m21 * py[i] + m.m22 * pz[i] + m.m23;
+                cw[i] = m.m30 * px[i] + m.m31 * py[i] + m.m32 * pz[i] + m.m33;
+            }
+        }
+
+        if (m_projection == LightSource::Projection_Paraboloid)
+        {
+            // The warp of the GL depth pass, from the light's view space: the hemisphere in front of the light
+            // to the unit disk, the distance to the light to the depth, and the vertices behind it past the far plane.
+            float depthScale = 2.f / (m_depthRange.y - m_depthRange.x);
+
+            for (const ShadowRange& range : ranges)
+            {
+                int end = range.firstVertex + range.numVertices;
+
+                for (int i = range.firstVertex; i < end; ++i)
+                {
+                    Vec3f v(cx[i], cy[i], cz[i]);
+                    float distance = v.length();
+                    Vec3f d = distance > 0.f ? v / distance : Vec3f(0.f, 0.f, -1.f);
+                    float s = 1.f / FW::max(1.f - d.z, 1e-4f);
+
+                    cx[i] = d.x * s;
+                    cy[i] = d.y * s;
+                    cz[i] = d.z < 0.f ? (distance - m_depthRange.x) * depthScale - 1.f : 2.f;
+                    cw[i] = 1.f;
+                }
+            }
+        }
+
+        scratch.triangles.clear();
+
+        for (const ShadowRange& range : ranges)
+        {
+            int end = range.firstTriangle + range.numTriangles;
+
+            for (int t = range.firstTriangle; t < end; ++t)
+            {
+                const Vec3i& idx = geometry.triangles[t];
+                Vec4f v[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    v[k] = Vec4f(cx[idx[k]], cy[idx[k]], cz[idx[k]], cw[idx[k]]);
+                }
+
+                // entirely outside one of the side planes or the far plane
+                if ((v[0].x > v[0].w && v[1].x > v[1].w && v[2].x > v[2].w) ||
+                    (v[0].x < -v[0].w && v[1].x < -v[1].w && v[2].x < -v[2].w) ||
+                    (v[0].y > v[0].w && v[1].y > v[1].w && v[2].y > v[2].w) ||
+                    (v[0].y < -v[0].w && v[1].y < -v[1].w && v[2].y < -v[2].w) ||
+                    (v[0].z > v[0].w && v[1].z > v[1].w && v[2].z > v[2].w))
+                {
+                    continue;
+                }
+
+                bool inside[3];
+                int numInside = 0;
+                for (int k = 0; k < 3; ++k)
+                {
+                    inside[k] = v[k].z + v[k].w >= 0.f;
+                    numInside += inside[k];
+                }
+
+                if (numInside == 3)
+                {
+                    addTriangle(v[0], v[1], v[2], size, scratch);
+                    continue;
+                }
+
+                if (numInside == 0)
+                {
+                    continue;
+                }
+
+                // Clip against the near plane z = -w; the other planes only need the pixel bounds.
+                Vec4f poly[4];
+                int numPoly = 0;
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    const Vec4f& p = v[k];
+                    const Vec4f& q = v[(k + 1) % 3];
+
+                    if (inside[k])
+                    {
+                        poly[numPoly++] = p;
+                    }
+
+                    if (inside[k] != inside[(k + 1) % 3])
+                    {
+                        float dp = p.z + p.w;
+                        float dq = q.z + q.w;
+                        poly[numPoly++] = p + (q - p) * (dp / (dp - dq));
+                    }
+                }
+
+                for (int k = 1; k + 1 < numPoly; ++k)
+                {
+                    addTriangle(poly[0], poly[k], poly[k + 1], size, scratch);
+                }
+            }
+        }
+    }
+
+    void ShadowRasterizer::addTriangle(const Vec4f& a, const Vec4f& b, const Vec4f& c, const Vec2i& size, Scratch& scratch) const
+    {
+        // to window coordinates and window depth, like the GL viewport transform with glDepthRange(0, 1)
+        Vec3f v[3];
+        const Vec4f* clip[3] = { &a, &b, &c };
+
+        for (int k = 0; k < 3; ++k)
+        {
+            float invW = 1.f / clip[k]->w;
+            v[k] = Vec3f((clip[k]->x * invW * 0.5f + 0.5f) * size.x,
+                (clip[k]->y * invW * 0.5f + 0.5f) * size.y,
+                clip[k]->z * invW * 0.5f + 0.5f);
+        }
+
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+
+        if (!(area != 0.f) || !FW::isFinite(area))
+        {
+            return;
+        }
+
+        bool front = area > 0.f;
+        if ((m_cullMode == CullMode_Front && front) || (m_cullMode == CullMode_Back && !front))
+        {
+            return;
+        }
+
+        // make the winding counterclockwise so that the edge functions are positive inside
+        if (!front)
+        {
+            std::swap(v[1], v[2]);
+            area = -area;
+        }
+
+        Triangle tri;
+
+        Vec2f lo = FW::min(v[0].getXY(), FW::min(v[1].getXY(), v[2].getXY()));
+        Vec2f hi = FW::max(v[0].getXY(), FW::max(v[1].getXY(), v[2].getXY()));
+        lo = FW::clamp(lo, Vec2f(-1.f), Vec2f(size) + 1.f);
+        hi = FW::clamp(hi, Vec2f(-1.f), Vec2f(size) + 1.f);
+
+        // pixel x covers the sample at x + 0.5
+        tri.lo = FW::max(Vec2i((int)FW::ceil(lo.x - 0.5f), (int)FW::ceil(lo.y - 0.5f)), Vec2i(0));
+        tri.hi = FW::min(Vec2i((int)FW::floor(hi.x - 0.5f) + 1, (int)FW::floor(hi.y - 0.5f) + 1), size);
+
+        if (tri.lo.x >= tri.hi.x || tri.lo.y >= tri.hi.y)
+        {
+            return;
+        }
+
+        for (int k = 0; k < 3; ++k)
+        {
+            const Vec3f& p = v[(k + 1) % 3];
+            const Vec3f& q = v[(k + 2) % 3];
+
+            tri.a[k] = p.y - q.y;
+            tri.b[k] = q.x - p.x;
+            tri.c[k] = -(tri.a[k] * p.x + tri.b[k] * p.y);
+            tri.inclusive[k] = tri.a[k] > 0.f || (tri.a[k] == 0.f && tri.b[k] < 0.f);
+        }
+
+        // Window depth is affine in window coordinates.
+        Vec3f e1 = v[1] - v[0];
+        Vec3f e2 = v[2] - v[0];
+        tri.dx = (e1.z * e2.y - e2.z * e1.y) / area;
+        tri.dy = (e1.x * e2.z - e2.x * e1.z) / area;
+        tri.d0 = v[0].z - tri.dx * v[0].x - tri.dy * v[0].y;
+        tri.minDepth = FW::min(v[0].z, FW::min(v[1].z, v[2].z));
+
+        scratch.triangles.push_back(tri);
+    }
+
+    void ShadowRasterizer::rasterizeTile(const Triangle& tri, const Vec2i& tileLo, const Vec2i& tileHi, DepthMap& map,
+        std::vector<float>& blockMax, int blocksPerRow)
+    {
+        Vec2i lo = FW::max(tri.lo, tileLo);
+        Vec2i hi = FW::min(tri.hi, tileHi);
+
+        for (int y0 = lo.y; y0 < hi.y; y0 = (y0 / BlockSize + 1) * BlockSize)
+        {
+            int y1 = FW::min(hi.y, (y0 / BlockSize + 1) * BlockSize);
+
+            for (int x0 = lo.x; x0 < hi.x; x0 = (x0 / BlockSize + 1) * BlockSize)
+            {
+                int x1 = FW::min(hi.x, (x0 / BlockSize + 1) * BlockSize);
+
+                // The edge functions and the depth are linear, so their extremes over the pixel centers of
+                // the block are at its corner pixels.
+                float cornerX[2] = { x0 + 0.5f, x1 - 0.5f };
+                float cornerY[2] = { y0 + 0.5f, y1 - 0.5f };
+                bool outside = false;
+                bool inside = true;
+
+                for (int k = 0; k < 3 && !outside; ++k)
+                {
+                    float emin = std::numeric_limits<float>::max();
+                    float emax = -std::numeric_limits<float>::max();
+
+                    for (int cy = 0; cy < 2; ++cy)
+                    {
+                        for (int cx = 0; cx < 2; ++cx)
+                        {
+                            float e = tri.a[k] * cornerX[cx] + tri.b[k] * cornerY[cy] + tri.c[k];
+                            emin = FW::min(emin, e);
+                            emax = FW::max(emax, e);
+                        }
+                    }
+
+                    outside = emax < 0.f;
+                    inside = inside && emin > 0.f;
+                }
+
+                if (outside)
+                {
+                    continue;
+                }
+
+                float nearest = std::numeric_limits<float>::max();
+                for (int cy = 0; cy < 2; ++cy)
+                {
+                    for (int cx = 0; cx < 2; ++cx)
+                    {
+                        nearest = FW::min(nearest, tri.d0 + tri.dx * cornerX[cx] + tri.dy * cornerY[cy]);
+                    }
+                }
+
+                int block = x0 / BlockSize + (y0 / BlockSize) * blocksPerRow;
+
+                if (FW::max(nearest, tri.minDepth) >= blockMax[block])
+                {
+                    continue;
+                }
+
+                bool written = false;
+
+                for (int y = y0; y < y1; ++y)
+                {
+                    float py = y + 0.5f;
+                    float* row = &map.depth[y * map.size.x];
+
+                    for (int x = x0; x < x1; ++x)
+                    {
+                        float px = x + 0.5f;
+                        bool covered = inside;
+
+                        if (!covered)
+                        {
+                            covered = true;
+                            for (int k = 0; k < 3; ++k)
+                            {
+                                float e = tri.a[k] * px + tri.b[k] * py + tri.c[k];
+                                covered = covered && (e > 0.f || (e == 0.f && tri.inclusive[k]));
+                            }
+                        }
+
+                        float d = tri.d0 + tri.dx * px + tri.dy * py;
+
+                        if (covered && d < row[x])
+                        {
+                            row[x] = d;
+                            written = true;
+                        }
+                    }
+                }
+
+                if (written)
+                {
+                    // the whole block, not just the part this triangle covered
+                    int bx0 = (x0 / BlockSize) * BlockSize;
+                    int by0 = (y0 / BlockSize) * BlockSize;
+                    float farthest = 0.f;
+
+                    for (int y = by0; y < FW::min(map.size.y, by0 + BlockSize); ++y)
+                    {
+                        for (int x = bx0; x < FW::min(map.size.x, bx0 + BlockSize); ++x)
+                        {
+                            farthest = FW::max(farthest, map.get(x, y));
+                        }
+                    }
+
+                    blockMax[block] = farthest;
+                }
+            }
+        }
+    }
+
+    float lookupShadow(const DepthMap& map, const Mat4f& posToLightClip, const Vec3f& p)
+    {
+        Vec4f clip = posToLightClip * Vec4f(p, 1.f);
+        Vec2f uv = 0.5f * clip.getXY() / clip.w + 0.5f;
+        float depth = clip.z / clip.w;
+
+        // nearest filtering with GL_CLAMP
+        int x = FW::clamp((int)FW::floor(uv.x * map.size.x), 0, map.size.x - 1);
+        int y = FW::clamp((int)FW::floor(uv.y * map.size.y), 0, map.size.y - 1);
+
+        return 2.f * map.get(x, y) - 1.f < depth ? 0.f : 1.f;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+
+#include "ShadowMap.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // A run of consecutive triangles of a ShadowGeometry, and the consecutive vertices they use.
+    struct ShadowRange
+    {
+        int firstTriangle, numTriangles;
+        int firstVertex, numVertices;
+    };
+
+    // The scene as the shadow rasterizer reads it: positions in separate coordinate arrays, so the
+    // vertex transform runs over contiguous floats, and one index triple per triangle.
+    struct ShadowGeometry
+    {
+        std::vector<float> x, y, z;
+        std::vector<Vec3i> triangles;
+
+        void build(const MeshWithColors& mesh);
+        int getNumVertices() const { return (int)x.size(); }
+        int getNumTriangles() const { return (int)triangles.size(); }
+        bool empty() const { return triangles.empty(); }
+        ShadowRange getAll() const { ShadowRange r = { 0, getNumTriangles(), 0, getNumVertices() }; return r; }
+    };
+
+    // A depth buffer as the GL shadow pass leaves it in the depth texture: window depth in [0, 1],
+    // cleared to 1, row 0 at the bottom.
+    struct DepthMap
+    {
+        Vec2i size;
+        std::vector<float> depth;
+
+        DepthMap() : size(0, 0) {}
+        void clear(const Vec2i& s) { size = s; depth.assign(s.x * s.y, 1.f); }
+        float get(int x, int y) const { return depth[x + y * size.x]; }
+    };
+
+    // Depth-only software rasterizer for shadow maps. Follows the GL shadow pass of renderShadowMap():
+    // the same posToLightClip transform, near plane clipping, front face culling, pixel center sampling
+    // and GL_LESS depth test, so its maps can be uploaded or looked up in place of the GL ones.
+    //
+    // Triangles are binned into 64x64 pixel tiles; within a tile, 8x8 pixel blocks are classified against
+    // the edge functions first, so blocks outside a triangle cost three corner tests, blocks inside it skip
+    // the edge tests, and blocks whose stored depth is already nearer than the triangle are skipped.
+    class ShadowRasterizer
+    {
+    public:
+        enum CullMode
+        {
+            CullMode_None = 0,
+            CullMode_Front,         // counterclockwise in window coordinates is front, like the GL default
+            CullMode_Back,
+        };
+
+        ShadowRasterizer() : m_cullMode(CullMode_Front), m_projection(LightSource::Projection_Perspective), m_depthRange(0.f) {}
+
+        void setCullMode(CullMode mode) { m_cullMode = mode; }
+        CullMode getCullMode() const { return m_cullMode; }
+
+        // With the paraboloid projection, the posToClip matrices given to render() are the lights' view
+        // transforms instead, and the vertices are warped like in the GL depth pass; depthRange holds the
+        // lights' near and far distances.
+        void setProjection(LightSource::Projection projection, const Vec2f& depthRange = Vec2f(0.f)) { m_projection = projection; m_depthRange = depthRange; }
+
+        // Renders into map, which keeps its size; clear() it first to set one.
+        void render(const ShadowGeometry& geometry, const Mat4f& posToClip, DepthMap& map) const;
+        // The same for only the given ranges of the geometry, e.g. the ones ShadowCuller found in the frustum.
+        // Only the vertices of the ranges are transformed.
+        void render(const ShadowGeometry& geometry, const std::vector<ShadowRange>& ranges, const Mat4f& posToClip, DepthMap& map) const;
+
+        // Renders every map, one per worker thread; optionally with the ranges of each map.
+        void renderMany(const ShadowGeometry& geometry, const std::vector<Mat4f>& posToClip, std::vector<DepthMap>& maps) const;
+        void renderMany(const ShadowGeometry& geometry, const std::vector<std::vector<ShadowRange>>& ranges, const std::vector<Mat4f>& posToClip, std::vector<DepthMap>& maps) const;
+
+    private:
+        struct Triangle;
+        struct Scratch;
+
+        void setupTriangles(const ShadowGeometry& geometry, const std::vector<ShadowRange>& ranges, const Mat4f& posToClip, const Vec2i& size, Scratch& scratch) const;
+        void addTriangle(const Vec4f& a, const Vec4f& b, const Vec4f& c, const Vec2i& size, Scratch& scratch) const;
+        static void rasterizeTile(const Triangle& tri, const Vec2i& lo, const Vec2i& hi, DepthMap& map, std::vector<float>& blockMax, int blocksPerRow);
+
+        CullMode m_cullMode;
+        LightSource::Projection m_projection;
+        Vec2f m_depthRange;
+    };
+
+    // The shadow test of the MeshBase::draw_generic shader against a map: 1 if the point is lit, 0 if not.
+    float lookupShadow(const DepthMap& map, const Mat4f& posToLightClip, const Vec3f& p);
+}
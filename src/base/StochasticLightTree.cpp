@@ -0,0 +1,136 @@
+#include "StochasticLightTree.hpp"
+
+#include "base/Random.hpp"
+
+
+namespace FW
+{
+    void StochasticLightTree::shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, int frameIndex,
+        std::vector<Vec3f>& image) const
+    {
+        const Vec2i& size = gbuffer.getSize();
+        image.assign(gbuffer.getNumPixels(), Vec3f(0.f));
+
+#pragma omp parallel for schedule(dynamic)
+        for (int y = 0; y < size.y; ++y)
+        {
+            // One generator per row and frame keeps the result independent of the thread scheduling.
+            Random rand(U32(y) * 9781u + U32(frameIndex) * 6271u + 1234u);
+
+            for (int x = 0; x < size.x; ++x)
+            {
+                const GBufferSample& s = gbuffer.get(x, y);
+
+                if (!s.valid)
+                {
+                    continue;
+                }
+
+                Vec3f irradiance(0.f);
+
+                Vec3f direct = evalVpl(mainLight, s.position, s.normal);
+                if (direct.max() > 0.f && isVisible(rt, s, mainLight.position))
+                {
+                    irradiance += direct;
+                }
+
+                Vec3f indirect(0.f);
+
+                for (int i = 0; i < m_samplesPerPixel; ++i)
+                {
+                    int vplIdx;
+                    float pdf;
+
+                    if (!sampleLight(s, rand, vplIdx, pdf))
+                    {
+                        break;
+                    }
+
+                    const Vpl& vpl = m_tree.getVpls()[vplIdx];
+                    Vec3f contribution = evalVpl(vpl, s.position, s.normal);
+
+                    if (contribution.max() > 0.f && isVisible(rt, s, vpl.position))
+                    {
+                        indirect += contribution / pdf;
+                    }
+                }
+
+                image[x + y * size.x] = s.albedo * (irradiance + indirect / float(m_samplesPerPixel));
+            }
+        }
+    }
+
+    bool StochasticLightTree::sampleLight(const GBufferSample& s, Random& rand, int& vplIdx, float& pdf) const
+    {
+        if (m_tree.empty())
+        {
+            return false;
+        }
+
+        const std::vector<LightTree::Node>& nodes = m_tree.getNodes();
+        auto importance = [&](const LightTree::Node& node)
+        {
+            return (node.E.x + node.E.y + node.E.z) * LightTree::geometryBound(node, s.position, s.normal);
+        };
+
+        const LightTree::Node* node = &m_tree.getRoot();
+        pdf = 1.f;
+
+        // The bounds are conservative, so a child with zero importance really contributes nothing
+        // and skipping it keeps the estimate unbiased.
+        while (!node->isLeaf())
+        {
+            float left = importance(nodes[node->left]);
+            float right = importance(nodes[node->right]);
+
+            if (left + right <= 0.f)
+            {
+                return false;
+            }
+
+            float pLeft = left / (left + right);
+
+            if (rand.getF32() < pLeft)
+            {
+                pdf *= pLeft;
+                node = &nodes[node->left];
+            }
+            else
+            {
+                pdf *= 1.f - pLeft;
+                node = &nodes[node->right];
+            }
+        }
+
+        vplIdx = node->representative;
+        return pdf > 0.f;
+    }
+
+    void AccumulationBuffer::add(const std::vector<Vec3f>& image)
+    {
+        if (m_sum.size() != image.size())
+        {
+            m_sum.assign(image.size(), Vec3f(0.f));
+            m_numFrames = 0;
+        }
+
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            m_sum[i] += image[i];
+        }
+
+        ++m_numFrames;
+    }
+
+    void AccumulationBuffer::resolve(std::vector<Vec3f>& average) const
+    {
+        average.resize(m_sum.size());
+
+        float scale = m_numFrames > 0 ? 1.f / m_numFrames : 0.f;
+
+        for (size_t i = 0; i < m_sum.size(); ++i)
+        {
+            average[i] = m_sum[i] * scale;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+
+#include "Lightcuts.hpp"
+
+#include <vector>
+
+
+namespace FW
+{
+    // Stochastic many-light shading: every pixel picks a few VPLs by walking down the light tree,
+    // choosing each child with probability proportional to its power times the bound of its geometry
+    // term at the pixel, and traces a shadow ray to each. Dividing by the probability of the walk makes
+    // the estimate unbiased; the cost per pixel does not depend on the number of VPLs.
+    class StochasticLightTree
+    {
+    public:
+        StochasticLightTree() : m_samplesPerPixel(4) {}
+
+        void setSamplesPerPixel(int n) { m_samplesPerPixel = FW::max(1, n); }
+        int getSamplesPerPixel() const { return m_samplesPerPixel; }
+
+        void build(const std::vector<Vpl>& vpls) { m_tree.build(vpls); }
+        const LightTree& getTree() const { return m_tree; }
+
+        // Shades the G-buffer with the main light (exactly) and sampled VPLs. frameIndex seeds the
+        // random numbers, so successive frames give independent estimates that can be averaged.
+        void shade(const RayTracer& rt, const GBuffer& gbuffer, const Vpl& mainLight, int frameIndex,
+            std::vector<Vec3f>& image) const;
+
+    private:
+        // Walks from the root to a leaf; returns false if no light can contribute to the point.
+        bool sampleLight(const GBufferSample& s, Random& rand, int& vplIdx, float& pdf) const;
+
+        LightTree m_tree;
+        int m_samplesPerPixel;
+    };
+
+
+    // Running sum of successive estimates of the same image, for progressive rendering.
+    // The owner resets it whenever something that affects the image changes.
+    class AccumulationBuffer
+    {
+    public:
+        AccumulationBuffer() : m_numFrames(0) {}
+
+        void reset() { m_sum.clear(); m_numFrames = 0; }
+        void add(const std::vector<Vec3f>& image);
+        void resolve(std::vector<Vec3f>& average) const;
+
+        int getNumFrames() const { return m_numFrames; }
+
+    private:
+        std::vector<Vec3f> m_sum;
+        int m_numFrames;
+    };
+}
@@ -19,6 +19,11 @@ namespace FW {
         SplitMode_Linear
     };
 
+    enum IntersectMode {
+        IntersectMode_Woop,         // affine transform test, strict inside test on the barycentrics
+        IntersectMode_Watertight    // sheared ray space test, no cracks on shared edges and vertices
+    };
+
     struct Plane : public Vec4f {
         inline float dot(const Vec3f& p) const {
             return p.x * x + p.y * y + p.z * z + w;
@@ -30,6 +35,7 @@ namespace FW {
         Vec3f min, max;
         inline AABB() : min(), max() {}
         inline AABB(const Vec3f& min, const Vec3f& max) : min(min), max(max) {}
+        inline const Vec3f& operator[](int i) const { return i ? max : min; } // 0: min corner, 1: max corner
         inline F32 area() const {
             Vec3f d(max - min);
             return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);